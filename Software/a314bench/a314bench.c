@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+// Measures the A314 physical channel from the Amiga side, against the
+// services that are built into a314d:
+//   a314bench echo [SIZE] [COUNT]     round trip time of SIZE byte packets
+//   a314bench sink [SIZE] [COUNT]     Amiga to Pi throughput
+//   a314bench source [SIZE] [COUNT]   Pi to Amiga throughput
+
+#include <exec/types.h>
+#include <exec/ports.h>
+#include <exec/memory.h>
+
+#include <libraries/dos.h>
+
+#include <proto/dos.h>
+#include <proto/exec.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../a314device/a314.h"
+#include "../a314device/proto_a314.h"
+
+#define MAX_PACKET_SIZE 252
+
+struct MsgPort *sync_mp;
+struct A314_IORequest *sync_ior;
+
+struct Library *A314Base;
+
+ULONG socket;
+
+UBYTE *buffer;
+
+BYTE a314_cmd(UWORD cmd, UBYTE *buf, int length)
+{
+	sync_ior->a314_Request.io_Message.mn_ReplyPort = sync_mp;
+	sync_ior->a314_Request.io_Command = cmd;
+	sync_ior->a314_Request.io_Error = 0;
+	sync_ior->a314_Socket = socket;
+	sync_ior->a314_Buffer = buf;
+	sync_ior->a314_Length = length;
+	DoIO((struct IORequest *)sync_ior);
+	return sync_ior->a314_Request.io_Error;
+}
+
+ULONG ticks_since(struct DateStamp *start)
+{
+	struct DateStamp now;
+	DateStamp(&now);
+	return (now.ds_Days - start->ds_Days) * 24 * 60 * 60 * TICKS_PER_SECOND
+		+ (now.ds_Minute - start->ds_Minute) * 60 * TICKS_PER_SECOND
+		+ (now.ds_Tick - start->ds_Tick);
+}
+
+ULONG get_be32(UBYTE *p)
+{
+	return ((ULONG)p[0] << 24) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 8) | p[3];
+}
+
+void print_rate(ULONG bytes, ULONG ticks)
+{
+	if (ticks == 0)
+		ticks = 1;
+	printf("%lu bytes in %lu ms, %lu bytes/s\n", bytes, ticks * 1000 / TICKS_PER_SECOND, bytes / ticks * TICKS_PER_SECOND);
+}
+
+int run_echo(int size, ULONG count)
+{
+	struct DateStamp start;
+	DateStamp(&start);
+
+	for (ULONG i = 0; i < count; i++)
+	{
+		if (a314_cmd(A314_WRITE, buffer, size) != A314_WRITE_OK)
+			return 1;
+		if (a314_cmd(A314_READ, buffer, 255) != A314_READ_OK)
+			return 1;
+	}
+
+	ULONG ticks = ticks_since(&start);
+	if (ticks == 0)
+		ticks = 1;
+
+	printf("%lu round trips of %d bytes in %lu ms, %lu us per round trip\n", count, size, ticks * 1000 / TICKS_PER_SECOND, ticks * (1000000 / TICKS_PER_SECOND) / count);
+	return 0;
+}
+
+int run_sink(int size, ULONG count)
+{
+	for (ULONG i = 0; i < count; i++)
+		if (a314_cmd(A314_WRITE, buffer, size) != A314_WRITE_OK)
+			return 1;
+
+	if (a314_cmd(A314_EOS, NULL, 0) != A314_EOS_OK)
+		return 1;
+
+	if (a314_cmd(A314_READ, buffer, 255) != A314_READ_OK || sync_ior->a314_Length != 8)
+		return 1;
+
+	ULONG bytes = get_be32(buffer);
+	ULONG elapsed_us = get_be32(buffer + 4);
+	if (elapsed_us == 0)
+		elapsed_us = 1;
+
+	printf("Pi received %lu bytes in %lu ms, %lu bytes/s\n", bytes, elapsed_us / 1000, (ULONG)((double)bytes * 1000000.0 / elapsed_us));
+
+	a314_cmd(A314_READ, buffer, 255);
+	return 0;
+}
+
+int run_source(int size, ULONG count)
+{
+	buffer[0] = (UBYTE)size;
+	buffer[1] = (UBYTE)(count >> 24);
+	buffer[2] = (UBYTE)(count >> 16);
+	buffer[3] = (UBYTE)(count >> 8);
+	buffer[4] = (UBYTE)count;
+
+	struct DateStamp start;
+	DateStamp(&start);
+
+	if (a314_cmd(A314_WRITE, buffer, 5) != A314_WRITE_OK)
+		return 1;
+
+	ULONG bytes = 0;
+	while (1)
+	{
+		BYTE res = a314_cmd(A314_READ, buffer, 255);
+		if (res == A314_READ_EOS)
+			break;
+		else if (res != A314_READ_OK)
+			return 1;
+		bytes += sync_ior->a314_Length;
+	}
+
+	print_rate(bytes, ticks_since(&start));
+
+	a314_cmd(A314_EOS, NULL, 0);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *mode = argc > 1 ? argv[1] : "echo";
+	int size = argc > 2 ? atoi(argv[2]) : 64;
+	ULONG count = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+
+	char service_name[32];
+	if (strcmp(mode, "echo") != 0 && strcmp(mode, "sink") != 0 && strcmp(mode, "source") != 0)
+	{
+		printf("Usage: a314bench [echo|sink|source] [SIZE] [COUNT]\n");
+		return 0;
+	}
+
+	if (size < 1)
+		size = 1;
+	else if (size > MAX_PACKET_SIZE)
+		size = MAX_PACKET_SIZE;
+
+	if (count == 0)
+		count = 1;
+
+	sprintf(service_name, "a314bench-%s", mode);
+
+	sync_mp = CreatePort(NULL, 0);
+	if (sync_mp == NULL)
+	{
+		printf("Unable to create sync reply message port\n");
+		return 0;
+	}
+
+	sync_ior = (struct A314_IORequest *)CreateExtIO(sync_mp, sizeof(struct A314_IORequest));
+	if (sync_ior == NULL)
+	{
+		printf("Unable to create io request\n");
+		DeletePort(sync_mp);
+		return 0;
+	}
+
+	if (OpenDevice(A314_NAME, 0, (struct IORequest *)sync_ior, 0) != 0)
+	{
+		printf("Unable to open a314.device\n");
+		DeleteExtIO((struct IORequest *)sync_ior);
+		DeletePort(sync_mp);
+		return 0;
+	}
+
+	A314Base = &(sync_ior->a314_Request.io_Device->dd_Library);
+
+	buffer = AllocMem(256, 0);
+	for (int i = 0; i < 256; i++)
+		buffer[i] = (UBYTE)i;
+
+	socket = time(NULL);
+
+	if (a314_cmd(A314_CONNECT, service_name, strlen(service_name)) != A314_CONNECT_OK)
+	{
+		printf("Unable to connect to %s\n", service_name);
+	}
+	else
+	{
+		int res;
+		if (strcmp(mode, "echo") == 0)
+			res = run_echo(size, count);
+		else if (strcmp(mode, "sink") == 0)
+			res = run_sink(size, count);
+		else
+			res = run_source(size, count);
+
+		if (res != 0)
+		{
+			printf("Stream closed by a314d\n");
+			a314_cmd(A314_RESET, NULL, 0);
+		}
+	}
+
+	FreeMem(buffer, 256);
+
+	CloseDevice((struct IORequest *)sync_ior);
+	DeleteExtIO((struct IORequest *)sync_ior);
+	DeletePort(sync_mp);
+	return 0;
+}
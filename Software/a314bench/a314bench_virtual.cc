@@ -0,0 +1,576 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+// Runs the a314bench measurements against a314d without an Amiga. The
+// Amiga side is played by SimAmiga on a virtual A314 board, and talks to
+// the a314bench-echo, a314bench-sink and a314bench-source services that
+// are built into a314d, so no Pi side client is involved either:
+//   echo    every stream keeps one packet in flight and measures its
+//           round trip time
+//   sink    every stream writes packets as fast as A2R takes them, and
+//           finally reads back how much a314d counted
+//   source  every stream asks a314d for packets, and reads them as fast
+//           as R2A delivers them
+// A transfer that is larger than a packet can carry is sent as several
+// packets, so --size can be compared with and without --jumbo.
+//
+// --probe adds an echo stream of small packets, whose latency is measured
+// while the other streams load the channel. With --qos the probe is in the
+// interactive class and the other streams are bulk, each class on its own
+// ring pair; without it they all share one.
+//
+// --stall adds a source stream that the Amiga never reads, like an
+// application that has stopped reading its socket. With --credit a314d
+// stops sending on it once its window is used up, and without it a314d
+// keeps sending, and the Amiga has to hold everything.
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../a314sim/sim_amiga.h"
+
+#define MODE_ECHO               0
+#define MODE_SINK               1
+#define MODE_SOURCE             2
+
+static const char *mode_names[] = {"echo", "sink", "source"};
+
+struct Stream
+{
+    bool connected;
+    bool done;
+    uint64_t sent_at;
+    uint64_t bytes;
+    int awaiting;
+    bool probe;
+    bool stalled;
+};
+
+#define PROBE_SIZE              16
+
+static const char *board = "a314bench";
+static int server_port = 7110;
+static const char *spawn_path = nullptr;
+static pid_t daemon_pid = 0;
+static int mode = MODE_ECHO;
+static int packet_size = 64;
+static int stream_count = 1;
+static double duration = 5.0;
+static uint32_t source_count = 0;
+static bool json_output = false;
+static int ring_size = 0;
+static bool jumbo = false;
+static bool qos = false;
+static bool probe = false;
+static bool credit = false;
+static int window_size = 0;
+static bool stall = false;
+
+static VirtualA314 amiga_board;
+static SimAmiga *amiga;
+
+static std::map<int, Stream> streams;
+static int open_streams = 0;
+
+static std::vector<uint32_t> latencies_us;
+static std::vector<uint32_t> probe_latencies_us;
+static uint64_t pi_bytes = 0;
+static uint64_t pi_elapsed_us = 0;
+static size_t stalled_held_bytes = 0;
+
+static uint8_t payload[SIM_MAX_RING_SIZE];
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// Writes one transfer of packet_size bytes, in as few packets as a314d has
+// agreed to.
+static void write_transfer(int s)
+{
+    int max_payload = amiga->max_payload();
+    for (int pos = 0; pos < packet_size; pos += max_payload)
+        amiga->write(s, payload + pos, std::min(max_payload, packet_size - pos));
+}
+
+static void close_stream(int s)
+{
+    Stream &st = streams[s];
+    if (!st.done)
+    {
+        st.done = true;
+        open_streams--;
+    }
+}
+
+static void on_connect_response(int s, int result)
+{
+    Stream &st = streams[s];
+    if (result != 0)
+    {
+        fprintf(stderr, "Unable to connect to a314bench-%s, result %d\n", st.probe ? "echo" : mode_names[mode], result);
+        close_stream(s);
+        return;
+    }
+
+    st.connected = true;
+
+    if (st.stalled)
+    {
+        amiga->pause(s, true);
+
+        uint8_t request[6] = {(uint8_t)(packet_size >> 8), (uint8_t)packet_size, 0xff, 0xff, 0xff, 0xff};
+        amiga->write(s, request, sizeof(request));
+    }
+    else if (mode == MODE_SOURCE && !st.probe)
+    {
+        uint8_t request[6];
+        request[0] = packet_size >> 8;
+        request[1] = packet_size;
+        request[2] = source_count >> 24;
+        request[3] = source_count >> 16;
+        request[4] = source_count >> 8;
+        request[5] = source_count;
+        amiga->write(s, request, sizeof(request));
+        st.sent_at = monotonic_ns();
+    }
+}
+
+static void on_data(int s, const uint8_t *data, int length)
+{
+    Stream &st = streams[s];
+    st.bytes += length;
+
+    if (st.probe)
+    {
+        probe_latencies_us.push_back((monotonic_ns() - st.sent_at) / 1000);
+        st.sent_at = 0;
+    }
+    else if (mode == MODE_ECHO)
+    {
+        st.awaiting -= length;
+        if (st.awaiting <= 0)
+        {
+            latencies_us.push_back((monotonic_ns() - st.sent_at) / 1000);
+            st.sent_at = 0;
+        }
+    }
+    else if (mode == MODE_SINK && length == 8)
+    {
+        pi_bytes += get_be32(data);
+        pi_elapsed_us = std::max<uint64_t>(pi_elapsed_us, get_be32(data + 4));
+    }
+}
+
+static void on_eos(int s)
+{
+    Stream &st = streams[s];
+    if (mode == MODE_SOURCE && !st.probe)
+    {
+        pi_elapsed_us = std::max<uint64_t>(pi_elapsed_us, (monotonic_ns() - st.sent_at) / 1000);
+        amiga->eos(s);
+    }
+    close_stream(s);
+}
+
+static void on_reset(int s)
+{
+    fprintf(stderr, "Stream %d was reset by a314d\n", s);
+    close_stream(s);
+}
+
+static void run()
+{
+    uint64_t end = monotonic_ns() + (uint64_t)(duration * 1e9);
+    bool stopping = false;
+
+    while (open_streams != 0)
+    {
+        uint64_t now = monotonic_ns();
+
+        if (!stopping && now >= end)
+        {
+            stopping = true;
+            stalled_held_bytes = amiga->held_bytes();
+            for (auto &e : streams)
+            {
+                if (e.second.done)
+                    continue;
+                if (e.second.stalled)
+                {
+                    amiga->reset(e.first);
+                    close_stream(e.first);
+                }
+                else if (mode == MODE_SOURCE && !e.second.probe)
+                {
+                    pi_elapsed_us = std::max<uint64_t>(pi_elapsed_us, (now - e.second.sent_at) / 1000);
+                    amiga->reset(e.first);
+                    close_stream(e.first);
+                }
+                else
+                    amiga->eos(e.first);
+            }
+        }
+
+        if (!stopping)
+        {
+            for (auto &e : streams)
+            {
+                Stream &st = e.second;
+                if (!st.connected || st.done || st.stalled)
+                    continue;
+
+                if (st.probe)
+                {
+                    if (st.sent_at == 0)
+                    {
+                        st.sent_at = monotonic_ns();
+                        amiga->write(e.first, payload, PROBE_SIZE);
+                    }
+                }
+                else if (mode == MODE_ECHO && st.sent_at == 0)
+                {
+                    st.sent_at = monotonic_ns();
+                    st.awaiting = packet_size;
+                    write_transfer(e.first);
+                }
+                else if (mode == MODE_SINK)
+                {
+                    // Keep a few packets queued, so that A2R never runs dry
+                    // while waiting for a314d to make room.
+                    for (int i = 0; i < 4 && amiga->queued_packets() < streams.size() * 4; i++)
+                        write_transfer(e.first);
+                }
+            }
+        }
+
+        amiga->service();
+
+        // A sink that has room to queue more goes straight on. With larger
+        // rings everything queued may fit in A2R, and then a314d has no
+        // reason to interrupt. So does an echo stream whose round trip was
+        // completed by service() above.
+        bool more = false;
+        if (mode == MODE_SINK)
+            more = !stopping && amiga->queued_packets() < streams.size() * 4;
+        if (!stopping)
+        {
+            for (auto &e : streams)
+            {
+                const Stream &st = e.second;
+                if ((mode == MODE_ECHO || st.probe) && st.connected && !st.done && st.sent_at == 0)
+                    more = true;
+            }
+        }
+
+        struct pollfd pfd;
+        pfd.fd = amiga->irq_fd();
+        pfd.events = POLLIN;
+        poll(&pfd, 1, more ? 0 : 10);
+
+        if (pfd.revents & POLLIN)
+            amiga->service();
+    }
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, int p)
+{
+    if (v.empty())
+        return 0;
+    return v[std::min(v.size() - 1, v.size() * p / 100)];
+}
+
+static void print_report(double elapsed)
+{
+    std::sort(latencies_us.begin(), latencies_us.end());
+    uint32_t max = latencies_us.empty() ? 0 : latencies_us.back();
+
+    double seconds = mode == MODE_ECHO ? elapsed : pi_elapsed_us / 1e6;
+    uint64_t bytes = pi_bytes;
+    if (mode != MODE_SINK)
+        for (auto &e : streams)
+            if (!e.second.probe && !e.second.stalled)
+                bytes += e.second.bytes;
+    double rate = seconds > 0 ? bytes / seconds : 0;
+
+    std::sort(probe_latencies_us.begin(), probe_latencies_us.end());
+    uint32_t probe_max = probe_latencies_us.empty() ? 0 : probe_latencies_us.back();
+
+    if (json_output)
+    {
+        printf("{\"mode\": \"%s\", \"size\": %d, \"streams\": %d, \"seconds\": %.3f, \"bytes\": %llu, \"bytes_per_sec\": %.0f, "
+                "\"round_trips\": %zu, \"latency_us_p50\": %u, \"latency_us_p99\": %u, \"latency_us_max\": %u, \"irqs\": %llu, \"r2a_ring\": %d, \"max_payload\": %d, "
+                "\"ring_pairs\": %d, \"probe_round_trips\": %zu, \"probe_latency_us_p50\": %u, \"probe_latency_us_p99\": %u, \"probe_latency_us_max\": %u, "
+                "\"flow_control\": %s, \"stalled_held_bytes\": %zu, \"amiga_credit_stalls\": %llu}\n",
+                mode_names[mode], packet_size, stream_count, seconds, (unsigned long long)bytes, rate,
+                latencies_us.size(), percentile(latencies_us, 50), percentile(latencies_us, 99), max,
+                (unsigned long long)amiga->irqs_raised, amiga->r2a_size(), amiga->max_payload(), amiga->ring_pairs(),
+                probe_latencies_us.size(), percentile(probe_latencies_us, 50), percentile(probe_latencies_us, 99), probe_max,
+                amiga->flow_control() ? "true" : "false", stalled_held_bytes, (unsigned long long)amiga->credit_stalls);
+    }
+    else
+    {
+        printf("Mode:         %s, %d byte transfers, %d streams\n", mode_names[mode], packet_size, stream_count);
+        if (mode == MODE_ECHO)
+        {
+            printf("Round trips:  %zu in %.3f s\n", latencies_us.size(), seconds);
+            printf("Latency:      p50 %u us, p99 %u us, max %u us\n", percentile(latencies_us, 50), percentile(latencies_us, 99), max);
+        }
+        else
+            printf("Throughput:   %llu bytes in %.3f s, %.1f KB/s\n", (unsigned long long)bytes, seconds, rate / 1024);
+        if (probe)
+            printf("Probe:        %zu round trips, p50 %u us, p99 %u us, max %u us\n", probe_latencies_us.size(),
+                    percentile(probe_latencies_us, 50), percentile(probe_latencies_us, 99), probe_max);
+        if (stall)
+            printf("Stalled:      %zu bytes held for the stream that isn't read\n", stalled_held_bytes);
+        printf("Amiga IRQs:   %llu\n", (unsigned long long)amiga->irqs_raised);
+        printf("Rings:        %d byte A2R, %d byte R2A, packets of up to %d bytes, %d pair%s\n", amiga->a2r_size(), amiga->r2a_size(),
+                amiga->max_payload(), amiga->ring_pairs(), amiga->ring_pairs() == 1 ? "" : "s");
+        if (amiga->flow_control())
+            printf("Credit:       per-channel flow control, the Amiga waited for credit %llu times\n",
+                    (unsigned long long)amiga->credit_stalls);
+    }
+}
+
+static bool wait_for_daemon()
+{
+    for (int retry = 0; retry < 200; retry++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        struct sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(server_port);
+
+        int res = connect(fd, (struct sockaddr *)&address, sizeof(address));
+        close(fd);
+        if (res == 0)
+            return true;
+
+        usleep(10000);
+    }
+    return false;
+}
+
+static void spawn_daemon()
+{
+    daemon_pid = fork();
+    if (daemon_pid == 0)
+    {
+        std::string port = std::to_string(server_port);
+        execl(spawn_path, spawn_path, "--virtual", board, "--port", port.c_str(), "/dev/null", (char *)nullptr);
+        fprintf(stderr, "Unable to start %s\n", spawn_path);
+        _exit(-1);
+    }
+}
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -b, --board NAME        virtual A314 board name (default a314bench)\n");
+    fprintf(stderr, "  -P, --port PORT         a314d client port (default 7110)\n");
+    fprintf(stderr, "  -s, --spawn PATH        start PATH as a314d on the virtual board\n");
+    fprintf(stderr, "  -m, --mode MODE         echo, sink or source (default echo)\n");
+    fprintf(stderr, "  -z, --size BYTES        transfer size, 1-16379 (default 64)\n");
+    fprintf(stderr, "  -n, --streams N         concurrent streams (default 1)\n");
+    fprintf(stderr, "  -d, --duration SECONDS  length of the run (default 5)\n");
+    fprintf(stderr, "  -c, --count N           packets per source stream (default: until --duration)\n");
+    fprintf(stderr, "  -r, --rings BYTES       offer a314d rings of BYTES, 256-16384 (default: legacy rings)\n");
+    fprintf(stderr, "  -J, --jumbo             offer jumbo packets with the rings\n");
+    fprintf(stderr, "  -Q, --qos               offer a ring pair for each QoS class\n");
+    fprintf(stderr, "  -C, --credit            offer per-channel flow control with the rings\n");
+    fprintf(stderr, "  -w, --window BYTES      reserve a transfer window of BYTES for a314d's clients\n");
+    fprintf(stderr, "  -p, --probe             add an echo stream that measures latency under load\n");
+    fprintf(stderr, "  -S, --stall             add a source stream that is never read\n");
+    fprintf(stderr, "  -j, --json              print the report as JSON\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"board", required_argument, nullptr, 'b'},
+        {"port", required_argument, nullptr, 'P'},
+        {"spawn", required_argument, nullptr, 's'},
+        {"mode", required_argument, nullptr, 'm'},
+        {"size", required_argument, nullptr, 'z'},
+        {"streams", required_argument, nullptr, 'n'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"count", required_argument, nullptr, 'c'},
+        {"rings", required_argument, nullptr, 'r'},
+        {"jumbo", no_argument, nullptr, 'J'},
+        {"qos", no_argument, nullptr, 'Q'},
+        {"credit", no_argument, nullptr, 'C'},
+        {"window", required_argument, nullptr, 'w'},
+        {"probe", no_argument, nullptr, 'p'},
+        {"stall", no_argument, nullptr, 'S'},
+        {"json", no_argument, nullptr, 'j'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:P:s:m:z:n:d:c:r:JQCw:pSj", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': board = optarg; break;
+        case 'P': server_port = atoi(optarg); break;
+        case 's': spawn_path = optarg; break;
+        case 'm':
+            mode = -1;
+            for (int i = 0; i < 3; i++)
+                if (strcmp(optarg, mode_names[i]) == 0)
+                    mode = i;
+            if (mode == -1)
+            {
+                print_usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'z': packet_size = atoi(optarg); break;
+        case 'n': stream_count = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'c': source_count = strtoul(optarg, nullptr, 10); break;
+        case 'r': ring_size = atoi(optarg); break;
+        case 'J': jumbo = true; break;
+        case 'Q': qos = true; break;
+        case 'C': credit = true; break;
+        case 'w': window_size = atoi(optarg); break;
+        case 'p': probe = true; break;
+        case 'S': stall = true; break;
+        case 'j': json_output = true; break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    bool ring_size_ok = ring_size == 0 || (ring_size >= 256 && ring_size <= 16384 && (ring_size & (ring_size - 1)) == 0);
+    if (packet_size < 1 || packet_size > SIM_MAX_RING_SIZE - 5 || stream_count < 1 || stream_count > 128 || !ring_size_ok ||
+            ((jumbo || qos || credit) && ring_size == 0) || window_size < 0 || window_size > SIM_MAX_WINDOW_SIZE)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    if (source_count == 0)
+        source_count = UINT32_MAX;
+    else
+        duration = 1e6;
+
+    for (int i = 0; i < SIM_MAX_RING_SIZE; i++)
+        payload[i] = i;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (spawn_path != nullptr)
+    {
+        VirtualA314::unlink(board);
+        spawn_daemon();
+    }
+
+    if (!wait_for_daemon())
+    {
+        fprintf(stderr, "Unable to connect to a314d on port %d\n", server_port);
+        if (daemon_pid != 0)
+            kill(daemon_pid, SIGTERM);
+        return -1;
+    }
+
+    if (amiga_board.open(board, VIRTUAL_A314_AMIGA) != 0)
+    {
+        fprintf(stderr, "Unable to open virtual A314 %s\n", board);
+        return -1;
+    }
+
+    amiga = new SimAmiga(amiga_board);
+    amiga->on_connect_response = on_connect_response;
+    amiga->on_data = on_data;
+    amiga->on_eos = on_eos;
+    amiga->on_reset = on_reset;
+    amiga->offer_rings(ring_size, ring_size, jumbo, qos, credit);
+    amiga->offer_window(window_size);
+    amiga->start();
+
+    // As a driver would, settle the rings before any stream is opened, so
+    // that the streams can go in their own classes.
+    while (amiga->negotiating())
+    {
+        struct pollfd pfd;
+        pfd.fd = amiga->irq_fd();
+        pfd.events = POLLIN;
+        poll(&pfd, 1, 10);
+        amiga->service();
+    }
+
+    std::string service = std::string("a314bench-") + mode_names[mode];
+    for (int i = 0; i < stream_count; i++)
+    {
+        int s = amiga->connect(service.c_str(), SIM_QOS_BULK);
+        streams[s] = {false, false, 0, 0, 0, false, false};
+        open_streams++;
+    }
+
+    if (probe)
+    {
+        int s = amiga->connect("a314bench-echo", SIM_QOS_INTERACTIVE);
+        streams[s] = {false, false, 0, 0, 0, true, false};
+        open_streams++;
+    }
+
+    if (stall)
+    {
+        int s = amiga->connect("a314bench-source", SIM_QOS_BULK);
+        streams[s] = {false, false, 0, 0, 0, false, true};
+        open_streams++;
+    }
+
+    uint64_t start = monotonic_ns();
+    run();
+    print_report((monotonic_ns() - start) / 1e9);
+
+    if (spawn_path != nullptr)
+    {
+        kill(daemon_pid, SIGTERM);
+
+        // a314d writes what it has already queued to R2A before it exits, so
+        // the Amiga keeps taking it until then.
+        while (waitpid(daemon_pid, nullptr, WNOHANG) == 0)
+        {
+            amiga->service();
+            usleep(1000);
+        }
+        VirtualA314::unlink(board);
+    }
+
+    return 0;
+}
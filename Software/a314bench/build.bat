@@ -0,0 +1 @@
+vc a314bench.c -lamiga -o a314bench
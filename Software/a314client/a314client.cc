@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#include "a314client.h"
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#define HDR_LEN                 9
+
+// Room for many small messages, or a large memory read, in one read().
+#define RECV_BUFFER_SIZE        65536
+
+// Larger than any message that a314d sends, compressed or not, as the
+// Amiga's A314 address space is 1 MB. A length above it means the stream is
+// out of sync, and the connection is closed rather than the length trusted.
+#define MAX_MSG_LEN             (16 * 1024 * 1024)
+
+#define COMPRESS_LZ4            1
+#define COMPRESS_HDR_LEN        4
+#define LZ4_MIN_MATCH           4
+
+A314Client::A314Client()
+    : msgs_sent(0), msgs_received(0), writes(0), fd_(-1), out_pos_(0), batch_depth_(0),
+      in_(RECV_BUFFER_SIZE), in_start_(0), in_end_(0), next_tag_(1)
+{
+}
+
+A314Client::~A314Client()
+{
+    close();
+}
+
+bool A314Client::connect(const char *host, int port)
+{
+    close();
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo *res;
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return false;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != nullptr; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        int saved = errno;
+        ::close(fd);
+        fd = -1;
+        errno = saved;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1)
+        return false;
+
+    attach(fd);
+    return true;
+}
+
+void A314Client::attach(int fd)
+{
+    close();
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    // Fails, harmlessly, on a Unix domain socket.
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    fd_ = fd;
+}
+
+void A314Client::close()
+{
+    if (fd_ != -1)
+        ::close(fd_);
+    fd_ = -1;
+
+    out_.clear();
+    out_pos_ = 0;
+    in_start_ = 0;
+    in_end_ = 0;
+    pending_mem_.clear();
+}
+
+void A314Client::closed()
+{
+    close();
+    if (on_close)
+        on_close();
+}
+
+void A314Client::register_service(const char *name)
+{
+    send(A314_MSG_REGISTER_REQ, 0, name, strlen(name));
+}
+
+void A314Client::deregister_service(const char *name)
+{
+    send(A314_MSG_DEREGISTER_REQ, 0, name, strlen(name));
+}
+
+void A314Client::connect_stream(int stream_id, const char *service)
+{
+    send(A314_MSG_CONNECT, stream_id, service, strlen(service));
+}
+
+void A314Client::connect_response(int stream_id, uint8_t result)
+{
+    send(A314_MSG_CONNECT_RESPONSE, stream_id, &result, 1);
+}
+
+void A314Client::data(int stream_id, const void *data, int length)
+{
+    send(A314_MSG_DATA, stream_id, data, length);
+}
+
+void A314Client::eos(int stream_id)
+{
+    send(A314_MSG_EOS, stream_id, nullptr, 0);
+}
+
+void A314Client::reset(int stream_id)
+{
+    send(A314_MSG_RESET, stream_id, nullptr, 0);
+}
+
+uint32_t A314Client::read_mem(uint32_t address, uint32_t length, MemCallback done)
+{
+    uint32_t req[2] = {address, length};
+    queue(A314_MSG_READ_MEM_REQ, 0, req, sizeof(req));
+
+    uint32_t tag = next_tag_++;
+    pending_mem_.push_back(PendingMem{tag, std::move(done)});
+    return tag;
+}
+
+uint32_t A314Client::write_mem(uint32_t address, const void *data, uint32_t length, MemCallback done)
+{
+    queue(A314_MSG_WRITE_MEM_REQ, 0, &address, sizeof(address), data, length);
+
+    uint32_t tag = next_tag_++;
+    pending_mem_.push_back(PendingMem{tag, std::move(done)});
+    return tag;
+}
+
+void A314Client::request_compression(bool enable)
+{
+    uint8_t algorithm = enable ? COMPRESS_LZ4 : 0;
+    send(A314_MSG_COMPRESS_REQ, 0, &algorithm, 1);
+}
+
+void A314Client::alloc_window(int tag, uint32_t length)
+{
+    send(A314_MSG_ALLOC_REQ, tag, &length, sizeof(length));
+}
+
+void A314Client::free_window(uint32_t address)
+{
+    send(A314_MSG_FREE_REQ, 0, &address, sizeof(address));
+}
+
+void A314Client::send(int type, int stream_id, const void *data, int length)
+{
+    queue(type, stream_id, data, length);
+}
+
+void A314Client::begin_batch()
+{
+    batch_depth_++;
+}
+
+void A314Client::end_batch()
+{
+    if (batch_depth_ > 0 && --batch_depth_ == 0)
+        flush();
+}
+
+// Outside a batch, and with nothing buffered, the message is written
+// straight from the caller's buffers, and only what the socket doesn't take
+// is copied.
+void A314Client::queue(int type, int stream_id, const void *data, int length, const void *data2, int length2)
+{
+    if (fd_ == -1)
+        return;
+
+    uint8_t hdr[HDR_LEN];
+    uint32_t total = length + length2;
+    uint32_t sid = stream_id;
+    memcpy(&hdr[0], &total, 4);
+    memcpy(&hdr[4], &sid, 4);
+    hdr[8] = (uint8_t)type;
+    msgs_sent++;
+
+    size_t sent = 0;
+    if (batch_depth_ == 0 && out_pos_ == out_.size())
+    {
+        struct iovec iov[3];
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = HDR_LEN;
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len = length;
+        iov[2].iov_base = (void *)data2;
+        iov[2].iov_len = length2;
+
+        ssize_t r = writev(fd_, iov, 3);
+        if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            closed();
+            return;
+        }
+        if (r > 0)
+        {
+            writes++;
+            sent = r;
+        }
+        if (sent == HDR_LEN + total)
+            return;
+
+        out_.clear();
+        out_pos_ = 0;
+    }
+
+    // Append what is left of the message.
+    const uint8_t *parts[3] = {hdr, (const uint8_t *)data, (const uint8_t *)data2};
+    size_t lengths[3] = {HDR_LEN, (size_t)length, (size_t)length2};
+    for (int i = 0; i < 3; i++)
+    {
+        size_t skip = std::min(sent, lengths[i]);
+        sent -= skip;
+        out_.insert(out_.end(), parts[i] + skip, parts[i] + lengths[i]);
+    }
+
+    if (batch_depth_ == 0)
+        flush();
+}
+
+bool A314Client::flush()
+{
+    while (fd_ != -1 && out_pos_ < out_.size())
+    {
+        ssize_t r = write(fd_, &out_[out_pos_], out_.size() - out_pos_);
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            closed();
+            return false;
+        }
+        writes++;
+        out_pos_ += r;
+    }
+
+    out_.clear();
+    out_pos_ = 0;
+    return fd_ != -1;
+}
+
+bool A314Client::process()
+{
+    if (fd_ == -1 || !flush())
+        return false;
+
+    while (1)
+    {
+        if (in_end_ == in_.size())
+        {
+            if (in_start_ != 0)
+            {
+                memmove(&in_[0], &in_[in_start_], in_end_ - in_start_);
+                in_end_ -= in_start_;
+                in_start_ = 0;
+            }
+            else
+                in_.resize(in_.size() * 2);
+        }
+
+        ssize_t r = read(fd_, &in_[in_end_], in_.size() - in_end_);
+        if (r == 0)
+        {
+            closed();
+            return false;
+        }
+        else if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            closed();
+            return false;
+        }
+        in_end_ += r;
+
+        while (in_end_ - in_start_ >= HDR_LEN)
+        {
+            const uint8_t *p = &in_[in_start_];
+            uint32_t length;
+            uint32_t stream_id;
+            memcpy(&length, p, 4);
+            memcpy(&stream_id, p + 4, 4);
+            int type = p[8];
+
+            if (length > MAX_MSG_LEN)
+            {
+                closed();
+                return false;
+            }
+
+            if (in_end_ - in_start_ < HDR_LEN + (size_t)length)
+            {
+                // Make room for the whole message.
+                if (HDR_LEN + (size_t)length > in_.size())
+                    in_.resize(HDR_LEN + (size_t)length);
+                break;
+            }
+
+            in_start_ += HDR_LEN + length;
+            dispatch(type, stream_id, p + HDR_LEN, length);
+            if (fd_ == -1)
+                return false;
+        }
+
+        if (in_start_ == in_end_)
+            in_start_ = in_end_ = 0;
+    }
+
+    return true;
+}
+
+bool A314Client::wait(int timeout_ms)
+{
+    if (fd_ == -1)
+        return false;
+
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN | (want_write() ? POLLOUT : 0);
+
+    int r = poll(&pfd, 1, timeout_ms);
+    if (r == -1 && errno != EINTR)
+    {
+        closed();
+        return false;
+    }
+    if (r <= 0)
+        return true;
+
+    return process();
+}
+
+void A314Client::dispatch(int type, int stream_id, const uint8_t *payload, int length)
+{
+    msgs_received++;
+
+    if (type & A314_MSG_FLAG_COMPRESSED)
+    {
+        if (!decompress(payload, length))
+        {
+            closed();
+            return;
+        }
+        payload = inflated_.empty() ? nullptr : &inflated_[0];
+        length = inflated_.size();
+        type &= ~A314_MSG_FLAG_COMPRESSED;
+    }
+
+    switch (type)
+    {
+    case A314_MSG_CONNECT:
+        if (on_connect)
+            return on_connect(stream_id, (const char *)payload, length);
+        break;
+    case A314_MSG_CONNECT_RESPONSE:
+        if (on_connect_response && length >= 1)
+            return on_connect_response(stream_id, payload[0]);
+        break;
+    case A314_MSG_DATA:
+        if (on_data)
+            return on_data(stream_id, payload, length);
+        break;
+    case A314_MSG_EOS:
+        if (on_eos)
+            return on_eos(stream_id);
+        break;
+    case A314_MSG_RESET:
+        if (on_reset)
+            return on_reset(stream_id);
+        break;
+    case A314_MSG_SNAPSHOT:
+        if (on_snapshot)
+            return on_snapshot(stream_id, payload, length);
+        break;
+    case A314_MSG_READ_MEM_RES:
+    case A314_MSG_WRITE_MEM_RES:
+        if (!pending_mem_.empty())
+        {
+            PendingMem pm = std::move(pending_mem_.front());
+            pending_mem_.pop_front();
+
+            if (pm.done)
+                pm.done(pm.tag, payload, length);
+            else if (on_mem_done)
+                on_mem_done(pm.tag, payload, length);
+            return;
+        }
+        break;
+    }
+
+    if (on_message)
+        on_message(type, stream_id, payload, length);
+}
+
+// The payload is the uncompressed length followed by an LZ4 block.
+bool A314Client::decompress(const uint8_t *payload, int length)
+{
+    if (length < COMPRESS_HDR_LEN)
+        return false;
+
+    uint32_t out_len;
+    memcpy(&out_len, payload, 4);
+    if (out_len > MAX_MSG_LEN)
+        return false;
+    inflated_.resize(out_len);
+
+    const uint8_t *ip = payload + COMPRESS_HDR_LEN;
+    const uint8_t *iend = payload + length;
+    size_t op = 0;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= iend)
+                    return false;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > out_len - op)
+            return false;
+        memcpy(&inflated_[op], ip, lit);
+        ip += lit;
+        op += lit;
+
+        // The last sequence has only literals.
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        size_t mlen = token & 15;
+        if (mlen == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= iend)
+                    return false;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+
+        if (offset == 0 || offset > op || mlen > out_len - op)
+            return false;
+
+        // Matches may overlap what they produce, so copy byte by byte.
+        uint8_t *out = &inflated_[0];
+        for (size_t i = 0; i < mlen; i++, op++)
+            out[op] = out[op - offset];
+    }
+
+    return op == out_len;
+}
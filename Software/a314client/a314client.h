@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#ifndef A314CLIENT_H
+#define A314CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+// Client side of a314d's socket protocol, for services on the Pi. Every
+// message is a header of length (u32), stream id (u32) and type (u8), in
+// host byte order, followed by length bytes of payload; see a314d.cc.
+//
+// The client never blocks unless asked to with wait(). Messages that are
+// sent go out straight from the caller's buffer if the socket takes them,
+// and are only copied if it doesn't. Between begin_batch() and end_batch()
+// they are collected, and go out in one write. Whole messages that a314d
+// sends are handed to the callbacks with pointers into the receive buffer,
+// which are valid only during the call.
+//
+// For an event loop, watch fd() for reading, and for writing while
+// want_write(), and call process() when it is ready. Callbacks may send,
+// and may close(), but must not call process() or wait().
+
+#define A314_MSG_REGISTER_REQ       1
+#define A314_MSG_REGISTER_RES       2
+#define A314_MSG_DEREGISTER_REQ     3
+#define A314_MSG_DEREGISTER_RES     4
+#define A314_MSG_READ_MEM_REQ       5
+#define A314_MSG_READ_MEM_RES       6
+#define A314_MSG_WRITE_MEM_REQ      7
+#define A314_MSG_WRITE_MEM_RES      8
+#define A314_MSG_CONNECT            9
+#define A314_MSG_CONNECT_RESPONSE   10
+#define A314_MSG_DATA               11
+#define A314_MSG_EOS                12
+#define A314_MSG_RESET              13
+#define A314_MSG_SUBSCRIBE_REQ      14
+#define A314_MSG_SUBSCRIBE_RES      15
+#define A314_MSG_UNSUBSCRIBE_REQ    16
+#define A314_MSG_SNAPSHOT_REQ       17
+#define A314_MSG_SNAPSHOT           18
+#define A314_MSG_COMPRESS_REQ       19
+#define A314_MSG_COMPRESS_RES       20
+#define A314_MSG_ALLOC_REQ          21
+#define A314_MSG_ALLOC_RES          22
+#define A314_MSG_FREE_REQ           23
+
+#define A314_MSG_FLAG_COMPRESSED    0x80
+
+#define A314_MSG_SUCCESS            1
+#define A314_MSG_FAIL               0
+
+// Values for the result of connect_response().
+#define A314_CONNECT_OK                 0
+#define A314_CONNECT_SOCKET_IN_USE      1
+#define A314_CONNECT_UNKNOWN_SERVICE    3
+
+#define A314_DEFAULT_PORT           7110
+
+class A314Client
+{
+public:
+    // Memory operations complete in the order they were issued. tag is the
+    // one that read_mem() or write_mem() returned, and data is what was
+    // read, or empty for a write.
+    typedef std::function<void(uint32_t tag, const uint8_t *data, uint32_t length)> MemCallback;
+
+    // service is the name the Amiga connected to, not zero terminated.
+    std::function<void(int stream_id, const char *service, int length)> on_connect;
+    std::function<void(int stream_id, int result)> on_connect_response;
+    std::function<void(int stream_id, const uint8_t *data, int length)> on_data;
+    std::function<void(int stream_id)> on_eos;
+    std::function<void(int stream_id)> on_reset;
+    std::function<void(int subscription, const uint8_t *data, int length)> on_snapshot;
+
+    // For memory operations that were issued without a callback of their
+    // own.
+    MemCallback on_mem_done;
+
+    // Every other message, such as MSG_REGISTER_RES, with the payload
+    // decompressed if a314d compressed it.
+    std::function<void(int type, int stream_id, const uint8_t *data, int length)> on_message;
+
+    // a314d closed the connection, or it failed.
+    std::function<void()> on_close;
+
+    A314Client();
+    ~A314Client();
+
+    // Connects to a314d over TCP. Returns false, with errno set, if that
+    // fails.
+    bool connect(const char *host = "localhost", int port = A314_DEFAULT_PORT);
+
+    // Takes over a socket that is already connected to a314d, such as the
+    // one that an on-demand service is started with.
+    void attach(int fd);
+
+    void close();
+
+    int fd() const { return fd_; }
+    bool is_open() const { return fd_ != -1; }
+    bool want_write() const { return out_pos_ < out_.size(); }
+
+    void register_service(const char *name);
+    void deregister_service(const char *name);
+
+    // Opens a stream to a service on the Amiga; stream_id must be even.
+    void connect_stream(int stream_id, const char *service);
+    void connect_response(int stream_id, uint8_t result);
+    void data(int stream_id, const void *data, int length);
+    void eos(int stream_id);
+    void reset(int stream_id);
+
+    // Any number of memory operations may be outstanding. done, or else
+    // on_mem_done, is called when each completes.
+    uint32_t read_mem(uint32_t address, uint32_t length, MemCallback done = nullptr);
+    uint32_t write_mem(uint32_t address, const void *data, uint32_t length, MemCallback done = nullptr);
+
+    // Asks a314d to compress large memory reads and snapshots, which is
+    // worth it for a client on another host. They are decompressed before
+    // they reach the callbacks. The answer comes as MSG_COMPRESS_RES.
+    void request_compression(bool enable);
+
+    // Asks for a slice of the transfer window that the Amiga has reserved,
+    // on the board that memory operations go to. The answer comes as
+    // MSG_ALLOC_RES with tag as its stream id, and a payload of the result
+    // (u8) and the address (u32) of the slice. free_window() gives the slice
+    // back; a314d frees all of them when the connection closes.
+    // Experimental: a314.device doesn't reserve a window, so this only
+    // succeeds against the simulated Amiga.
+    void alloc_window(int tag, uint32_t length);
+    void free_window(uint32_t address);
+
+    // Sends a message that has no function of its own.
+    void send(int type, int stream_id, const void *data, int length);
+
+    // Messages sent in a batch are written when it ends, together.
+    void begin_batch();
+    void end_batch();
+
+    // Writes what is buffered, as far as the socket takes it, then reads
+    // what a314d has sent and dispatches every whole message. Returns
+    // false once the connection is closed.
+    bool process();
+
+    // Waits up to timeout_ms, or forever if it is negative, for the socket
+    // to become ready, and then processes it. Returns false once the
+    // connection is closed.
+    bool wait(int timeout_ms = -1);
+
+    // Counters.
+    uint64_t msgs_sent;
+    uint64_t msgs_received;
+    uint64_t writes;
+
+private:
+    struct PendingMem
+    {
+        uint32_t tag;
+        MemCallback done;
+    };
+
+    void queue(int type, int stream_id, const void *data, int length, const void *data2 = nullptr, int length2 = 0);
+    bool flush();
+    void dispatch(int type, int stream_id, const uint8_t *payload, int length);
+    bool decompress(const uint8_t *payload, int length);
+    void closed();
+
+    int fd_;
+
+    std::vector<uint8_t> out_;
+    size_t out_pos_;
+    int batch_depth_;
+
+    std::vector<uint8_t> in_;
+    size_t in_start_;
+    size_t in_end_;
+    std::vector<uint8_t> inflated_;
+
+    std::deque<PendingMem> pending_mem_;
+    uint32_t next_tag_;
+};
+
+#endif
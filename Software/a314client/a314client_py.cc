@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+// Python binding of A314Client, so that services written in Python don't
+// have to frame and parse messages themselves. Messages from a314d are
+// returned by wait_for_msg() as (stream_id, type, payload), as the services
+// in this repository already have them, and memory operations that were
+// issued with read_mem_async() or write_mem_async() come back the same way,
+// with their tag in place of the stream id.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <poll.h>
+
+#include <deque>
+#include <memory>
+
+#include "a314client.h"
+
+#if PY_MAJOR_VERSION > 2
+#define BYTES_FORMAT "y*"
+#else
+#define BYTES_FORMAT "s*"
+#endif
+
+typedef struct
+{
+    PyObject_HEAD
+    A314Client *client;
+    std::deque<PyObject *> *messages;
+} ClientObject;
+
+static void queue_message(ClientObject *self, int stream_id, int type, const uint8_t *data, int length)
+{
+    PyObject *t = Py_BuildValue("(IiN)", (unsigned int)stream_id, type,
+            PyBytes_FromStringAndSize((const char *)data, length));
+    if (t != NULL)
+        self->messages->push_back(t);
+}
+
+static int client_init(ClientObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = {"host", "port", "fd", NULL};
+    const char *host = "localhost";
+    int port = A314_DEFAULT_PORT;
+    int fd = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|sii", (char **)kwlist, &host, &port, &fd))
+        return -1;
+
+    if (self->client == NULL)
+    {
+        self->client = new A314Client();
+        self->messages = new std::deque<PyObject *>();
+    }
+
+    self->client->on_message = [self](int type, int stream_id, const uint8_t *data, int length)
+    {
+        queue_message(self, stream_id, type, data, length);
+    };
+
+    if (fd != -1)
+        self->client->attach(fd);
+    else
+    {
+        bool ok;
+        Py_BEGIN_ALLOW_THREADS
+        ok = self->client->connect(host, port);
+        Py_END_ALLOW_THREADS
+        if (!ok)
+        {
+            PyErr_SetFromErrno(PyExc_IOError);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void client_dealloc(ClientObject *self)
+{
+    if (self->messages != NULL)
+    {
+        for (PyObject *t : *self->messages)
+            Py_DECREF(t);
+        delete self->messages;
+    }
+    delete self->client;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *closed_error()
+{
+    PyErr_SetString(PyExc_IOError, "Connection to a314d was closed");
+    return NULL;
+}
+
+// Waits for the socket with the GIL released, and then processes it, which
+// queues the messages that were received. Returns 1 while the connection is
+// open, 0 once it is closed, and -1 with an exception set if a signal
+// handler raised one, as for Ctrl-C, or poll() failed.
+static int wait_once(ClientObject *self, int timeout_ms)
+{
+    A314Client *c = self->client;
+    if (!c->is_open())
+        return 0;
+
+    struct pollfd pfd;
+    pfd.fd = c->fd();
+    pfd.events = POLLIN | (c->want_write() ? POLLOUT : 0);
+
+    int r;
+    int err;
+    Py_BEGIN_ALLOW_THREADS
+    r = poll(&pfd, 1, timeout_ms);
+    err = errno;
+    Py_END_ALLOW_THREADS
+
+    if (r == -1)
+    {
+        if (err == EINTR)
+            return PyErr_CheckSignals() == 0 ? 1 : -1;
+        errno = err;
+        PyErr_SetFromErrno(PyExc_IOError);
+        return -1;
+    }
+    if (r == 0)
+        return 1;
+    return c->process() ? 1 : 0;
+}
+
+// A blocking memory operation that is interrupted leaves its callback
+// pending, so the callback holds the state rather than the stack of the
+// call, and ignores the answer once the call has given up.
+struct BlockingMem
+{
+    bool done;
+    bool abandoned;
+    PyObject *result;
+};
+
+static PyObject *wait_for_blocking_mem(ClientObject *self, const std::shared_ptr<BlockingMem> &op)
+{
+    while (!op->done)
+    {
+        int state = wait_once(self, -1);
+        if (state != 1)
+        {
+            op->abandoned = true;
+            return state == 0 ? closed_error() : NULL;
+        }
+    }
+    return op->result;
+}
+
+static PyObject *client_fileno(ClientObject *self, PyObject *args)
+{
+    return PyLong_FromLong(self->client->fd());
+}
+
+static PyObject *client_close(ClientObject *self, PyObject *args)
+{
+    self->client->close();
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_register(ClientObject *self, PyObject *args)
+{
+    const char *name;
+    Py_ssize_t length;
+    if (!PyArg_ParseTuple(args, "s#", &name, &length))
+        return NULL;
+    self->client->send(A314_MSG_REGISTER_REQ, 0, name, length);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_deregister(ClientObject *self, PyObject *args)
+{
+    const char *name;
+    Py_ssize_t length;
+    if (!PyArg_ParseTuple(args, "s#", &name, &length))
+        return NULL;
+    self->client->send(A314_MSG_DEREGISTER_REQ, 0, name, length);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_connect(ClientObject *self, PyObject *args)
+{
+    unsigned int stream_id;
+    const char *name;
+    Py_ssize_t length;
+    if (!PyArg_ParseTuple(args, "Is#", &stream_id, &name, &length))
+        return NULL;
+    self->client->send(A314_MSG_CONNECT, stream_id, name, length);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_connect_response(ClientObject *self, PyObject *args)
+{
+    unsigned int stream_id;
+    unsigned char result;
+    if (!PyArg_ParseTuple(args, "Ib", &stream_id, &result))
+        return NULL;
+    self->client->connect_response(stream_id, result);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_data(ClientObject *self, PyObject *args)
+{
+    unsigned int stream_id;
+    Py_buffer data;
+    if (!PyArg_ParseTuple(args, "I" BYTES_FORMAT, &stream_id, &data))
+        return NULL;
+    self->client->data(stream_id, data.buf, data.len);
+    PyBuffer_Release(&data);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_eos(ClientObject *self, PyObject *args)
+{
+    unsigned int stream_id;
+    if (!PyArg_ParseTuple(args, "I", &stream_id))
+        return NULL;
+    self->client->eos(stream_id);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_reset(ClientObject *self, PyObject *args)
+{
+    unsigned int stream_id;
+    if (!PyArg_ParseTuple(args, "I", &stream_id))
+        return NULL;
+    self->client->reset(stream_id);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_send(ClientObject *self, PyObject *args)
+{
+    int type;
+    unsigned int stream_id;
+    Py_buffer data = {};
+    if (!PyArg_ParseTuple(args, "iI|" BYTES_FORMAT, &type, &stream_id, &data))
+        return NULL;
+    self->client->send(type, stream_id, data.buf, data.len);
+    if (data.obj != NULL)
+        PyBuffer_Release(&data);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_read_mem_async(ClientObject *self, PyObject *args)
+{
+    unsigned int address;
+    unsigned int length;
+    if (!PyArg_ParseTuple(args, "II", &address, &length))
+        return NULL;
+
+    uint32_t tag = self->client->read_mem(address, length, [self](uint32_t tag, const uint8_t *data, uint32_t length)
+    {
+        queue_message(self, tag, A314_MSG_READ_MEM_RES, data, length);
+    });
+    return PyLong_FromUnsignedLong(tag);
+}
+
+static PyObject *client_write_mem_async(ClientObject *self, PyObject *args)
+{
+    unsigned int address;
+    Py_buffer data;
+    if (!PyArg_ParseTuple(args, "I" BYTES_FORMAT, &address, &data))
+        return NULL;
+
+    uint32_t tag = self->client->write_mem(address, data.buf, data.len, [self](uint32_t tag, const uint8_t *data, uint32_t length)
+    {
+        queue_message(self, tag, A314_MSG_WRITE_MEM_RES, data, length);
+    });
+    PyBuffer_Release(&data);
+    return PyLong_FromUnsignedLong(tag);
+}
+
+// The blocking memory operations leave other messages that arrive in the
+// meantime for wait_for_msg().
+static PyObject *client_read_mem(ClientObject *self, PyObject *args)
+{
+    unsigned int address;
+    unsigned int length;
+    if (!PyArg_ParseTuple(args, "II", &address, &length))
+        return NULL;
+
+    auto op = std::make_shared<BlockingMem>(BlockingMem{false, false, NULL});
+    self->client->read_mem(address, length, [op](uint32_t tag, const uint8_t *data, uint32_t length)
+    {
+        if (op->abandoned)
+            return;
+        op->result = PyBytes_FromStringAndSize((const char *)data, length);
+        op->done = true;
+    });
+
+    return wait_for_blocking_mem(self, op);
+}
+
+static PyObject *client_write_mem(ClientObject *self, PyObject *args)
+{
+    unsigned int address;
+    Py_buffer data;
+    if (!PyArg_ParseTuple(args, "I" BYTES_FORMAT, &address, &data))
+        return NULL;
+
+    auto op = std::make_shared<BlockingMem>(BlockingMem{false, false, NULL});
+    self->client->write_mem(address, data.buf, data.len, [op](uint32_t tag, const uint8_t *data, uint32_t length)
+    {
+        if (op->abandoned)
+            return;
+        Py_INCREF(Py_None);
+        op->result = Py_None;
+        op->done = true;
+    });
+    PyBuffer_Release(&data);
+
+    return wait_for_blocking_mem(self, op);
+}
+
+static PyObject *client_request_compression(ClientObject *self, PyObject *args)
+{
+    int enable = 1;
+    if (!PyArg_ParseTuple(args, "|i", &enable))
+        return NULL;
+    self->client->request_compression(enable != 0);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_alloc_window_async(ClientObject *self, PyObject *args)
+{
+    int tag;
+    unsigned int length;
+    if (!PyArg_ParseTuple(args, "iI", &tag, &length))
+        return NULL;
+    self->client->alloc_window(tag, length);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_free_window(ClientObject *self, PyObject *args)
+{
+    unsigned int address;
+    if (!PyArg_ParseTuple(args, "I", &address))
+        return NULL;
+    self->client->free_window(address);
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_begin_batch(ClientObject *self, PyObject *args)
+{
+    self->client->begin_batch();
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_end_batch(ClientObject *self, PyObject *args)
+{
+    self->client->end_batch();
+    Py_RETURN_NONE;
+}
+
+static PyObject *client_wait_for_msg(ClientObject *self, PyObject *args)
+{
+    PyObject *timeout = Py_None;
+    if (!PyArg_ParseTuple(args, "|O", &timeout))
+        return NULL;
+
+    int timeout_ms = -1;
+    if (timeout != Py_None)
+    {
+        double s = PyFloat_AsDouble(timeout);
+        if (s == -1.0 && PyErr_Occurred())
+            return NULL;
+        timeout_ms = (int)(s * 1000);
+    }
+
+    if (self->messages->empty())
+    {
+        int state = wait_once(self, timeout_ms);
+
+        // Without a timeout, wait until there is a whole message.
+        while (state == 1 && timeout_ms < 0 && self->messages->empty())
+            state = wait_once(self, -1);
+
+        if (state == -1)
+            return NULL;
+        if (state == 0 && self->messages->empty())
+            return closed_error();
+    }
+
+    if (self->messages->empty())
+        Py_RETURN_NONE;
+
+    PyObject *t = self->messages->front();
+    self->messages->pop_front();
+    return t;
+}
+
+static PyObject *client_read_messages(ClientObject *self, PyObject *args)
+{
+    if (!self->client->process() && self->messages->empty())
+        return closed_error();
+
+    PyObject *list = PyList_New(self->messages->size());
+    if (list == NULL)
+        return NULL;
+
+    Py_ssize_t i = 0;
+    for (PyObject *t : *self->messages)
+        PyList_SET_ITEM(list, i++, t);
+    self->messages->clear();
+    return list;
+}
+
+static PyObject *client_want_write(ClientObject *self, PyObject *args)
+{
+    return PyBool_FromLong(self->client->want_write());
+}
+
+static PyMethodDef client_methods[] = {
+    {"fileno", (PyCFunction)client_fileno, METH_NOARGS, "The socket, for select() or an event loop."},
+    {"close", (PyCFunction)client_close, METH_NOARGS, "Close the connection to a314d."},
+    {"register", (PyCFunction)client_register, METH_VARARGS, "register(name): send MSG_REGISTER_REQ."},
+    {"deregister", (PyCFunction)client_deregister, METH_VARARGS, "deregister(name): send MSG_DEREGISTER_REQ."},
+    {"connect", (PyCFunction)client_connect, METH_VARARGS, "connect(stream_id, name): open a stream to a service on the Amiga."},
+    {"connect_response", (PyCFunction)client_connect_response, METH_VARARGS, "connect_response(stream_id, result)"},
+    {"data", (PyCFunction)client_data, METH_VARARGS, "data(stream_id, data)"},
+    {"eos", (PyCFunction)client_eos, METH_VARARGS, "eos(stream_id)"},
+    {"reset", (PyCFunction)client_reset, METH_VARARGS, "reset(stream_id)"},
+    {"send", (PyCFunction)client_send, METH_VARARGS, "send(type, stream_id[, payload]): send any message."},
+    {"read_mem_async", (PyCFunction)client_read_mem_async, METH_VARARGS, "read_mem_async(address, length) -> tag"},
+    {"write_mem_async", (PyCFunction)client_write_mem_async, METH_VARARGS, "write_mem_async(address, data) -> tag"},
+    {"read_mem", (PyCFunction)client_read_mem, METH_VARARGS, "read_mem(address, length) -> data, waiting for it."},
+    {"write_mem", (PyCFunction)client_write_mem, METH_VARARGS, "write_mem(address, data), waiting for it."},
+    {"request_compression", (PyCFunction)client_request_compression, METH_VARARGS, "request_compression([enable])"},
+    {"alloc_window_async", (PyCFunction)client_alloc_window_async, METH_VARARGS, "alloc_window_async(tag, length): answered by MSG_ALLOC_RES. Experimental; only the simulated Amiga offers a window."},
+    {"free_window", (PyCFunction)client_free_window, METH_VARARGS, "free_window(address)"},
+    {"begin_batch", (PyCFunction)client_begin_batch, METH_NOARGS, "Collect messages until end_batch()."},
+    {"end_batch", (PyCFunction)client_end_batch, METH_NOARGS, "Send the messages of the batch together."},
+    {"wait_for_msg", (PyCFunction)client_wait_for_msg, METH_VARARGS, "wait_for_msg([timeout]) -> (stream_id, type, payload), or None on timeout."},
+    {"read_messages", (PyCFunction)client_read_messages, METH_NOARGS, "Messages that have arrived, without waiting."},
+    {"want_write", (PyCFunction)client_want_write, METH_NOARGS, "True while sent messages are buffered."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject ClientType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "a314client.Client",
+};
+
+static const char module_docstring[] = "Client for a314d's socket protocol.";
+
+#if PY_MAJOR_VERSION > 2
+static struct PyModuleDef a314client_module = {
+   PyModuleDef_HEAD_INIT,
+   "a314client",
+   module_docstring,
+   -1,
+   NULL
+};
+#endif
+
+static const struct
+{
+    const char *name;
+    int value;
+} constants[] = {
+    {"MSG_REGISTER_REQ", A314_MSG_REGISTER_REQ},
+    {"MSG_REGISTER_RES", A314_MSG_REGISTER_RES},
+    {"MSG_DEREGISTER_REQ", A314_MSG_DEREGISTER_REQ},
+    {"MSG_DEREGISTER_RES", A314_MSG_DEREGISTER_RES},
+    {"MSG_READ_MEM_REQ", A314_MSG_READ_MEM_REQ},
+    {"MSG_READ_MEM_RES", A314_MSG_READ_MEM_RES},
+    {"MSG_WRITE_MEM_REQ", A314_MSG_WRITE_MEM_REQ},
+    {"MSG_WRITE_MEM_RES", A314_MSG_WRITE_MEM_RES},
+    {"MSG_CONNECT", A314_MSG_CONNECT},
+    {"MSG_CONNECT_RESPONSE", A314_MSG_CONNECT_RESPONSE},
+    {"MSG_DATA", A314_MSG_DATA},
+    {"MSG_EOS", A314_MSG_EOS},
+    {"MSG_RESET", A314_MSG_RESET},
+    {"MSG_SUBSCRIBE_REQ", A314_MSG_SUBSCRIBE_REQ},
+    {"MSG_SUBSCRIBE_RES", A314_MSG_SUBSCRIBE_RES},
+    {"MSG_UNSUBSCRIBE_REQ", A314_MSG_UNSUBSCRIBE_REQ},
+    {"MSG_SNAPSHOT_REQ", A314_MSG_SNAPSHOT_REQ},
+    {"MSG_SNAPSHOT", A314_MSG_SNAPSHOT},
+    {"MSG_COMPRESS_REQ", A314_MSG_COMPRESS_REQ},
+    {"MSG_COMPRESS_RES", A314_MSG_COMPRESS_RES},
+    {"MSG_ALLOC_REQ", A314_MSG_ALLOC_REQ},
+    {"MSG_ALLOC_RES", A314_MSG_ALLOC_RES},
+    {"MSG_FREE_REQ", A314_MSG_FREE_REQ},
+    {"MSG_SUCCESS", A314_MSG_SUCCESS},
+    {"MSG_FAIL", A314_MSG_FAIL},
+    {"CONNECT_OK", A314_CONNECT_OK},
+    {"CONNECT_SOCKET_IN_USE", A314_CONNECT_SOCKET_IN_USE},
+    {"CONNECT_UNKNOWN_SERVICE", A314_CONNECT_UNKNOWN_SERVICE},
+};
+
+#if PY_MAJOR_VERSION > 2
+PyMODINIT_FUNC PyInit_a314client(void)
+#else
+PyMODINIT_FUNC inita314client(void)
+#endif
+{
+    ClientType.tp_basicsize = sizeof(ClientObject);
+    ClientType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ClientType.tp_doc = "Client(host='localhost', port=7110, fd=-1): a connection to a314d.";
+    ClientType.tp_methods = client_methods;
+    ClientType.tp_init = (initproc)client_init;
+    ClientType.tp_dealloc = (destructor)client_dealloc;
+    ClientType.tp_new = PyType_GenericNew;
+
+#if PY_MAJOR_VERSION > 2
+    if (PyType_Ready(&ClientType) < 0)
+        return NULL;
+    PyObject *m = PyModule_Create(&a314client_module);
+    if (m == NULL)
+        return NULL;
+#else
+    if (PyType_Ready(&ClientType) < 0)
+        return;
+    PyObject *m = Py_InitModule3("a314client", NULL, module_docstring);
+    if (m == NULL)
+        return;
+#endif
+
+    Py_INCREF(&ClientType);
+    PyModule_AddObject(m, "Client", (PyObject *)&ClientType);
+
+    for (auto &c : constants)
+        PyModule_AddIntConstant(m, c.name, c.value);
+
+#if PY_MAJOR_VERSION > 2
+    return m;
+#else
+    return;
+#endif
+}
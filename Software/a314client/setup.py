@@ -0,0 +1,13 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+from distutils.core import setup, Extension
+
+setup(  name            = "a314client",
+        version         = "1.0",
+        description     = "Client for a314d's socket protocol",
+        author          = "Niklas Ekström",
+        url             = "http://github.com/niklasekstrom/a314",
+        ext_modules     = [Extension("a314client", ["a314client_py.cc", "a314client.cc"],
+                                     extra_compile_args = ["-std=c++11", "-O3"])]
+)
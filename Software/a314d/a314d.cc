@@ -11,15 +11,26 @@
 #include <netinet/tcp.h>
 
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
 #include <ctype.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,10 +39,18 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <list>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "a314d_plugin.h"
+#include "spsc_queue.h"
+#include "virtual_a314.h"
+
 #define LOGGER_TRACE 0
 #define logger_trace(...) do { if (LOGGER_TRACE) fprintf(stdout, __VA_ARGS__); } while (0)
 
@@ -54,6 +73,7 @@
 #define WRITE_CMEM_CMD          3
 
 #define READ_SRAM_HDR_LEN       4
+#define WRITE_SRAM_HDR_LEN      3
 
 // Addresses to variables in CMEM.
 #define R_EVENTS_ADDRESS        12
@@ -76,17 +96,124 @@
 #define R2A_TAIL_OFFSET         2
 #define A2R_HEAD_OFFSET         3
 
+// Offset relative to communication area for the legacy 256 byte rings.
+#define A2R_BUFFER_OFFSET       4
+#define R2A_BUFFER_OFFSET       260
+
+#define LEGACY_RING_SIZE        256
+
 // Packets that are communicated across physical channels (A2R and R2A).
+#define PKT_SETTINGS            3
 #define PKT_CONNECT             4
 #define PKT_CONNECT_RESPONSE    5
 #define PKT_DATA                6
 #define PKT_EOS                 7
 #define PKT_RESET               8
+#define PKT_CREDIT              9
 
 // Valid responses for PKT_CONNECT_RESPONSE.
 #define CONNECT_OK              0
+#define CONNECT_SOCKET_IN_USE   1
 #define CONNECT_UNKNOWN_SERVICE 3
 
+// The Amiga opens logical channels with odd channel ids. Clients of a314d
+// can open channels to services on the Amiga too, and a314d gives those
+// even channel ids, round robin from the first to the last, so that an id is
+// not soon reused. Channel id 0 is used for PKT_SETTINGS.
+#define PI_CHANNEL_ID_FIRST     2
+#define PI_CHANNEL_ID_LAST      254
+
+// Packets are [length:u8][type:u8][stream:u8] followed by the payload.
+#define PKT_HDR_LEN             3
+#define LEGACY_MAX_PAYLOAD      252
+
+// Jumbo packets, which may be used in the extended rings, have a 16 bit big
+// endian length: [length:u16][type:u8][stream:u8]. A payload can then be as
+// large as the ring it is sent on allows.
+#define JUMBO_PKT_HDR_LEN       4
+
+// PKT_SETTINGS, on stream 0, negotiates larger rings. The Amiga allocates an
+// extended area and offers it in A2R:
+//   OFFER     version, log2 of A2R size, log2 of R2A size, flags, address (BE32)
+// a314d answers in R2A with ACCEPT or REFUSE, followed by the same version
+// and sizes, and the flags it agreed to. ACCEPT is the last packet a314d
+// writes to the legacy R2A, and the Amiga answers it with SWITCHED as the
+// last packet in the legacy A2R.
+// Each direction thereby changes rings at a point that its reader sees in
+// order. A driver that never offers, or an a314d that ignores the offer,
+// keeps the legacy layout.
+#define SETTINGS_OFFER          1
+#define SETTINGS_ACCEPT         2
+#define SETTINGS_REFUSE         3
+#define SETTINGS_SWITCHED       4
+
+#define SETTINGS_VERSION        1
+#define SETTINGS_OFFER_LEN      9
+
+#define SETTINGS_FLAG_JUMBO     1
+#define SETTINGS_FLAG_QOS       2
+#define SETTINGS_FLAG_CREDIT    4
+
+// The Amiga may also reserve a transfer window in A314 memory, and offer it
+// on stream 0 in A2R, in whichever ring, any time after the base address:
+//   WINDOW    address (BE32), length (BE32)
+// a314d doesn't answer it, but hands out slices of the window to clients on
+// request; see MSG_ALLOC_REQ. The window is given up when the Amiga
+// publishes a new base address. This is experimental: a314.device doesn't
+// reserve a window, and only the simulated Amiga offers one.
+#define SETTINGS_WINDOW         5
+#define SETTINGS_WINDOW_LEN     9
+
+// An Amiga that accepts logical channels opened by clients says so on stream
+// 0 in A2R, any time after the base address, with LISTEN and no more. Until
+// it has, a314d answers MSG_CONNECT with CONNECT_UNKNOWN_SERVICE itself, as
+// a314.device drops a CONNECT that no one listens for and never answers it.
+// a314.device doesn't send LISTEN yet; the simulated Amiga does.
+#define SETTINGS_LISTEN         6
+
+#define MIN_RING_LOG2           8
+#define MAX_RING_LOG2           14
+#define MAX_RING_SIZE           (1 << MAX_RING_LOG2)
+
+// Offset relative to a ring pair's pointers in the extended area for 16 bit
+// big endian queue pointers. Every pointer is followed by its complement, and
+// is written before it. The pointers of all pairs come first, and then the
+// rings, the A2R and then the R2A ring of each pair in turn.
+#define EXT_A2R_TAIL_OFFSET     0
+#define EXT_R2A_HEAD_OFFSET     4
+#define EXT_R2A_TAIL_OFFSET     8
+#define EXT_A2R_HEAD_OFFSET     12
+#define EXT_POINTERS_LEN        16
+
+// Reads of the extended pointers that are tried before giving up on a read
+// that keeps coming back torn; see read_channel_status().
+#define EXT_POINTERS_READS      8
+
+// With SETTINGS_FLAG_QOS the extended area has one ring pair for each QoS
+// class, in this order, rather than a single pair. A logical channel belongs
+// to the class whose A2R ring its CONNECT came in on, or to control if a
+// client opened it, and the rest of its packets go on the same pair in both
+// directions. a314d reads A2R, and hands
+// packets to R2A, one class at a time, starting with control, so that bulk
+// transfers don't hold up control and interactive traffic.
+#define QOS_CONTROL             0
+#define QOS_INTERACTIVE         1
+#define QOS_BULK                2
+#define QOS_CLASSES             3
+
+// With SETTINGS_FLAG_CREDIT, every logical channel whose CONNECT comes in an
+// extended A2R ring, or for a channel that a client opened, whose
+// CONNECT_RESPONSE does, has flow control of its own. Each side may send at most
+// CHANNEL_WINDOW bytes of DATA payload on the channel that the other side
+// hasn't given back with PKT_CREDIT, whose payload is the number of bytes
+// given back, as a BE32. A side gives credit back once its client has taken
+// at least CREDIT_GRANT_MIN bytes; as what is held back is then less than
+// that, the largest jumbo packet always fits in what remains of the window.
+// A client that doesn't keep up therefore holds up its own channel only,
+// instead of making a314d or the Amiga buffer everything sent to it.
+#define CHANNEL_WINDOW          65536
+#define CREDIT_GRANT_MIN        16384
+
 // Messages that are communicated between driver and client.
 #define MSG_REGISTER_REQ        1
 #define MSG_REGISTER_RES        2
@@ -101,11 +228,90 @@
 #define MSG_DATA                11
 #define MSG_EOS                 12
 #define MSG_RESET               13
+#define MSG_SUBSCRIBE_REQ       14
+#define MSG_SUBSCRIBE_RES       15
+#define MSG_UNSUBSCRIBE_REQ     16
+#define MSG_SNAPSHOT_REQ        17
+#define MSG_SNAPSHOT            18
+#define MSG_COMPRESS_REQ        19
+#define MSG_COMPRESS_RES        20
+#define MSG_ALLOC_REQ           21
+#define MSG_ALLOC_RES           22
+#define MSG_FREE_REQ            23
 
 #define MSG_SUCCESS             1
 #define MSG_FAIL                0
 
-#define IRQ_GPIO                "25"
+// A client subscribes to a region of Amiga memory with MSG_SUBSCRIBE_REQ,
+// whose payload is address (u32), length (u32), trigger (u8) and interval in
+// ms (u32), in host byte order as for MSG_READ_MEM_REQ, and whose stream id
+// is a subscription id of the client's own choice. a314d reads the region
+// each time the trigger fires, and sends what it read in a MSG_SNAPSHOT to
+// every client that has subscribed to the same region with the same trigger
+// and interval, so that the region is read only once for all of them.
+#define SNAPSHOT_ON_DEMAND      0   // when a subscriber sends MSG_SNAPSHOT_REQ
+#define SNAPSHOT_INTERVAL       1   // every interval
+#define SNAPSHOT_ON_A2R         2   // after the Amiga has sent packets, at most once per interval
+
+#define SUBSCRIBE_REQ_LEN       13
+#define SNAPSHOT_MAX_LENGTH     65532
+
+// MSG_SUBSCRIBE_REQ may have a flags byte after the interval. With
+// SNAPSHOT_FLAG_DELTA, a314d keeps a shadow copy of the region, and a
+// MSG_SNAPSHOT only has what changed since the one before it, as runs of
+// offset (u32) and length (u32), in host byte order, each followed by the
+// bytes of the run. The first snapshot, and the one after a snapshot that
+// the client missed, is a single run of the whole region. Changes are found
+// a block at a time, and the runs are trimmed to the bytes that changed.
+#define SNAPSHOT_FLAG_DELTA     1
+#define DELTA_BLOCK             64
+#define DELTA_RUN_HDR_LEN       8
+
+// A client, typically one on another host, can ask with MSG_COMPRESS_REQ,
+// whose payload is the algorithm (u8), to have large MSG_READ_MEM_RES and
+// MSG_SNAPSHOT payloads compressed, and is answered MSG_SUCCESS or MSG_FAIL
+// in MSG_COMPRESS_RES. A compressed message has MSG_FLAG_COMPRESSED set in
+// its type, and its payload is the uncompressed length (u32, host byte
+// order) followed by an LZ4 block, which any LZ4 library can decompress.
+// Payloads shorter than COMPRESS_MIN_LENGTH, and those that don't get
+// smaller, are sent as they are.
+#define COMPRESS_NONE           0
+#define COMPRESS_LZ4            1
+#define MSG_FLAG_COMPRESSED     0x80
+#define COMPRESS_MIN_LENGTH     256
+#define COMPRESS_HDR_LEN        4
+
+#define LZ4_MIN_MATCH           4
+#define LZ4_LAST_LITERALS       5
+#define LZ4_MFLIMIT             12
+#define LZ4_MAX_OFFSET          65535
+#define LZ4_HASH_BITS           12
+#define LZ4_SKIP_TRIGGER        6
+
+// A bulk service asks with MSG_ALLOC_REQ, whose payload is a length (u32)
+// and whose stream id is a tag of its own choice, for a slice of the
+// transfer window of the board that its memory requests go to, rather than
+// having the Amiga side allocate a buffer and send its address. It is
+// answered in MSG_ALLOC_RES, with the same tag, with MSG_SUCCESS or MSG_FAIL
+// followed by the address (u32) of the slice, and reads and writes the slice
+// with MSG_READ_MEM_REQ and MSG_WRITE_MEM_REQ. MSG_FREE_REQ, whose payload is
+// the address, gives a slice back, and isn't answered. The slices of a client
+// are freed when it disconnects. Slices are aligned to WINDOW_ALIGN bytes.
+// The interface is experimental and is only of use with the simulated Amiga,
+// as a314.device doesn't offer a window; on real hardware every MSG_ALLOC_REQ
+// fails.
+#define WINDOW_ALIGN            16
+#define ALLOC_RES_LEN           5
+
+// Services that are built into a314d, used to benchmark the physical
+// channel without any client in the way. See a314bench/README.md.
+#define BUILTIN_NONE            0
+#define BUILTIN_ECHO            1
+#define BUILTIN_SINK            2
+#define BUILTIN_SOURCE          3
+
+#define DEFAULT_SPI_DEVICE      "/dev/spidev0.0"
+#define DEFAULT_IRQ_GPIO        "25"
 
 static sigset_t original_sigset;
 
@@ -113,30 +319,110 @@ static uint8_t mode = SPI_CS_HIGH;
 static uint8_t bits = 8;
 static uint32_t speed = 67000000;
 
-static int spi_fd = -1;
+// SPI clock calibration, with --spi-calibrate ADDRESS. Test patterns are
+// written to CALIBRATE_LENGTH bytes of SRAM at ADDRESS, and read back, at
+// each of the SPI clocks in turn, from the slowest up, until one gives an
+// error. The board then runs one rate below the fastest that passed, for
+// margin. What was at ADDRESS is read first, and written back afterwards,
+// at CALIBRATE_SAFE_HZ, but the Amiga must not use that memory while a314d
+// runs.
+//
+// With --spi-verify SECONDS as well, the SPI thread repeats a round of
+// patterns at the board's rate that often, counts the bytes that come back
+// wrong, and moves the board one rate down if any did.
+#define CALIBRATE_LENGTH        1024
+#define CALIBRATE_ROUNDS        12
+#define CALIBRATE_PATTERNS      6
+#define CALIBRATE_SAFE_HZ       16000000
+
+// The SPI clock is the core clock divided by an even number: spidev rounds
+// the divider for the speed it is asked for up to one. Calibration steps
+// through the clocks of the dividers, so that every step is a different
+// clock, and rates are logged as the clock they give. The core clock is
+// given with --spi-core-hz, or read from the kernel's clock tree when
+// calibration starts; the speed of a board that isn't calibrated is passed
+// to spidev as it is.
+#define DEFAULT_SPI_CORE_HZ     250000000
+
+static const char *const spi_core_clk_files[] =
+{
+    "/sys/kernel/debug/clk/vpu/clk_rate",
+    "/sys/kernel/debug/clk/fw-clk-core/clk_rate",
+};
+
+static const int spi_dividers[] = {16, 12, 10, 8, 6, 4, 2};
+#define SPI_RATE_COUNT          (int)(sizeof(spi_dividers) / sizeof(spi_dividers[0]))
+
+static uint32_t spi_core_hz = 0;
 
-static unsigned char tx_buf[65536];
-static unsigned char rx_buf[65536];
+static uint32_t spi_rate_hz(int rate)
+{
+    return spi_core_hz / spi_dividers[rate];
+}
 
-static bool gpio_exported = false;
-static bool gpio_edge_set = false;
-static int gpio_fd = -1;
+static bool calibrate_spi_enabled = false;
+static unsigned int calibrate_address = 0;
+static int spi_verify_s = 0;
 
+static int server_port = 7110;
 static int server_socket = -1;
 
 static int epfd = -1;
 
-static bool have_base_address = false;
-static unsigned int base_address = 0;
+// Ring occupancy and SPI duty-cycle profiler, enabled with --profile.
+// One ProfileSample is appended to the profile file for every IRQ that
+// read the channel status, and a summary is logged when a314d shuts down.
+#define PROFILE_MAGIC           "A314PRF1"
+
+// A2R is counted as full when it has no room for even a one byte packet.
+#define PROFILE_A2R_FULL_ROOM   4
+
+#define PROFILE_FLAG_A2R_FULL   1
+#define PROFILE_FLAG_R2A_FULL   2
+
+#pragma pack(push, 1)
+struct ProfileSample
+{
+    uint32_t delta_us;
+    uint32_t spi_busy_ns;
+    uint16_t a2r_used;
+    uint16_t r2a_used;
+    uint16_t bytes_in;
+    uint16_t bytes_out;
+    uint8_t events;
+    uint8_t flags;
+};
+#pragma pack(pop)
 
-static uint8_t channel_status[4];
-static uint8_t channel_status_updated = 0;
+struct Profiler
+{
+    bool enabled;
+    FILE *f;
+
+    uint64_t start_ns;
+    uint64_t last_sample_ns;
+    uint64_t spi_busy_ns;
+    uint64_t irq_spi_busy_ns;
+
+    uint64_t irqs;
+    uint64_t spurious_irqs;
+    uint64_t samples;
+    uint64_t a2r_full;
+    uint64_t r2a_full;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    uint64_t a2r_hist[256];
+    uint64_t r2a_hist[256];
+};
 
-static uint8_t recv_buf[256];
-static uint8_t send_buf[256];
+static const char *profile_filename = nullptr;
 
 struct LogicalChannel;
 struct ClientConnection;
+struct Board;
+struct Plugin;
+struct OnDemandStart;
 
 #pragma pack(push, 1)
 struct MessageHeader
@@ -155,8 +441,60 @@ struct MessageBuffer
 
 struct RegisteredService
 {
+    ClientConnection *cc;
+
+    // The board the service was registered for, as NAME@BOARD, or nullptr
+    // if it serves all boards.
+    Board *board;
+};
+
+// Everything that is offered under one service name, or, for a name that
+// was registered as PREFIX*, under every name that starts with PREFIX and
+// has nothing offered under a longer match: the registrations of clients
+// and plugins, and the on-demand service of that name. The entries are kept
+// in hash tables, so that a CONNECT is resolved with a lookup rather than by
+// comparing its name with every service, and the name is kept once, here.
+struct ServiceName
+{
+    // As registered, with the * of a prefix.
     std::string name;
+    bool prefix;
+
+    std::list<RegisteredService> registrations;
+    OnDemandStart *on_demand;
+};
+
+struct Subscriber
+{
     ClientConnection *cc;
+    uint32_t id;
+
+    // A delta subscriber is in sync once it has been sent the whole region,
+    // and as long as it takes every snapshot after that.
+    bool delta;
+    bool in_sync;
+};
+
+// A region of memory that is read for all of its subscribers at once.
+struct Snapshot
+{
+    uint32_t id;
+    Board *board;
+    uint32_t address;
+    uint32_t length;
+    int trigger;
+    uint32_t interval_ms;
+
+    std::list<Subscriber> subscribers;
+
+    // What was read last, kept while there are delta subscribers.
+    std::vector<uint8_t> shadow;
+
+    // Set when the trigger has fired, until the read is handed to the SPI
+    // thread. A snapshot has at most one read in flight.
+    bool due;
+    bool in_flight;
+    uint64_t next_ns;
 };
 
 struct PacketBuffer
@@ -169,8 +507,33 @@ struct ClientConnection
 {
     int fd;
 
+    // Identifies the connection in memory requests that are handed to the
+    // SPI thread, as the connection may be gone when the answer comes back.
+    uint32_t id;
+
+    // The board that memory requests go to; the first board, unless the
+    // connection has registered a service for another board, or was started
+    // on demand for a channel on another board.
+    Board *board;
+
+    // Set if this is the connection of an in-process plugin rather than a
+    // socket, in which case fd is -1 and messages become plugin callbacks.
+    Plugin *plugin;
+
+    // Set while this is an idle instance of an on-demand service, started
+    // ahead of time and waiting in the warm pool for a CONNECT.
+    OnDemandStart *warm_for;
+
+    // When an instance of an on-demand service was started for a CONNECT,
+    // until it has sent its first message. Zero otherwise.
+    uint64_t cold_start_ns;
+
     int next_stream_id;
 
+    // COMPRESS_NONE, or the algorithm that the client asked for with
+    // MSG_COMPRESS_REQ.
+    int compression;
+
     int bytes_read;
     MessageHeader header;
     std::vector<uint8_t> payload;
@@ -178,39 +541,486 @@ struct ClientConnection
     std::list<MessageBuffer> message_queue;
 
     std::list<LogicalChannel*> associations;
+
+    // The entries that the connection has registrations in, once for each.
+    std::vector<ServiceName *> registered_names;
 };
 
 struct LogicalChannel
 {
+    Board *board;
     int channel_id;
 
+    // The ring pair, and so the QoS class, of the channel.
+    int ring;
+
     ClientConnection *association;
     int stream_id;
 
     bool got_eos_from_ami;
     bool got_eos_from_client;
 
+    // Set while a channel that a client opened waits for the Amiga to answer
+    // its CONNECT.
+    bool connect_pending;
+
     std::list<PacketBuffer> packet_queue;
+
+    // Per-channel flow control; see CHANNEL_WINDOW. A channel that waits for
+    // credit is left out of the send queue until it gets it.
+    bool flow_control;
+    int send_credit;
+    int consumed;
+    bool credit_stalled;
+    uint64_t stalled_since_ns;
+
+    // State of a built-in benchmark service, if that is what the channel
+    // is connected to.
+    int builtin;
+    uint16_t bench_size;
+    uint32_t bench_remaining;
+    uint32_t bench_bytes;
+    uint64_t bench_start_ns;
 };
 
 static void remove_association(LogicalChannel *ch);
 static void clear_packet_queue(LogicalChannel *ch);
-static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, uint8_t length);
+static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, int length);
+static void create_and_enqueue_data(LogicalChannel *ch, uint8_t *data, int length);
+static void data_delivered(ClientConnection *cc, int stream_id, int length);
 
 static std::list<ClientConnection> connections;
-static std::list<RegisteredService> services;
-static std::list<LogicalChannel> channels;
-static std::list<LogicalChannel*> send_queue;
+static std::unordered_map<std::string, ServiceName> service_names;
+static std::unordered_map<std::string, ServiceName> service_prefixes;
+
+// The lengths of the keys of service_prefixes, longest first.
+static std::vector<int> prefix_lengths;
+static std::list<Snapshot> snapshots;
+static uint32_t next_snapshot_id = 1;
+
+static uint32_t next_connection_id = 1;
+
+// a314d runs one SPI thread per board, and one client thread. A board's SPI
+// thread owns its transport (spidev or the virtual board, and the IRQ) and
+// the rings in its communication area. The client thread owns client
+// connections, services and logical channels. They only talk through a pair
+// of SPSC queues of ThreadMessages per board, so that the IRQ path never
+// waits on a slow client socket or on fork().
+#define TM_PACKET               1
+#define TM_READ_MEM             2
+#define TM_WRITE_MEM            3
+#define TM_CREDIT               4
+#define TM_CHANNELS_RESET       5
+#define TM_STOP                 6
+#define TM_R2A_RESIZED          7
+#define TM_A2R                  8
+#define TM_SNAPSHOT             9
+
+struct FreeDeleter
+{
+    void operator()(uint8_t *p) const { free(p); }
+};
+
+struct ThreadMessage
+{
+    uint8_t kind;
+
+    // TM_PACKET: a packet to R2A. Packets carry the generation of logical
+    // channels they were created in, and are dropped by the SPI thread if
+    // the Amiga has reset the channels since then.
+    uint8_t type;
+    uint8_t channel_id;
+    uint32_t generation;
+
+    // The ring pair, which is also the QoS class, of a TM_PACKET or TM_A2R,
+    // or that a TM_CREDIT or TM_R2A_RESIZED is about.
+    uint8_t ring;
+
+    // TM_READ_MEM, TM_WRITE_MEM and TM_SNAPSHOT, both as request and as
+    // response. A TM_SNAPSHOT has the id of the snapshot in connection_id.
+    uint32_t connection_id;
+    uint32_t address;
+
+    // Memory length for TM_READ_MEM and TM_SNAPSHOT, R2A bytes given back by
+    // TM_CREDIT, the new size of R2A for TM_R2A_RESIZED, whose type is then
+    // true if R2A takes jumbo packets, and the length of a TM_A2R.
+    uint32_t length;
+
+    std::vector<uint8_t> data;
+
+    // What was read for a TM_A2R or TM_SNAPSHOT, which the client thread
+    // hands to clients from where it is. A TM_A2R has everything that was
+    // read from an A2R ring at once, and is parsed in place; type is then
+    // true if the ring has jumbo packets, and flow_control if channels that
+    // CONNECT in it get per-channel flow control.
+    std::unique_ptr<uint8_t, FreeDeleter> buffer;
+    bool flow_control;
+};
+
+#define THREAD_QUEUE_SIZE       4096
+
+// Bytes of packets (including headers) that the client thread may hand to
+// the SPI thread before they have been written to R2A. Keeps a ring's worth
+// of packets ready in the SPI thread, while the rest stays in the channels'
+// packet queues where they are sent round robin and can be dropped on RESET.
+// When larger rings are negotiated the credit grows with R2A. Every ring pair
+// has credit of its own.
+#define R2A_CREDIT              512
+
+// The IRQ is an edge on a GPIO pin. If an edge is lost then R_EVENTS is never
+// read, so the IRQ is never re-armed either, and every channel stalls. While
+// logical channels are open, or R2A holds data the Amiga hasn't taken yet,
+// the watchdog polls R_EVENTS if no IRQ has arrived within the deadline, and
+// counts the events that were recovered that way.
+static int watchdog_deadline_ms = 100;
+
+struct Watchdog
+{
+    uint64_t last_activity_ns;
+
+    uint64_t polls;
+    uint64_t recoveries;
+};
+
+// Set with --realtime PRIO. Memory is locked and malloc keeps what it has
+// been given, so that the SPI threads don't take page faults, and the SPI
+// threads run at SCHED_FIFO priority PRIO.
+//
+// Each SPI thread then also measures its own scheduling latency, in the way
+// of cyclictest: a periodic timer is added to its epoll set, and how late the
+// thread gets to each expiry is recorded in a histogram of microseconds.
+static int realtime_priority = 0;
+
+#define LATENCY_PROBE_PERIOD_NS 10000000ULL
+
+struct LatencyProbe
+{
+    int timer_fd;
+    uint64_t start_ns;
+    uint64_t expirations;
+
+    uint64_t samples;
+    uint64_t max_us;
+    uint64_t hist[256];
+};
+
+// Where a ring is in SRAM. size is a power of two.
+struct RingLayout
+{
+    bool extended;
+    bool jumbo;
+    unsigned int address;
+    int size;
+};
+
+// An A2R and an R2A ring, and the packets that wait for room in R2A.
+struct RingPair
+{
+    RingLayout a2r;
+    RingLayout r2a;
+
+    // Queue pointers, indexed by the legacy offsets whatever the layout.
+    uint16_t channel_status[4];
+    bool pointers_updated;
+
+    std::deque<ThreadMessage> r2a_pending;
+};
+
+// WRITE_MEM requests that the SPI thread has combined, and not yet written.
+struct WriteBurst
+{
+    unsigned int address;
+    std::vector<uint8_t> data;
+};
+
+// A slice of a board's transfer window that a client has.
+struct WindowSlice
+{
+    unsigned int address;
+    unsigned int length;
+    ClientConnection *cc;
+};
+
+// Everything about one A314 board. The transport, the rings and the rest of
+// the SPI thread's state are only touched by the board's SPI thread, and the
+// logical channels only by the client thread.
+struct Board
+{
+    int index;
+
+    // Either an spidev device and the GPIO of its IRQ, or, when virtual_name
+    // is set, a simulated board; see virtual_a314.h.
+    std::string spi_device;
+    std::string irq_gpio;
+    std::string virtual_board_name;
+    const char *virtual_name;
+    VirtualA314 virtual_board;
+
+    int spi_fd;
+
+    bool gpio_exported;
+    bool gpio_edge_set;
+    int gpio_fd;
+
+    unsigned char tx_buf[65536];
+    unsigned char rx_buf[65536];
+
+    // SPI thread.
+    pthread_t thread;
+    int cpu;
+    int epfd;
+
+    bool have_base_address;
+    unsigned int base_address;
+
+    uint8_t channel_status_updated;
+
+    // Set while reads of the extended pointers come back torn, so that it is
+    // logged once.
+    bool ext_pointers_torn;
+
+    // A2R and R2A start out as the legacy rings in the communication area,
+    // in the first pair, and move to the extended area one at a time; see
+    // PKT_SETTINGS. a2r_count and r2a_count are the pairs whose A2R and R2A
+    // rings are in use.
+    RingPair rings[QOS_CLASSES];
+    int a2r_count;
+    int r2a_count;
+    unsigned int ext_address;
+    uint8_t settings_reply[5];
+    bool settings_reply_pending;
+    bool a2r_switched;
+
+    uint8_t send_buf[MAX_RING_SIZE];
+
+    Profiler profiler;
+    Watchdog watchdog;
+    LatencyProbe latency;
+
+    // The SPI clock of the board, and when it is calibrated, the index of its
+    // divider in spi_dividers; see init_spi_speed().
+    uint32_t spi_speed;
+    int spi_rate;
+    uint64_t spi_verify_next_ns;
+    uint64_t spi_verifications;
+    uint64_t spi_verify_errors;
+
+    // WRITE_MEM requests are written as disjoint bursts, and answered in
+    // order, before anything else is read or written; see
+    // combine_write_mem().
+    std::vector<WriteBurst> write_bursts;
+    std::vector<ThreadMessage> write_completions;
+    uint64_t mem_writes;
+    uint64_t mem_write_bursts;
+
+    uint32_t spi_generation;
+    std::deque<ThreadMessage> to_client_backlog;
+    bool a2r_deferred;
+    bool spi_stop;
+
+    // Between the threads.
+    SpscQueue<ThreadMessage, THREAD_QUEUE_SIZE> to_spi_queue;
+    SpscQueue<ThreadMessage, THREAD_QUEUE_SIZE> to_client_queue;
+    int spi_wake_fd;
+    int client_wake_fd;
+
+    // Written by the client thread, so that the watchdog knows if there are
+    // logical channels open.
+    std::atomic<int> open_channel_count;
+
+    // Client thread.
+    std::list<LogicalChannel> channels;
+    std::list<LogicalChannel*> send_queue[QOS_CLASSES];
+    int r2a_credit[QOS_CLASSES];
+    int r2a_credit_limit[QOS_CLASSES];
+    int max_payload;
+    uint32_t channels_generation;
+    int active_bench_sources;
+    int next_channel_id;
+
+    // How often channels have had to wait for credit from the Amiga, and
+    // for how long in all.
+    uint64_t credit_stalls;
+    uint64_t credit_stall_ns;
+
+    // The transfer window that the Amiga has offered, if window_length isn't
+    // 0, and the slices of it that clients have, in order of address.
+    unsigned int window_address;
+    unsigned int window_length;
+    std::vector<WindowSlice> window_slices;
+    unsigned int window_used;
+    unsigned int window_max_used;
+    uint64_t window_allocs;
+    uint64_t window_alloc_fails;
+    bool window_missing_logged;
+
+    // Set once the Amiga has sent SETTINGS_LISTEN since its base address.
+    bool amiga_listens;
+};
+
+static std::list<Board> boards;
+
+// Called on the client thread, and before the threads start.
+static void reset_r2a_credit(Board *b)
+{
+    for (int i = 0; i < QOS_CLASSES; i++)
+    {
+        b->r2a_credit[i] = R2A_CREDIT;
+        b->r2a_credit_limit[i] = R2A_CREDIT;
+    }
+    b->max_payload = LEGACY_MAX_PAYLOAD;
+}
+
+static Board *add_board()
+{
+    boards.emplace_back();
+
+    Board *b = &boards.back();
+    b->index = boards.size() - 1;
+    b->spi_device = DEFAULT_SPI_DEVICE;
+    b->irq_gpio = DEFAULT_IRQ_GPIO;
+    b->virtual_name = nullptr;
+    b->spi_fd = -1;
+    b->gpio_fd = -1;
+    b->cpu = -1;
+    b->latency.timer_fd = -1;
+    b->epfd = -1;
+    b->spi_wake_fd = -1;
+    b->client_wake_fd = -1;
+    for (auto &rp : b->rings)
+    {
+        rp.a2r.size = LEGACY_RING_SIZE;
+        rp.r2a.size = LEGACY_RING_SIZE;
+    }
+    b->a2r_count = 1;
+    b->r2a_count = 1;
+    b->next_channel_id = PI_CHANNEL_ID_FIRST;
+    reset_r2a_credit(b);
+    return b;
+}
+
+static Board *add_virtual_board(const char *name)
+{
+    Board *b = add_board();
+    b->virtual_board_name = name;
+    b->virtual_name = b->virtual_board_name.c_str();
+    return b;
+}
+
+#ifndef A314D_NO_MAIN
+// SPEC is virtual:NAME, or DEVICE[:GPIO], e.g. /dev/spidev0.1:24.
+static Board *add_board_from_spec(const char *spec)
+{
+    if (strncmp(spec, "virtual:", 8) == 0)
+        return add_virtual_board(spec + 8);
+
+    Board *b = add_board();
+    const char *colon = strchr(spec, ':');
+    if (colon == nullptr)
+        b->spi_device = spec;
+    else
+    {
+        b->spi_device = std::string(spec, colon - spec);
+        b->irq_gpio = colon + 1;
+    }
+    return b;
+}
+#endif
+
+static Board *get_board_by_index(int index)
+{
+    for (auto &b : boards)
+        if (b.index == index)
+            return &b;
+    return nullptr;
+}
 
 struct OnDemandStart
 {
     std::string service_name;
     std::string program;
     std::vector<std::string> arguments;
+
+    // Up to warm_size instances are kept started and idle, set with --warm.
+    // If one exits before it is used the pool isn't refilled until
+    // next_refill_ns, so that a service that fails to start isn't restarted
+    // in a loop.
+    int warm_size;
+    uint64_t next_refill_ns;
 };
 
 std::vector<OnDemandStart> on_demand_services;
 
+// Instances of on-demand services are started with posix_spawn(), which
+// doesn't copy a314d's address space as fork() did. Spawn time is what the
+// client thread spends in posix_spawnp(), and ready time is from a CONNECT
+// until an instance started for it sends its first message.
+struct SpawnStats
+{
+    uint64_t spawns;
+    uint64_t failures;
+    uint64_t spawn_ns;
+    uint64_t max_spawn_ns;
+
+    uint64_t cold_starts;
+    uint64_t ready_ns;
+    uint64_t max_ready_ns;
+};
+
+static SpawnStats spawn_stats;
+
+// A payload that is sent to several clients is compressed once, the first
+// time that one of them has asked for compression.
+struct CompressedPayload
+{
+    bool done;
+
+    // Empty if the payload didn't compress.
+    std::vector<uint8_t> data;
+};
+
+struct CompressionStats
+{
+    uint64_t payloads;
+    uint64_t in_bytes;
+    uint64_t out_bytes;
+};
+
+static CompressionStats compression_stats;
+
+// A service in a314d.conf whose program is a shared object is loaded into
+// a314d as a plugin, see a314d_plugin.h.
+struct PluginService
+{
+    std::string service_name;
+    std::string path;
+    std::vector<std::string> arguments;
+};
+
+std::vector<PluginService> plugin_services;
+
+struct Plugin
+{
+    std::string path;
+    void *handle;
+    const A314Plugin *ops;
+    void *state;
+
+    A314PluginHost host;
+
+    // The plugin's stand-in for a client connection, which its streams are
+    // associated with and its services are registered to.
+    ClientConnection *cc;
+};
+
+static std::list<Plugin> plugins;
+
+#ifndef A314D_NO_MAIN
+static bool is_shared_object(const std::string &program)
+{
+    return program.size() > 3 && program.compare(program.size() - 3, 3, ".so") == 0;
+}
+
 static void load_config_file(const char *filename)
 {
     FILE *f = fopen(filename, "rt");
@@ -253,14 +1063,25 @@ static void load_config_file(const char *filename)
             }
         }
 
-        if (parts.size() >= 2)
+        if (parts.size() >= 2 && is_shared_object(parts[1]))
+        {
+            plugin_services.emplace_back();
+            auto &e = plugin_services.back();
+            e.service_name = parts[0];
+            e.path = parts[1];
+            for (size_t i = 1; i < parts.size(); i++)
+                e.arguments.push_back(std::string(parts[i]));
+        }
+        else if (parts.size() >= 2)
         {
             on_demand_services.emplace_back();
             auto &e = on_demand_services.back();
             e.service_name = parts[0];
             e.program = parts[1];
-            for (int i = 1; i < parts.size(); i++)
+            for (size_t i = 1; i < parts.size(); i++)
                 e.arguments.push_back(std::string(parts[i]));
+            e.warm_size = 0;
+            e.next_refill_ns = 0;
         }
         else if (parts.size() != 0)
             logger_warn("Invalid number of columns in configuration file line: %s\n", org_line);
@@ -270,949 +1091,3946 @@ static void load_config_file(const char *filename)
 
     fclose(f);
 
-    if (on_demand_services.empty())
+    if (on_demand_services.empty() && plugin_services.empty())
         logger_warn("No registered services\n");
 }
+#endif
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-static int init_spi()
+static int init_profiler(Board *b, const char *filename)
 {
-    spi_fd = open("/dev/spidev0.0", O_RDWR | O_CLOEXEC);
-    if (spi_fd < 0)
+    b->profiler.f = fopen(filename, "wb");
+    if (b->profiler.f == nullptr)
+    {
+        logger_error("Unable to open profile file %s\n", filename);
         return -1;
+    }
 
-    int ret = ioctl(spi_fd, SPI_IOC_WR_MODE, &mode);
-    ret |= ioctl(spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
-    ret |= ioctl(spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
-    if (ret != 0)
-        return ret;
+    setvbuf(b->profiler.f, nullptr, _IOFBF, 65536);
+    fwrite(PROFILE_MAGIC, 1, 8, b->profiler.f);
 
+    b->profiler.enabled = true;
+    b->profiler.start_ns = monotonic_ns();
+    b->profiler.last_sample_ns = b->profiler.start_ns;
     return 0;
 }
 
-static void shutdown_spi()
+static uint64_t histogram_percentile(const uint64_t *hist, uint64_t count, int percent)
 {
-    if (spi_fd != -1)
-        close(spi_fd);
+    uint64_t rank = (count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < 256; i++)
+    {
+        seen += hist[i];
+        if (seen >= rank && seen != 0)
+            return i;
+    }
+    return 255;
 }
 
-static int transfer(int len)
+static double histogram_mean(const uint64_t *hist, uint64_t count)
 {
-    struct spi_ioc_transfer tr =
-    {
-        .tx_buf = (uintptr_t)tx_buf,
-        .rx_buf = (uintptr_t)rx_buf,
-        .len = (uint32_t)len,
-        .speed_hz = speed,
-        .delay_usecs = 0,
-        .bits_per_word = bits,
-        .cs_change = 0,
-    };
+    if (count == 0)
+        return 0.0;
 
-    return ioctl(spi_fd, SPI_IOC_MESSAGE(1), &tr);
+    double sum = 0.0;
+    for (int i = 0; i < 256; i++)
+        sum += (double)i * hist[i];
+    return sum / count;
 }
 
-static void spi_read_mem(unsigned int address, unsigned int length)
+static void profile_irq_begin(Board *b)
 {
-    logger_trace("SPI read mem address = %d length = %d\n", address, length);
-
-    unsigned int header = (READ_SRAM_CMD << 20) | (address & 0xfffff);
-
-    tx_buf[0] = (uint8_t)((header >> 16) & 0xff);
-    tx_buf[1] = (uint8_t)((header >> 8) & 0xff);
-    tx_buf[2] = (uint8_t)(header & 0xff);
-	tx_buf[3] = 0;
-
-    transfer(length + 4);
+    b->profiler.irqs++;
+    b->profiler.irq_spi_busy_ns = b->profiler.spi_busy_ns;
 }
 
-static void spi_write_mem(unsigned int address, uint8_t *buf, unsigned int length)
+// With several ring pairs the profile counts them together.
+static int a2r_capacity(Board *b)
 {
-    logger_trace("SPI write mem address = %d length = %d\n", address, length);
-
-    unsigned int header = (WRITE_SRAM_CMD << 20) | (address & 0xfffff);
-
-    tx_buf[0] = (uint8_t)((header >> 16) & 0xff);
-    tx_buf[1] = (uint8_t)((header >> 8) & 0xff);
-    tx_buf[2] = (uint8_t)(header & 0xff);
-
-    memcpy(&tx_buf[3], buf, length);
-    transfer(length + 3);
+    int size = 0;
+    for (int i = 0; i < b->a2r_count; i++)
+        size += b->rings[i].a2r.size;
+    return size;
 }
 
-static uint8_t spi_read_cmem(unsigned int address)
+static int r2a_capacity(Board *b)
 {
-    tx_buf[0] = (uint8_t)((READ_CMEM_CMD << 4) | (address & 0xf));
-    tx_buf[1] = 0;
-    transfer(2);
-    logger_trace("SPI read cmem, address = %d, returned = %d\n", address, rx_buf[1]);
-    return rx_buf[1];
+    int size = 0;
+    for (int i = 0; i < b->r2a_count; i++)
+        size += b->rings[i].r2a.size;
+    return size;
 }
 
-static void spi_write_cmem(unsigned int address, unsigned int data)
+static void profile_irq_end(Board *b, uint8_t events, int a2r_used, int r2a_used, int bytes_in, int bytes_out, bool a2r_full, bool r2a_blocked)
 {
-    logger_trace("SPI write cmem, address = %d, data = %d\n", address, data);
+    uint64_t now = monotonic_ns();
+
+    ProfileSample ps;
+    ps.delta_us = (uint32_t)std::min<uint64_t>((now - b->profiler.last_sample_ns) / 1000, UINT32_MAX);
+    ps.spi_busy_ns = (uint32_t)std::min<uint64_t>(b->profiler.spi_busy_ns - b->profiler.irq_spi_busy_ns, UINT32_MAX);
+    ps.a2r_used = a2r_used;
+    ps.r2a_used = r2a_used;
+    ps.bytes_in = bytes_in;
+    ps.bytes_out = bytes_out;
+    ps.events = events;
+    ps.flags = 0;
+
+    if (a2r_full)
+    {
+        ps.flags |= PROFILE_FLAG_A2R_FULL;
+        b->profiler.a2r_full++;
+    }
+
+    if (r2a_blocked)
+    {
+        ps.flags |= PROFILE_FLAG_R2A_FULL;
+        b->profiler.r2a_full++;
+    }
 
-    tx_buf[0] = (uint8_t)((WRITE_CMEM_CMD << 4) | (address & 0xf));
-    tx_buf[1] = (uint8_t)(data & 0xf);
-    transfer(2);
+    b->profiler.last_sample_ns = now;
+    b->profiler.samples++;
+    b->profiler.bytes_in += bytes_in;
+    b->profiler.bytes_out += bytes_out;
+    // The histograms have 256 buckets across each ring, which for the legacy
+    // rings are bytes.
+    b->profiler.a2r_hist[std::min(a2r_used * 256 / a2r_capacity(b), 255)]++;
+    b->profiler.r2a_hist[std::min(r2a_used * 256 / r2a_capacity(b), 255)]++;
+
+    fwrite(&ps, sizeof(ps), 1, b->profiler.f);
 }
 
-static uint8_t spi_ack_irq()
+static void shutdown_profiler(Board *b)
 {
-    logger_trace("SPI ack_irq\n");
-    return spi_read_cmem(R_EVENTS_ADDRESS);
+    if (!b->profiler.enabled)
+        return;
+
+    b->profiler.enabled = false;
+    fclose(b->profiler.f);
+
+    uint64_t wall_ns = monotonic_ns() - b->profiler.start_ns;
+    uint64_t n = b->profiler.samples;
+    double pct = n ? 100.0 / n : 0.0;
+
+    logger_info("Profile summary for board %d: %.3f s wall time, %llu IRQs (%llu without events), %llu samples\n",
+            b->index, wall_ns / 1e9, (unsigned long long)b->profiler.irqs, (unsigned long long)b->profiler.spurious_irqs, (unsigned long long)n);
+    logger_info("  SPI busy %.3f s, duty cycle %.2f%%\n",
+            b->profiler.spi_busy_ns / 1e9, wall_ns ? 100.0 * b->profiler.spi_busy_ns / wall_ns : 0.0);
+    logger_info("  A2R occupancy mean %.1f p99 %llu, full in %.2f%% of IRQs, %llu bytes in (%.1f per IRQ)\n",
+            histogram_mean(b->profiler.a2r_hist, n) * a2r_capacity(b) / 256,
+            (unsigned long long)histogram_percentile(b->profiler.a2r_hist, n, 99) * a2r_capacity(b) / 256,
+            b->profiler.a2r_full * pct, (unsigned long long)b->profiler.bytes_in, n ? (double)b->profiler.bytes_in / n : 0.0);
+    logger_info("  R2A occupancy mean %.1f p99 %llu, full in %.2f%% of IRQs, %llu bytes out (%.1f per IRQ)\n",
+            histogram_mean(b->profiler.r2a_hist, n) * r2a_capacity(b) / 256,
+            (unsigned long long)histogram_percentile(b->profiler.r2a_hist, n, 99) * r2a_capacity(b) / 256,
+            b->profiler.r2a_full * pct, (unsigned long long)b->profiler.bytes_out, n ? (double)b->profiler.bytes_out / n : 0.0);
 }
 
-static int open_write_close(const char *filename, const char *text)
+static int init_spi(Board *b)
 {
-    int fd = open(filename, O_WRONLY);
-    if (fd == -1)
+    if (b->virtual_name != nullptr)
+    {
+        if (b->virtual_board.open(b->virtual_name, VIRTUAL_A314_PI) != 0)
+        {
+            logger_error("Unable to open virtual A314 %s\n", b->virtual_name);
+            return -1;
+        }
+        return 0;
+    }
+
+    b->spi_fd = open(b->spi_device.c_str(), O_RDWR | O_CLOEXEC);
+    if (b->spi_fd < 0)
+    {
+        logger_error("Unable to open %s\n", b->spi_device.c_str());
         return -1;
+    }
+
+    int ret = ioctl(b->spi_fd, SPI_IOC_WR_MODE, &mode);
+    ret |= ioctl(b->spi_fd, SPI_IOC_WR_BITS_PER_WORD, &bits);
+    ret |= ioctl(b->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed);
+    if (ret != 0)
+        return ret;
 
-    write(fd, text, strlen(text));
-    close(fd);
     return 0;
 }
 
-static void sleep_10ms()
+static void shutdown_spi(Board *b)
 {
-    struct timespec delay;
-    delay.tv_sec = 0;
-    delay.tv_nsec = 10000000L;
-    nanosleep(&delay, NULL);
+    if (b->spi_fd != -1)
+        close(b->spi_fd);
+    b->spi_fd = -1;
+
+    b->virtual_board.close();
 }
 
-static void set_direction()
+static int transfer(Board *b, int len)
 {
-    for (int retry = 0; retry < 100; retry++)
+    if (b->virtual_name != nullptr)
     {
-        int fd = open("/sys/class/gpio/gpio" IRQ_GPIO "/direction", O_WRONLY);
-        if (fd != -1)
+        if (!b->profiler.enabled)
         {
-            write(fd, "in", 2);
-            close(fd);
-            break;
+            b->virtual_board.spi_transfer(b->tx_buf, b->rx_buf, len);
+            return len;
         }
-        sleep_10ms();
+
+        uint64_t start = monotonic_ns();
+        b->virtual_board.spi_transfer(b->tx_buf, b->rx_buf, len);
+        b->profiler.spi_busy_ns += monotonic_ns() - start;
+        return len;
     }
+
+    // Zeroed first, as the fields that follow cs_change differ between
+    // kernel versions.
+    struct spi_ioc_transfer tr;
+    memset(&tr, 0, sizeof(tr));
+    tr.tx_buf = (uintptr_t)b->tx_buf;
+    tr.rx_buf = (uintptr_t)b->rx_buf;
+    tr.len = (uint32_t)len;
+    tr.speed_hz = b->spi_speed;
+    tr.bits_per_word = bits;
+
+    if (!b->profiler.enabled)
+        return ioctl(b->spi_fd, SPI_IOC_MESSAGE(1), &tr);
+
+    uint64_t start = monotonic_ns();
+    int ret = ioctl(b->spi_fd, SPI_IOC_MESSAGE(1), &tr);
+    b->profiler.spi_busy_ns += monotonic_ns() - start;
+    return ret;
 }
 
-static int init_gpio()
+static void spi_read_mem(Board *b, unsigned int address, unsigned int length)
 {
-    if (open_write_close("/sys/class/gpio/export", IRQ_GPIO) != 0)
-        return -1;
+    logger_trace("SPI read mem address = %d length = %d\n", address, length);
 
-    gpio_exported = true;
+    unsigned int header = (READ_SRAM_CMD << 20) | (address & 0xfffff);
 
-    set_direction();
+    b->tx_buf[0] = (uint8_t)((header >> 16) & 0xff);
+    b->tx_buf[1] = (uint8_t)((header >> 8) & 0xff);
+    b->tx_buf[2] = (uint8_t)(header & 0xff);
+	b->tx_buf[3] = 0;
 
-    if (open_write_close("/sys/class/gpio/gpio" IRQ_GPIO "/edge", "both") == -1)
-        return -1;
+    transfer(b, length + 4);
+}
 
-    gpio_edge_set = true;
+// Transfers that are given to spidev as one message.
+static int transfer_message(Board *b, struct spi_ioc_transfer *tr, int count)
+{
+    uint64_t start = b->profiler.enabled ? monotonic_ns() : 0;
 
-    gpio_fd = open("/sys/class/gpio/gpio" IRQ_GPIO "/value", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-    if (gpio_fd == -1)
-        return -1;
+    int ret;
+    if (b->virtual_name != nullptr)
+    {
+        VirtualSpiTransfer vt[4];
+        ret = 0;
+        for (int i = 0; i < count; i++)
+        {
+            vt[i].tx = (const uint8_t *)(uintptr_t)tr[i].tx_buf;
+            vt[i].rx = (uint8_t *)(uintptr_t)tr[i].rx_buf;
+            vt[i].len = tr[i].len;
+            vt[i].cs_change = tr[i].cs_change != 0;
+            ret += tr[i].len;
+        }
+        b->virtual_board.spi_message(vt, count);
+    }
+    else
+        ret = ioctl(b->spi_fd, SPI_IOC_MESSAGE(count), tr);
 
-    return 0;
+    if (b->profiler.enabled)
+        b->profiler.spi_busy_ns += monotonic_ns() - start;
+    return ret;
 }
 
-static void shutdown_gpio()
+// Reads length1 bytes at address1 followed by length2 bytes at address2,
+// which may be none, into dst, as one SPI message. The command headers are
+// sent from tx_buf, and what is read lands in dst directly, in one piece,
+// even when it is the two ends of a ring.
+static void spi_read_mem_split(Board *b, unsigned int address1, unsigned int length1,
+        unsigned int address2, unsigned int length2, uint8_t *dst)
 {
-    if (gpio_fd != -1)
-        close(gpio_fd);
+    logger_trace("SPI read mem address = %d length = %d, address = %d length = %d\n", address1, length1, address2, length2);
 
-    if (gpio_edge_set)
-        open_write_close("/sys/class/gpio/gpio" IRQ_GPIO "/edge", "none");
+    struct spi_ioc_transfer tr[4];
+    memset(tr, 0, sizeof(tr));
 
-    if (gpio_exported)
-        open_write_close("/sys/class/gpio/unexport", IRQ_GPIO);
-}
+    unsigned int addresses[2] = {address1, address2};
+    unsigned int lengths[2] = {length1, length2};
 
-static int init_server_socket()
-{
-    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (server_socket == -1)
+    int count = 0;
+    for (int i = 0; i < 2 && lengths[i] != 0; i++)
     {
-        logger_error("Failed to create server socket\n");
-        return -1;
+        uint8_t *hdr = &b->tx_buf[i * READ_SRAM_HDR_LEN];
+        unsigned int header = (READ_SRAM_CMD << 20) | (addresses[i] & 0xfffff);
+        hdr[0] = (uint8_t)((header >> 16) & 0xff);
+        hdr[1] = (uint8_t)((header >> 8) & 0xff);
+        hdr[2] = (uint8_t)(header & 0xff);
+        hdr[3] = 0;
+
+        tr[count].tx_buf = (uintptr_t)hdr;
+        tr[count].len = READ_SRAM_HDR_LEN;
+        count++;
+
+        tr[count].rx_buf = (uintptr_t)dst;
+        tr[count].len = lengths[i];
+        dst += lengths[i];
+        count++;
     }
 
-    struct sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(7110);
-
-    int res = bind(server_socket, (struct sockaddr *)&address, sizeof(address));
-    if (res < 0)
+    for (int i = 0; i < count; i++)
     {
-        logger_error("Bind to localhost:7110 failed\n");
-        return -1;
+        tr[i].speed_hz = b->spi_speed;
+        tr[i].bits_per_word = bits;
     }
 
-    listen(server_socket, 16);
+    // Ends the first command before the second one.
+    if (count == 4)
+        tr[1].cs_change = 1;
 
-    return 0;
+    transfer_message(b, tr, count);
 }
 
-static void shutdown_server_socket()
+static void spi_write_mem(Board *b, unsigned int address, uint8_t *buf, unsigned int length)
 {
-    if (server_socket != -1)
-        close(server_socket);
-    server_socket = -1;
+    logger_trace("SPI write mem address = %d length = %d\n", address, length);
+
+    unsigned int header = (WRITE_SRAM_CMD << 20) | (address & 0xfffff);
+
+    b->tx_buf[0] = (uint8_t)((header >> 16) & 0xff);
+    b->tx_buf[1] = (uint8_t)((header >> 8) & 0xff);
+    b->tx_buf[2] = (uint8_t)(header & 0xff);
+
+    memcpy(&b->tx_buf[WRITE_SRAM_HDR_LEN], buf, length);
+    transfer(b, length + WRITE_SRAM_HDR_LEN);
 }
 
-static void sigterm_handler(int signo)
+static uint8_t spi_read_cmem(Board *b, unsigned int address)
 {
+    b->tx_buf[0] = (uint8_t)((READ_CMEM_CMD << 4) | (address & 0xf));
+    b->tx_buf[1] = 0;
+    transfer(b, 2);
+    logger_trace("SPI read cmem, address = %d, returned = %d\n", address, b->rx_buf[1]);
+    return b->rx_buf[1];
 }
 
-static void init_sigterm()
+static void spi_write_cmem(Board *b, unsigned int address, unsigned int data)
 {
-    sigset_t ss;
-    sigemptyset(&ss);
-    sigaddset(&ss, SIGTERM);
-    sigprocmask(SIG_BLOCK, &ss, &original_sigset);
+    logger_trace("SPI write cmem, address = %d, data = %d\n", address, data);
 
-    struct sigaction sa;
+    b->tx_buf[0] = (uint8_t)((WRITE_CMEM_CMD << 4) | (address & 0xf));
+    b->tx_buf[1] = (uint8_t)(data & 0xf);
+    transfer(b, 2);
+}
+
+static uint8_t spi_ack_irq(Board *b)
+{
+    logger_trace("SPI ack_irq\n");
+    return spi_read_cmem(b, R_EVENTS_ADDRESS);
+}
+
+// Every transfer asks for b->spi_speed, and the device's default follows it,
+// so that the board's rate, calibrated or not, is the one in use whichever
+// way the device is driven.
+static void set_spi_speed(Board *b, uint32_t hz)
+{
+    b->spi_speed = hz;
+    if (b->virtual_name != nullptr)
+        b->virtual_board.set_spi_speed(b->spi_speed);
+    else if (ioctl(b->spi_fd, SPI_IOC_WR_MAX_SPEED_HZ, &b->spi_speed) != 0)
+        logger_warn("Unable to set the SPI clock of board %d to %u Hz\n", b->index, b->spi_speed);
+}
+
+static void set_spi_rate(Board *b, int rate)
+{
+    b->spi_rate = rate;
+    set_spi_speed(b, spi_rate_hz(rate));
+}
+
+static void fill_calibration_pattern(uint8_t *buf, int round)
+{
+    uint32_t x = 0x9e3779b9 * (round + 1);
+    for (int i = 0; i < CALIBRATE_LENGTH; i++)
+    {
+        switch (round % CALIBRATE_PATTERNS)
+        {
+        case 0: buf[i] = 0x00; break;
+        case 1: buf[i] = 0xff; break;
+        case 2: buf[i] = (i & 1) ? 0xaa : 0x55; break;
+        case 3: buf[i] = (uint8_t)(1 << (i & 7)); break;
+        case 4: buf[i] = (uint8_t)~(1 << (i & 7)); break;
+        default:
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            buf[i] = (uint8_t)x;
+            break;
+        }
+    }
+}
+
+// Writes a pattern to the scratch region at the board's clock, and reads it
+// back. Returns the number of bytes that came back wrong.
+static int spi_pattern_errors(Board *b, int round)
+{
+    uint8_t pattern[CALIBRATE_LENGTH];
+    fill_calibration_pattern(pattern, round);
+
+    spi_write_mem(b, calibrate_address, pattern, CALIBRATE_LENGTH);
+    spi_read_mem(b, calibrate_address, CALIBRATE_LENGTH);
+
+    int errors = 0;
+    for (int i = 0; i < CALIBRATE_LENGTH; i++)
+    {
+        if (b->rx_buf[READ_SRAM_HDR_LEN + i] != pattern[i])
+            errors++;
+    }
+    return errors;
+}
+
+static void save_scratch(Board *b, uint8_t *saved)
+{
+    uint32_t hz = b->spi_speed;
+    set_spi_speed(b, CALIBRATE_SAFE_HZ);
+    spi_read_mem(b, calibrate_address, CALIBRATE_LENGTH);
+    memcpy(saved, &b->rx_buf[READ_SRAM_HDR_LEN], CALIBRATE_LENGTH);
+    set_spi_speed(b, hz);
+}
+
+static void restore_scratch(Board *b, uint8_t *saved)
+{
+    uint32_t hz = b->spi_speed;
+    set_spi_speed(b, CALIBRATE_SAFE_HZ);
+    spi_write_mem(b, calibrate_address, saved, CALIBRATE_LENGTH);
+    set_spi_speed(b, hz);
+}
+
+// Reads the core clock that the SPI controller divides, if it wasn't given
+// with --spi-core-hz. Reading it needs debugfs, which a314d running as root
+// on Raspberry Pi OS has mounted.
+static void init_spi_core_hz(Board *b)
+{
+    if (spi_core_hz != 0)
+        return;
+
+    if (b->virtual_name == nullptr)
+    {
+        for (const char *filename : spi_core_clk_files)
+        {
+            FILE *f = fopen(filename, "rt");
+            if (f == nullptr)
+                continue;
+
+            unsigned long hz = 0;
+            if (fscanf(f, "%lu", &hz) == 1 && hz != 0)
+                spi_core_hz = (uint32_t)hz;
+            fclose(f);
+
+            if (spi_core_hz != 0)
+            {
+                logger_info("SPI core clock is %.1f MHz\n", spi_core_hz / 1e6);
+                return;
+            }
+        }
+
+        logger_warn("Unable to read the SPI core clock, calibrating for %.0f MHz; give it with --spi-core-hz\n",
+                DEFAULT_SPI_CORE_HZ / 1e6);
+    }
+
+    spi_core_hz = DEFAULT_SPI_CORE_HZ;
+}
+
+// Called before the SPI thread is started.
+static void init_spi_speed(Board *b)
+{
+    set_spi_speed(b, speed);
+
+    if (!calibrate_spi_enabled)
+        return;
+
+    init_spi_core_hz(b);
+
+    uint8_t saved[CALIBRATE_LENGTH];
+    save_scratch(b, saved);
+
+    int passed = -1;
+    bool failed = false;
+    for (int i = 0; i < SPI_RATE_COUNT && !failed; i++)
+    {
+        set_spi_rate(b, i);
+
+        int errors = 0;
+        for (int round = 0; round < CALIBRATE_ROUNDS; round++)
+            errors += spi_pattern_errors(b, round);
+
+        logger_debug("SPI calibration on board %d: %d of %d bytes wrong at %.1f MHz\n",
+                b->index, errors, CALIBRATE_ROUNDS * CALIBRATE_LENGTH, b->spi_speed / 1e6);
+
+        if (errors != 0)
+            failed = true;
+        else
+            passed = i;
+    }
+
+    restore_scratch(b, saved);
+
+    int rate = failed ? passed - 1 : passed;
+    if (rate < 0)
+    {
+        logger_warn("SPI calibration on board %d: errors even at %.1f MHz, running at that anyway\n",
+                b->index, spi_rate_hz(0) / 1e6);
+        rate = 0;
+    }
+    else
+        logger_info("SPI calibration on board %d: %.1f MHz passed, running at %.1f MHz\n",
+                b->index, spi_rate_hz(passed) / 1e6, spi_rate_hz(rate) / 1e6);
+    set_spi_rate(b, rate);
+}
+
+// Returns the epoll timeout until the next verification is due, or -1 if
+// there are none.
+static int spi_verify_timeout(Board *b)
+{
+    if (spi_verify_s == 0)
+        return -1;
+
+    uint64_t now = monotonic_ns();
+    if (b->spi_verify_next_ns == 0)
+        b->spi_verify_next_ns = now + spi_verify_s * 1000000000ULL;
+    return b->spi_verify_next_ns > now ? (int)((b->spi_verify_next_ns - now + 999999) / 1000000) : 0;
+}
+
+static void verify_spi(Board *b)
+{
+    b->spi_verify_next_ns = monotonic_ns() + spi_verify_s * 1000000000ULL;
+
+    uint8_t saved[CALIBRATE_LENGTH];
+    save_scratch(b, saved);
+    int errors = spi_pattern_errors(b, b->spi_verifications++);
+    restore_scratch(b, saved);
+
+    if (errors == 0)
+        return;
+
+    b->spi_verify_errors += errors;
+    if (b->spi_rate == 0)
+    {
+        logger_warn("SPI verification on board %d: %d bytes wrong at %.1f MHz\n", b->index, errors, b->spi_speed / 1e6);
+        return;
+    }
+
+    logger_warn("SPI verification on board %d: %d bytes wrong at %.1f MHz, going down to %.1f MHz\n",
+            b->index, errors, b->spi_speed / 1e6, spi_rate_hz(b->spi_rate - 1) / 1e6);
+    set_spi_rate(b, b->spi_rate - 1);
+}
+
+static void shutdown_spi_verify(Board *b)
+{
+    if (b->spi_verifications != 0)
+        logger_info("SPI on board %d ran at %.1f MHz, and %llu verifications found %llu bytes wrong\n",
+                b->index, b->spi_speed / 1e6, (unsigned long long)b->spi_verifications, (unsigned long long)b->spi_verify_errors);
+}
+
+static int open_write_close(const char *filename, const char *text)
+{
+    int fd = open(filename, O_WRONLY);
+    if (fd == -1)
+        return -1;
+
+    write(fd, text, strlen(text));
+    close(fd);
+    return 0;
+}
+
+static void sleep_10ms()
+{
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 10000000L;
+    nanosleep(&delay, NULL);
+}
+
+static std::string gpio_path(Board *b, const char *file)
+{
+    return "/sys/class/gpio/gpio" + b->irq_gpio + "/" + file;
+}
+
+static void set_direction(Board *b)
+{
+    std::string path = gpio_path(b, "direction");
+
+    for (int retry = 0; retry < 100; retry++)
+    {
+        int fd = open(path.c_str(), O_WRONLY);
+        if (fd != -1)
+        {
+            write(fd, "in", 2);
+            close(fd);
+            break;
+        }
+        sleep_10ms();
+    }
+}
+
+static int init_gpio(Board *b)
+{
+    if (b->virtual_name != nullptr)
+    {
+        b->gpio_fd = b->virtual_board.irq_fd();
+        return 0;
+    }
+
+    if (open_write_close("/sys/class/gpio/export", b->irq_gpio.c_str()) != 0)
+        return -1;
+
+    b->gpio_exported = true;
+
+    set_direction(b);
+
+    if (open_write_close(gpio_path(b, "edge").c_str(), "both") == -1)
+        return -1;
+
+    b->gpio_edge_set = true;
+
+    b->gpio_fd = open(gpio_path(b, "value").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (b->gpio_fd == -1)
+        return -1;
+
+    return 0;
+}
+
+static void shutdown_gpio(Board *b)
+{
+    if (b->gpio_fd != -1 && b->virtual_name == nullptr)
+        close(b->gpio_fd);
+    b->gpio_fd = -1;
+
+    if (b->gpio_edge_set)
+        open_write_close(gpio_path(b, "edge").c_str(), "none");
+    b->gpio_edge_set = false;
+
+    if (b->gpio_exported)
+        open_write_close("/sys/class/gpio/unexport", b->irq_gpio.c_str());
+    b->gpio_exported = false;
+}
+
+static int init_server_socket()
+{
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_socket == -1)
+    {
+        logger_error("Failed to create server socket\n");
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(server_port);
+
+    int flag = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(int));
+
+    int res = bind(server_socket, (struct sockaddr *)&address, sizeof(address));
+    if (res < 0)
+    {
+        logger_error("Bind to localhost:%d failed\n", server_port);
+        return -1;
+    }
+
+    listen(server_socket, 16);
+
+    return 0;
+}
+
+static void shutdown_server_socket()
+{
+    if (server_socket != -1)
+        close(server_socket);
+    server_socket = -1;
+}
+
+static void sigterm_handler(int)
+{
+}
+
+static void init_sigterm()
+{
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGTERM);
+    sigprocmask(SIG_BLOCK, &ss, &original_sigset);
+
+    struct sigaction sa;
     sa.sa_handler = sigterm_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGTERM, &sa, NULL);
 }
 
-static int init_driver()
-{
-    init_sigterm();
+static void init_realtime()
+{
+    if (realtime_priority == 0)
+        return;
+
+    // Freed memory stays with malloc, and large blocks come from the heap
+    // rather than from mmap, so that nothing is given back to the kernel and
+    // faulted in again later. All threads share one arena, as every arena
+    // would otherwise reserve, and now lock, 64 MB of its own.
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+    mallopt(M_ARENA_MAX, 1);
+
+    // This also faults in everything that is mapped, including the buffers
+    // and queues of the boards, and everything that is mapped later.
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        logger_warn("Unable to lock memory for realtime mode; errno = %d\n", errno);
+}
+
+static int init_thread_queues(Board *b)
+{
+    b->spi_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    b->client_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (b->spi_wake_fd == -1 || b->client_wake_fd == -1)
+        return -1;
+
+    reset_r2a_credit(b);
+    b->spi_stop = false;
+    return 0;
+}
+
+static void shutdown_thread_queues(Board *b)
+{
+    if (b->spi_wake_fd != -1)
+        close(b->spi_wake_fd);
+    b->spi_wake_fd = -1;
+
+    if (b->client_wake_fd != -1)
+        close(b->client_wake_fd);
+    b->client_wake_fd = -1;
+}
+
+static int init_board(Board *b)
+{
+    if (profile_filename != nullptr)
+    {
+        // The first board profiles to FILE, and the others to FILE.N.
+        std::string filename(profile_filename);
+        if (b->index != 0)
+            filename += "." + std::to_string(b->index);
+
+        if (init_profiler(b, filename.c_str()) != 0)
+            return -1;
+    }
+
+    if (init_spi(b) != 0)
+        return -1;
+
+    init_spi_speed(b);
+
+    if (init_gpio(b) != 0)
+        return -1;
+
+    if (init_thread_queues(b) != 0)
+        return -1;
+
+    b->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (b->epfd == -1)
+        return -1;
+
+    struct epoll_event ev;
+    ev.events = b->virtual_name != nullptr ? EPOLLIN : EPOLLPRI | EPOLLERR;
+    ev.data.fd = b->gpio_fd;
+    if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, b->gpio_fd, &ev) != 0)
+        return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = b->spi_wake_fd;
+    if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, b->spi_wake_fd, &ev) != 0)
+        return -1;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = b->client_wake_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, b->client_wake_fd, &ev) != 0)
+        return -1;
+
+    if (realtime_priority != 0)
+    {
+        b->latency.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (b->latency.timer_fd == -1)
+            return -1;
+
+        ev.events = EPOLLIN;
+        ev.data.fd = b->latency.timer_fd;
+        if (epoll_ctl(b->epfd, EPOLL_CTL_ADD, b->latency.timer_fd, &ev) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void load_plugins();
+
+static int init_driver()
+{
+    init_sigterm();
+    init_realtime();
+
+    if (init_server_socket() != 0)
+        return -1;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = server_socket;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_socket, &ev) != 0)
+        return -1;
+
+    for (auto &b : boards)
+    {
+        if (init_board(&b) != 0)
+        {
+            logger_error("Unable to initialize board %d\n", b.index);
+            return -1;
+        }
+    }
+
+    load_plugins();
+    return 0;
+}
+
+static void shutdown_watchdog(Board *b);
+static void shutdown_latency_probe(Board *b);
+static void shutdown_flow_control(Board *b);
+static void shutdown_write_mem(Board *b);
+static void shutdown_spi_verify(Board *b);
+static void shutdown_window(Board *b);
+static void unload_plugins();
+static void shutdown_spawn_stats();
+static void shutdown_compression_stats();
+
+static void shutdown_board(Board *b)
+{
+    shutdown_profiler(b);
+    shutdown_watchdog(b);
+    shutdown_latency_probe(b);
+    shutdown_flow_control(b);
+    shutdown_write_mem(b);
+    shutdown_spi_verify(b);
+    shutdown_window(b);
+
+    if (b->epfd != -1)
+        close(b->epfd);
+    b->epfd = -1;
+
+    shutdown_thread_queues(b);
+    shutdown_gpio(b);
+    shutdown_spi(b);
+}
+
+static void shutdown_driver()
+{
+    unload_plugins();
+    shutdown_spawn_stats();
+    shutdown_compression_stats();
+
+    if (epfd != -1)
+        close(epfd);
+    epfd = -1;
+
+    for (auto &b : boards)
+        shutdown_board(&b);
+
+    shutdown_server_socket();
+}
+
+static void wake_thread(int fd)
+{
+    uint64_t one = 1;
+    write(fd, &one, sizeof(one));
+}
+
+static void drain_wake_fd(int fd)
+{
+    uint64_t count;
+    read(fd, &count, sizeof(count));
+}
+
+// Called on the client thread. The SPI thread never waits for the client
+// thread, so if its queue is full it will make room shortly.
+static void send_to_spi(Board *b, ThreadMessage &&tm)
+{
+    bool was_empty;
+    while (!b->to_spi_queue.push(std::move(tm), &was_empty))
+        sched_yield();
+
+    if (was_empty)
+        wake_thread(b->spi_wake_fd);
+}
+
+// Called on the SPI thread. Messages that don't fit in the queue are held in
+// a backlog, as the SPI thread must not wait for the client thread.
+static void send_to_client(Board *b, ThreadMessage &&tm)
+{
+    bool was_empty;
+    if (b->to_client_backlog.empty() && b->to_client_queue.push(std::move(tm), &was_empty))
+    {
+        if (was_empty)
+            wake_thread(b->client_wake_fd);
+        return;
+    }
+
+    b->to_client_backlog.push_back(std::move(tm));
+}
+
+static void flush_to_client_backlog(Board *b)
+{
+    while (!b->to_client_backlog.empty())
+    {
+        bool was_empty;
+        if (!b->to_client_queue.push(std::move(b->to_client_backlog.front()), &was_empty))
+            break;
+
+        b->to_client_backlog.pop_front();
+        if (was_empty)
+            wake_thread(b->client_wake_fd);
+    }
+}
+
+// Messages to a plugin's connection are made into calls to the plugin, which
+// may in turn call the host functions below before returning.
+static void send_msg_to_plugin(ClientConnection *cc, int type, int stream_id, uint8_t *data, int length)
+{
+    Plugin *pl = cc->plugin;
+    const A314Plugin *ops = pl->ops;
+
+    switch (type)
+    {
+    case MSG_CONNECT:
+    {
+        int board = 0;
+        for (auto ch : cc->associations)
+            if (ch->stream_id == stream_id)
+                board = ch->board->index;
+
+        if (ops->connect)
+            ops->connect(pl->state, stream_id, board, (const char *)data, length);
+        break;
+    }
+    case MSG_DATA:
+        if (ops->data)
+            ops->data(pl->state, stream_id, data, length);
+        break;
+    case MSG_EOS:
+        if (ops->eos)
+            ops->eos(pl->state, stream_id);
+        break;
+    case MSG_RESET:
+        if (ops->reset)
+            ops->reset(pl->state, stream_id);
+        break;
+    case MSG_READ_MEM_RES:
+        if (ops->read_mem_res)
+            ops->read_mem_res(pl->state, data, length);
+        break;
+    case MSG_WRITE_MEM_RES:
+        if (ops->write_mem_res)
+            ops->write_mem_res(pl->state);
+        break;
+    }
+}
+
+void create_and_send_msg(ClientConnection *cc, int type, int stream_id, uint8_t *data, int length)
+{
+    if (cc->plugin != nullptr)
+    {
+        send_msg_to_plugin(cc, type, stream_id, data, length);
+        if (type == MSG_DATA)
+            data_delivered(cc, stream_id, length);
+        return;
+    }
+
+    MessageHeader mh;
+    mh.length = length;
+    mh.stream_id = stream_id;
+    mh.type = type;
+
+    if (!length)
+        data = nullptr;
+
+    // The message goes out straight from data, which can be the buffer that
+    // A2R was read into. Only what the socket doesn't take is copied.
+    int sent = 0;
+    if (cc->message_queue.empty())
+    {
+        struct iovec iov[2];
+        iov[0].iov_base = &mh;
+        iov[0].iov_len = sizeof(MessageHeader);
+        iov[1].iov_base = data;
+        iov[1].iov_len = data ? length : 0;
+
+        while (1)
+        {
+            ssize_t r = writev(cc->fd, iov, data ? 2 : 1);
+            if (r == -1)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                else if (errno == ECONNRESET)
+                {
+                    // Do not close connection here; it will get done at some other place.
+                    return;
+                }
+                else
+                {
+                    logger_error("Write failed unexpectedly with errno = %d\n", errno);
+                    exit(-1);
+                }
+            }
+
+            sent += r;
+            if (sent == (int)sizeof(MessageHeader) + (data ? length : 0))
+            {
+                if (type == MSG_DATA)
+                    data_delivered(cc, stream_id, length);
+                return;
+            }
+
+            if (sent < (int)sizeof(MessageHeader))
+            {
+                iov[0].iov_base = (uint8_t *)&mh + sent;
+                iov[0].iov_len = sizeof(MessageHeader) - sent;
+            }
+            else
+            {
+                iov[0].iov_len = 0;
+                iov[1].iov_base = data + sent - sizeof(MessageHeader);
+                iov[1].iov_len = length - (sent - sizeof(MessageHeader));
+            }
+        }
+    }
+
+    MessageBuffer mb;
+    mb.pos = sent;
+    mb.data.resize(sizeof(MessageHeader) + length);
+    memcpy(&mb.data[0], &mh, sizeof(MessageHeader));
+    if (data)
+        memcpy(&mb.data[sizeof(MessageHeader)], data, length);
+    cc->message_queue.push_back(std::move(mb));
+}
+
+// A service registered as NAME@N is only offered on board N, and memory
+// requests from its connection go to that board. A plain NAME is offered on
+// every board. Returns false, with the name left whole, if N isn't a board.
+static bool parse_service_name(ClientConnection *cc, std::string &service_name, Board *&board)
+{
+    service_name.assign((char *)&cc->payload[0], cc->payload.size());
+    board = nullptr;
+
+    size_t at = service_name.rfind('@');
+    if (at == std::string::npos || at + 1 == service_name.size() ||
+            !std::all_of(service_name.begin() + at + 1, service_name.end(), ::isdigit))
+        return true;
+
+    board = get_board_by_index(atoi(service_name.c_str() + at + 1));
+    if (board == nullptr)
+        return false;
+
+    service_name.resize(at);
+    return true;
+}
+
+static void update_prefix_lengths()
+{
+    prefix_lengths.clear();
+    for (auto &e : service_prefixes)
+        prefix_lengths.push_back(e.first.size());
+
+    std::sort(prefix_lengths.begin(), prefix_lengths.end(), std::greater<int>());
+    prefix_lengths.erase(std::unique(prefix_lengths.begin(), prefix_lengths.end()), prefix_lengths.end());
+}
+
+// Returns the entry of a name, or of a prefix if the name ends with *, and
+// creates it if it doesn't exist and create is set.
+static ServiceName *get_service_name(const std::string &name, bool create)
+{
+    bool prefix = !name.empty() && name.back() == '*';
+    auto &table = prefix ? service_prefixes : service_names;
+    std::string key = prefix ? name.substr(0, name.size() - 1) : name;
+
+    auto it = table.find(key);
+    if (it != table.end())
+        return &it->second;
+    if (!create)
+        return nullptr;
+
+    ServiceName &sn = table[key];
+    sn.name = name;
+    sn.prefix = prefix;
+    sn.on_demand = nullptr;
+
+    if (prefix)
+        update_prefix_lengths();
+    return &sn;
+}
+
+// Drops an entry that nothing is offered under any more.
+static void release_service_name(ServiceName *sn)
+{
+    if (!sn->registrations.empty() || sn->on_demand != nullptr)
+        return;
+
+    if (sn->prefix)
+    {
+        service_prefixes.erase(sn->name.substr(0, sn->name.size() - 1));
+        update_prefix_lengths();
+    }
+    else
+    {
+        std::string key = sn->name;
+        service_names.erase(key);
+    }
+}
+
+static bool add_registration(ServiceName *sn, ClientConnection *cc, Board *board)
+{
+    for (auto &srv : sn->registrations)
+        if (srv.board == board)
+            return false;
+
+    sn->registrations.push_back({cc, board});
+    cc->registered_names.push_back(sn);
+    return true;
+}
+
+static bool remove_registration(ServiceName *sn, ClientConnection *cc, Board *board)
+{
+    for (auto it = sn->registrations.begin(); it != sn->registrations.end(); it++)
+    {
+        if (it->cc == cc && it->board == board)
+        {
+            sn->registrations.erase(it);
+
+            auto &names = cc->registered_names;
+            names.erase(std::find(names.begin(), names.end(), sn));
+
+            release_service_name(sn);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void remove_all_registrations(ClientConnection *cc)
+{
+    std::vector<ServiceName *> names;
+    names.swap(cc->registered_names);
+
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    for (auto sn : names)
+    {
+        sn->registrations.remove_if([=](const RegisteredService &srv) { return srv.cc == cc; });
+        release_service_name(sn);
+    }
+}
+
+// A registration for the board takes precedence over one for all boards.
+static RegisteredService *find_registration(ServiceName *sn, Board *b)
+{
+    RegisteredService *found = nullptr;
+    for (auto &srv : sn->registrations)
+        if (srv.board == b || (srv.board == nullptr && found == nullptr))
+            found = &srv;
+    return found;
+}
+
+// The entry that a CONNECT to name on board b goes to: that of the name, if
+// anything is offered on b under it, or else that of the longest prefix of
+// the name that has. The name is looked up in a buffer that is kept, so that
+// the lookups don't allocate.
+static ServiceName *resolve_service(Board *b, const uint8_t *name, int length)
+{
+    static std::string key;
+    key.assign((const char *)name, length);
+
+    auto it = service_names.find(key);
+    if (it != service_names.end() && (it->second.on_demand != nullptr || find_registration(&it->second, b) != nullptr))
+        return &it->second;
+
+    for (int prefix_length : prefix_lengths)
+    {
+        if (prefix_length > length)
+            continue;
+
+        key.resize(prefix_length);
+        it = service_prefixes.find(key);
+        if (it != service_prefixes.end() && (it->second.on_demand != nullptr || find_registration(&it->second, b) != nullptr))
+            return &it->second;
+    }
+    return nullptr;
+}
+
+#ifndef A314D_NO_MAIN
+// The on-demand services in a314d.conf are entered with their names once
+// they are all loaded, as the entries point into on_demand_services. The
+// first line for a name is the one that is used.
+static void enter_on_demand_services()
+{
+    for (auto &on_demand : on_demand_services)
+    {
+        ServiceName *sn = get_service_name(on_demand.service_name, true);
+        if (sn->on_demand == nullptr)
+            sn->on_demand = &on_demand;
+    }
+}
+#endif
+
+static void handle_msg_register_req(ClientConnection *cc)
+{
+    uint8_t result = MSG_FAIL;
+
+    std::string service_name;
+    Board *board;
+    if (!parse_service_name(cc, service_name, board))
+    {
+        create_and_send_msg(cc, MSG_REGISTER_RES, 0, &result, 1);
+        return;
+    }
+
+    ServiceName *sn = get_service_name(service_name, true);
+    if (add_registration(sn, cc, board))
+    {
+        if (board != nullptr)
+            cc->board = board;
+
+        result = MSG_SUCCESS;
+    }
+
+    create_and_send_msg(cc, MSG_REGISTER_RES, 0, &result, 1);
+}
+
+static void handle_msg_deregister_req(ClientConnection *cc)
+{
+    uint8_t result = MSG_FAIL;
+
+    std::string service_name;
+    Board *board;
+    if (!parse_service_name(cc, service_name, board))
+    {
+        create_and_send_msg(cc, MSG_DEREGISTER_RES, 0, &result, 1);
+        return;
+    }
+
+    ServiceName *sn = get_service_name(service_name, false);
+    if (sn != nullptr && remove_registration(sn, cc, board))
+        result = MSG_SUCCESS;
+
+    create_and_send_msg(cc, MSG_DEREGISTER_RES, 0, &result, 1);
+}
+
+// Memory requests are carried out by the SPI thread, in order with the
+// packets that the client has sent before them, and the response is sent to
+// the client when it comes back in handle_spi_message().
+static void read_mem_for_client(ClientConnection *cc, Board *b, uint32_t address, uint32_t length)
+{
+    ThreadMessage tm;
+    tm.kind = TM_READ_MEM;
+    tm.connection_id = cc->id;
+    tm.address = address;
+    tm.length = length;
+    send_to_spi(b, std::move(tm));
+}
+
+static void write_mem_for_client(ClientConnection *cc, Board *b, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    ThreadMessage tm;
+    tm.kind = TM_WRITE_MEM;
+    tm.connection_id = cc->id;
+    tm.address = address;
+    tm.data.assign(data, data + length);
+    send_to_spi(b, std::move(tm));
+}
+
+static void handle_msg_read_mem_req(ClientConnection *cc)
+{
+    read_mem_for_client(cc, cc->board, *(uint32_t *)&(cc->payload[0]), *(uint32_t *)&(cc->payload[4]));
+}
+
+static void handle_msg_write_mem_req(ClientConnection *cc)
+{
+    write_mem_for_client(cc, cc->board, *(uint32_t *)&(cc->payload[0]), &cc->payload[4], cc->payload.size() - 4);
+}
+
+static Snapshot *get_subscribed_snapshot(ClientConnection *cc, uint32_t id)
+{
+    for (auto &sn : snapshots)
+        for (auto &sub : sn.subscribers)
+            if (sub.cc == cc && sub.id == id)
+                return &sn;
+    return nullptr;
+}
+
+// Answered with MSG_SUBSCRIBE_RES, whose stream id is the subscription id.
+// The region is on the board that memory requests of the connection go to.
+static void handle_msg_subscribe_req(ClientConnection *cc)
+{
+    uint32_t id = cc->header.stream_id;
+    uint8_t result = MSG_FAIL;
+
+    int size = cc->payload.size();
+    if ((size == SUBSCRIBE_REQ_LEN || size == SUBSCRIBE_REQ_LEN + 1) && get_subscribed_snapshot(cc, id) == nullptr)
+    {
+        bool delta = size > SUBSCRIBE_REQ_LEN && (cc->payload[SUBSCRIBE_REQ_LEN] & SNAPSHOT_FLAG_DELTA) != 0;
+        uint32_t address = *(uint32_t *)&cc->payload[0];
+        uint32_t length = *(uint32_t *)&cc->payload[4];
+        int trigger = cc->payload[8];
+        uint32_t interval_ms = trigger == SNAPSHOT_ON_DEMAND ? 0 : *(uint32_t *)&cc->payload[9];
+
+        if (length != 0 && length <= SNAPSHOT_MAX_LENGTH && trigger <= SNAPSHOT_ON_A2R &&
+                (trigger != SNAPSHOT_INTERVAL || interval_ms != 0))
+        {
+            Snapshot *found = nullptr;
+            for (auto &sn : snapshots)
+            {
+                if (sn.board == cc->board && sn.address == address && sn.length == length &&
+                        sn.trigger == trigger && sn.interval_ms == interval_ms)
+                    found = &sn;
+            }
+
+            if (found == nullptr)
+            {
+                snapshots.emplace_back();
+
+                found = &snapshots.back();
+                found->id = next_snapshot_id++;
+                found->board = cc->board;
+                found->address = address;
+                found->length = length;
+                found->trigger = trigger;
+                found->interval_ms = interval_ms;
+                found->due = false;
+                found->in_flight = false;
+                found->next_ns = 0;
+            }
+
+            found->subscribers.push_back({cc, id, delta, false});
+            result = MSG_SUCCESS;
+        }
+    }
+
+    create_and_send_msg(cc, MSG_SUBSCRIBE_RES, id, &result, 1);
+}
+
+// Removes one subscription of a client, or all of them. A snapshot without
+// subscribers is dropped, and a read of it that is in flight is ignored
+// when it comes back.
+static void unsubscribe(ClientConnection *cc, bool all, uint32_t id)
+{
+    auto it = snapshots.begin();
+    while (it != snapshots.end())
+    {
+        it->subscribers.remove_if([=](const Subscriber &sub) { return sub.cc == cc && (all || sub.id == id); });
+        if (it->subscribers.empty())
+            it = snapshots.erase(it);
+        else
+        {
+            if (std::none_of(it->subscribers.begin(), it->subscribers.end(), [](const Subscriber &sub) { return sub.delta; }))
+                std::vector<uint8_t>().swap(it->shadow);
+            it++;
+        }
+    }
+}
+
+static void handle_msg_unsubscribe_req(ClientConnection *cc)
+{
+    unsubscribe(cc, false, cc->header.stream_id);
+}
+
+// Asks for a snapshot as soon as the interval allows, whatever the trigger.
+static void handle_msg_snapshot_req(ClientConnection *cc)
+{
+    Snapshot *sn = get_subscribed_snapshot(cc, cc->header.stream_id);
+    if (sn != nullptr)
+        sn->due = true;
+}
+
+static void handle_msg_compress_req(ClientConnection *cc)
+{
+    uint8_t result = MSG_FAIL;
+    if (cc->payload.size() == 1 && (cc->payload[0] == COMPRESS_NONE || cc->payload[0] == COMPRESS_LZ4))
+    {
+        cc->compression = cc->payload[0];
+        result = MSG_SUCCESS;
+    }
+
+    create_and_send_msg(cc, MSG_COMPRESS_RES, 0, &result, 1);
+}
+
+static unsigned int align_window(unsigned int address)
+{
+    return (address + WINDOW_ALIGN - 1) & ~(WINDOW_ALIGN - 1);
+}
+
+// First fit, in the gaps between the slices that are in use.
+static bool alloc_window_slice(Board *b, ClientConnection *cc, uint32_t length, unsigned int &address)
+{
+    unsigned int end = b->window_address + b->window_length;
+    if (length == 0 || length > b->window_length)
+        return false;
+
+    unsigned int candidate = align_window(b->window_address);
+    auto it = b->window_slices.begin();
+    for (; it != b->window_slices.end(); it++)
+    {
+        if (candidate + length <= it->address)
+            break;
+        candidate = align_window(it->address + it->length);
+    }
+
+    if (candidate + length > end)
+        return false;
+
+    b->window_slices.insert(it, WindowSlice{candidate, length, cc});
+    b->window_used += length;
+    b->window_max_used = std::max(b->window_max_used, b->window_used);
+    address = candidate;
+    return true;
+}
+
+// Frees the slice at address, or every slice of the client if all is set.
+static void free_window_slices(Board *b, ClientConnection *cc, bool all, unsigned int address)
+{
+    auto it = b->window_slices.begin();
+    while (it != b->window_slices.end())
+    {
+        if (it->cc == cc && (all || it->address == address))
+        {
+            b->window_used -= it->length;
+            it = b->window_slices.erase(it);
+        }
+        else
+            it++;
+    }
+}
+
+static void handle_msg_alloc_req(ClientConnection *cc)
+{
+    Board *b = cc->board;
+    uint8_t res[ALLOC_RES_LEN] = {MSG_FAIL};
+
+    unsigned int address = 0;
+    if (cc->payload.size() == 4 && b->window_length != 0 &&
+            alloc_window_slice(b, cc, *(uint32_t *)&cc->payload[0], address))
+    {
+        res[0] = MSG_SUCCESS;
+        b->window_allocs++;
+    }
+    else
+    {
+        b->window_alloc_fails++;
+
+        if (b->window_length == 0 && !b->window_missing_logged)
+        {
+            logger_warn("MSG_ALLOC_REQ on board %d, which has offered no transfer window; only the simulated Amiga offers one\n",
+                    b->index);
+            b->window_missing_logged = true;
+        }
+    }
+
+    uint32_t a = address;
+    memcpy(&res[1], &a, sizeof(a));
+    create_and_send_msg(cc, MSG_ALLOC_RES, cc->header.stream_id, res, sizeof(res));
+}
+
+static void handle_msg_free_req(ClientConnection *cc)
+{
+    if (cc->payload.size() == 4)
+        free_window_slices(cc->board, cc, false, *(uint32_t *)&cc->payload[0]);
+}
+
+static void shutdown_window(Board *b)
+{
+    if (b->window_allocs != 0 || b->window_alloc_fails != 0)
+        logger_info("Transfer window on board %d handed out %llu slices, refused %llu, and had at most %u bytes in use\n",
+                b->index, (unsigned long long)b->window_allocs, (unsigned long long)b->window_alloc_fails,
+                b->window_max_used);
+}
+
+// Called on the client thread when the Amiga has sent packets on a board.
+static void trigger_a2r_snapshots(Board *b)
+{
+    for (auto &sn : snapshots)
+        if (sn.board == b && sn.trigger == SNAPSHOT_ON_A2R)
+            sn.due = true;
+}
+
+// Hands the reads of snapshots that are due to the SPI threads. Returns the
+// epoll timeout until the next one is, or -1 if there is none.
+static int run_snapshots()
+{
+    if (snapshots.empty())
+        return -1;
+
+    uint64_t now = monotonic_ns();
+    uint64_t wake_ns = 0;
+
+    for (auto &sn : snapshots)
+    {
+        if (sn.trigger == SNAPSHOT_INTERVAL && now >= sn.next_ns)
+            sn.due = true;
+
+        if (sn.in_flight || !sn.due)
+            continue;
+
+        if (now < sn.next_ns)
+        {
+            if (wake_ns == 0 || sn.next_ns < wake_ns)
+                wake_ns = sn.next_ns;
+            continue;
+        }
+
+        ThreadMessage tm;
+        tm.kind = TM_SNAPSHOT;
+        tm.connection_id = sn.id;
+        tm.address = sn.address;
+        tm.length = sn.length;
+        send_to_spi(sn.board, std::move(tm));
+
+        sn.due = false;
+        sn.in_flight = true;
+        sn.next_ns = now + sn.interval_ms * 1000000ULL;
+    }
+
+    if (wake_ns == 0)
+        return -1;
+    return (int)((wake_ns - now + 999999) / 1000000);
+}
+
+static uint8_t *lz4_put_length(uint8_t *op, uint32_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+// Compresses src into an LZ4 block in dst, greedily, with a single entry
+// hash table. Returns the length of the block, or 0 if it would be longer
+// than capacity. The table is only used from the client thread; stale
+// entries from earlier calls merely fail to match.
+static uint32_t lz4_compress(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t capacity)
+{
+    static uint32_t table[1 << LZ4_HASH_BITS];
+
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + capacity;
+
+    if (length > LZ4_MFLIMIT)
+    {
+        const uint8_t *mflimit = src + length - LZ4_MFLIMIT;
+        const uint8_t *matchlimit = src + length - LZ4_LAST_LITERALS;
+        uint32_t misses = 0;
+
+        while (ip <= mflimit)
+        {
+            uint32_t seq;
+            memcpy(&seq, ip, 4);
+            uint32_t h = (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+            uint32_t pos = ip - src;
+            uint32_t cand = table[h];
+            table[h] = pos;
+
+            uint32_t cand_seq = 0;
+            if (cand < pos && pos - cand <= LZ4_MAX_OFFSET)
+                memcpy(&cand_seq, src + cand, 4);
+            if (cand >= pos || pos - cand > LZ4_MAX_OFFSET || cand_seq != seq)
+            {
+                // Step faster through data that doesn't compress.
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            const uint8_t *match = src + cand;
+            while (ip > anchor && match > src && ip[-1] == match[-1])
+            {
+                ip--;
+                match--;
+            }
+
+            const uint8_t *end = ip + LZ4_MIN_MATCH;
+            const uint8_t *m = match + LZ4_MIN_MATCH;
+            while (end < matchlimit && *end == *m)
+            {
+                end++;
+                m++;
+            }
+
+            uint32_t lit = ip - anchor;
+            uint32_t mlen = end - ip - LZ4_MIN_MATCH;
+            if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+                return 0;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((std::min<uint32_t>(lit, 15) << 4) | std::min<uint32_t>(mlen, 15));
+            if (lit >= 15)
+                op = lz4_put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            uint32_t offset = ip - match;
+            *op++ = (uint8_t)(offset & 0xff);
+            *op++ = (uint8_t)(offset >> 8);
+            if (mlen >= 15)
+                op = lz4_put_length(op, mlen - 15);
+
+            ip = end;
+            anchor = ip;
+        }
+    }
+
+    uint32_t lit = src + length - anchor;
+    if (op + 1 + lit / 255 + 1 + lit > oend)
+        return 0;
+
+    *op++ = (uint8_t)(std::min<uint32_t>(lit, 15) << 4);
+    if (lit >= 15)
+        op = lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+static void compress_payload(const uint8_t *data, uint32_t length, std::vector<uint8_t> &out)
+{
+    out.resize(COMPRESS_HDR_LEN + length);
+    uint32_t n = lz4_compress(data, length, &out[COMPRESS_HDR_LEN], length - COMPRESS_HDR_LEN - 1);
+    if (n == 0)
+        out.clear();
+    else
+    {
+        memcpy(&out[0], &length, 4);
+        out.resize(COMPRESS_HDR_LEN + n);
+    }
+
+    compression_stats.payloads++;
+    compression_stats.in_bytes += length;
+    compression_stats.out_bytes += out.empty() ? length : out.size();
+}
+
+// Sends a MSG_READ_MEM_RES or MSG_SNAPSHOT, compressed if the client has
+// asked for that. cp is shared between the clients the payload is sent to.
+static void send_mem_msg(ClientConnection *cc, int type, int stream_id, uint8_t *data, int length, CompressedPayload &cp)
+{
+    if (cc->compression == COMPRESS_LZ4 && length >= COMPRESS_MIN_LENGTH)
+    {
+        if (!cp.done)
+        {
+            compress_payload(data, length, cp.data);
+            cp.done = true;
+        }
+
+        if (!cp.data.empty())
+        {
+            create_and_send_msg(cc, type | MSG_FLAG_COMPRESSED, stream_id, &cp.data[0], cp.data.size());
+            return;
+        }
+    }
+
+    create_and_send_msg(cc, type, stream_id, data, length);
+}
+
+static void shutdown_compression_stats()
+{
+    const CompressionStats &cs = compression_stats;
+    if (cs.payloads != 0)
+        logger_info("Compressed %llu payloads for clients from %llu to %llu bytes\n",
+                (unsigned long long)cs.payloads, (unsigned long long)cs.in_bytes, (unsigned long long)cs.out_bytes);
+}
+
+static void append_delta_run(std::vector<uint8_t> &out, const uint8_t *data, uint32_t offset, uint32_t length)
+{
+    size_t pos = out.size();
+    out.resize(pos + DELTA_RUN_HDR_LEN + length);
+    memcpy(&out[pos], &offset, 4);
+    memcpy(&out[pos + 4], &length, 4);
+    memcpy(&out[pos + DELTA_RUN_HDR_LEN], data + offset, length);
+}
+
+// Appends to out the runs of data that differ from shadow. Blocks are
+// compared whole, and only the first and last block of a run are looked at
+// byte by byte, to trim it.
+static void encode_delta(const uint8_t *shadow, const uint8_t *data, uint32_t length, std::vector<uint8_t> &out)
+{
+    uint32_t pos = 0;
+    while (pos < length)
+    {
+        uint32_t n = std::min<uint32_t>(DELTA_BLOCK, length - pos);
+        if (memcmp(shadow + pos, data + pos, n) == 0)
+        {
+            pos += n;
+            continue;
+        }
+
+        uint32_t start = pos;
+        while (shadow[start] == data[start])
+            start++;
+
+        uint32_t end = pos + n;
+        while (end < length)
+        {
+            n = std::min<uint32_t>(DELTA_BLOCK, length - end);
+            if (memcmp(shadow + end, data + end, n) == 0)
+                break;
+            end += n;
+        }
+        pos = end;
+
+        while (shadow[end - 1] == data[end - 1])
+            end--;
+
+        append_delta_run(out, data, start, end - start);
+    }
+}
+
+// The region is sent to every subscriber from the one buffer it was read
+// into, and the changes in it are worked out once for all delta subscribers.
+// A subscriber whose socket hasn't taken the previous snapshot yet misses
+// this one, rather than have snapshots pile up in a314d.
+static void handle_snapshot_read(ThreadMessage &tm)
+{
+    for (auto &sn : snapshots)
+    {
+        if (sn.id != tm.connection_id)
+            continue;
+
+        sn.in_flight = false;
+
+        uint8_t *data = tm.buffer.get();
+        bool any_delta = false;
+        bool have_delta = false;
+        std::vector<uint8_t> delta;
+        std::vector<uint8_t> whole;
+        CompressedPayload data_cp = {};
+        CompressedPayload delta_cp = {};
+        CompressedPayload whole_cp = {};
+
+        for (auto &sub : sn.subscribers)
+        {
+            if (sub.delta)
+                any_delta = true;
+
+            if (!sub.cc->message_queue.empty())
+            {
+                sub.in_sync = false;
+                continue;
+            }
+
+            if (!sub.delta)
+                send_mem_msg(sub.cc, MSG_SNAPSHOT, sub.id, data, tm.length, data_cp);
+            else if (sub.in_sync && !sn.shadow.empty())
+            {
+                if (!have_delta)
+                {
+                    encode_delta(&sn.shadow[0], data, tm.length, delta);
+                    have_delta = true;
+                }
+                send_mem_msg(sub.cc, MSG_SNAPSHOT, sub.id, delta.empty() ? nullptr : &delta[0], delta.size(), delta_cp);
+            }
+            else
+            {
+                if (whole.empty())
+                    append_delta_run(whole, data, 0, tm.length);
+                send_mem_msg(sub.cc, MSG_SNAPSHOT, sub.id, &whole[0], whole.size(), whole_cp);
+                sub.in_sync = true;
+            }
+        }
+
+        if (any_delta)
+            sn.shadow.assign(data, data + tm.length);
+        break;
+    }
+}
+
+static LogicalChannel *get_associated_channel_by_stream_id(ClientConnection *cc, int stream_id)
+{
+    for (auto ch : cc->associations)
+    {
+        if (ch->stream_id == stream_id)
+            return ch;
+    }
+    return nullptr;
+}
+
+static int allocate_channel_id(Board *b)
+{
+    for (int i = PI_CHANNEL_ID_FIRST; i <= PI_CHANNEL_ID_LAST; i += 2)
+    {
+        int channel_id = b->next_channel_id;
+        b->next_channel_id = channel_id == PI_CHANNEL_ID_LAST ? PI_CHANNEL_ID_FIRST : channel_id + 2;
+
+        bool used = false;
+        for (auto &ch : b->channels)
+            if (ch.channel_id == channel_id)
+                used = true;
+
+        if (!used)
+            return channel_id;
+    }
+    return -1;
+}
+
+// A client opens a logical channel to a service on the Amiga, on the board
+// of the connection unless the name is NAME@BOARD. The client picks the
+// stream id, which must be even, as the channels that the Amiga opens get
+// odd ones. The Amiga's answer comes back in MSG_CONNECT_RESPONSE, and the
+// client must wait for it before it sends anything else than RESET on the
+// stream. The channel goes in the control class.
+static void handle_msg_connect(ClientConnection *cc)
+{
+    int stream_id = cc->header.stream_id;
+
+    std::string service_name;
+    Board *b;
+    bool known = parse_service_name(cc, service_name, b);
+    if (b == nullptr)
+        b = cc->board;
+
+    uint8_t result = CONNECT_OK;
+    int channel_id = -1;
+    if (!known || !b->amiga_listens || service_name.empty() || (int)service_name.size() > b->max_payload)
+        result = CONNECT_UNKNOWN_SERVICE;
+    else if ((stream_id & 1) != 0 || get_associated_channel_by_stream_id(cc, stream_id) != nullptr ||
+            (channel_id = allocate_channel_id(b)) == -1)
+        result = CONNECT_SOCKET_IN_USE;
+
+    if (result != CONNECT_OK)
+    {
+        create_and_send_msg(cc, MSG_CONNECT_RESPONSE, stream_id, &result, 1);
+        return;
+    }
+
+    b->channels.emplace_back();
+
+    auto &ch = b->channels.back();
+
+    ch.board = b;
+    ch.channel_id = channel_id;
+    ch.ring = QOS_CONTROL;
+    ch.association = cc;
+    ch.stream_id = stream_id;
+    ch.got_eos_from_ami = false;
+    ch.got_eos_from_client = false;
+    ch.connect_pending = true;
+    ch.flow_control = false;
+    ch.send_credit = CHANNEL_WINDOW;
+    ch.consumed = 0;
+    ch.credit_stalled = false;
+    ch.builtin = BUILTIN_NONE;
+
+    cc->associations.push_back(&ch);
+
+    create_and_enqueue_packet(&ch, PKT_CONNECT, (uint8_t *)service_name.c_str(), service_name.size());
+}
+
+// The operations of a client on a stream, whether they come from a socket or
+// from a plugin.
+static void connect_response_from_client(ClientConnection *cc, int stream_id, uint8_t *data, int length)
+{
+    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, stream_id);
+    if (!ch || ch->connect_pending)
+        return;
+
+    create_and_enqueue_packet(ch, PKT_CONNECT_RESPONSE, data, length);
+
+    if (data[0] != CONNECT_OK)
+        remove_association(ch);
+}
+
+static void data_from_client(ClientConnection *cc, int stream_id, uint8_t *data, int length)
+{
+    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, stream_id);
+    if (!ch || ch->connect_pending)
+        return;
+
+    create_and_enqueue_data(ch, data, length);
+}
+
+static void eos_from_client(ClientConnection *cc, int stream_id)
+{
+    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, stream_id);
+    if (!ch || ch->got_eos_from_client || ch->connect_pending)
+        return;
+
+    ch->got_eos_from_client = true;
+
+    create_and_enqueue_packet(ch, PKT_EOS, nullptr, 0);
+
+    if (ch->got_eos_from_ami)
+        remove_association(ch);
+}
+
+static void reset_from_client(ClientConnection *cc, int stream_id)
+{
+    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, stream_id);
+    if (!ch)
+        return;
+
+    remove_association(ch);
+
+    clear_packet_queue(ch);
+    create_and_enqueue_packet(ch, PKT_RESET, nullptr, 0);
+}
+
+static void handle_msg_connect_response(ClientConnection *cc)
+{
+    connect_response_from_client(cc, cc->header.stream_id, &cc->payload[0], cc->payload.size());
+}
+
+static void handle_msg_data(ClientConnection *cc)
+{
+    data_from_client(cc, cc->header.stream_id, &cc->payload[0], cc->header.length);
+}
+
+static void handle_msg_eos(ClientConnection *cc)
+{
+    eos_from_client(cc, cc->header.stream_id);
+}
+
+static void handle_msg_reset(ClientConnection *cc)
+{
+    reset_from_client(cc, cc->header.stream_id);
+}
+
+// The host functions that plugins are given; context is the plugin's
+// connection.
+static void plugin_connect_response(void *context, int stream_id, uint8_t result)
+{
+    connect_response_from_client((ClientConnection *)context, stream_id, &result, 1);
+}
+
+static void plugin_data(void *context, int stream_id, const uint8_t *data, int length)
+{
+    if (length < 0)
+    {
+        logger_warn("Plugin sent a DATA packet of %d bytes, which was dropped\n", length);
+        return;
+    }
+
+    data_from_client((ClientConnection *)context, stream_id, (uint8_t *)data, length);
+}
+
+static void plugin_eos(void *context, int stream_id)
+{
+    eos_from_client((ClientConnection *)context, stream_id);
+}
+
+static void plugin_reset(void *context, int stream_id)
+{
+    reset_from_client((ClientConnection *)context, stream_id);
+}
+
+// A request for a board that doesn't exist goes to the first board, so that
+// the plugin still gets its responses in order.
+static void plugin_read_mem(void *context, int board, uint32_t address, uint32_t length)
+{
+    ClientConnection *cc = (ClientConnection *)context;
+    Board *b = get_board_by_index(board);
+    if (b == nullptr)
+        b = cc->board;
+
+    read_mem_for_client(cc, b, address, length);
+}
+
+static void plugin_write_mem(void *context, int board, uint32_t address, const uint8_t *data, uint32_t length)
+{
+    ClientConnection *cc = (ClientConnection *)context;
+    Board *b = get_board_by_index(board);
+    if (b == nullptr)
+        b = cc->board;
+
+    write_mem_for_client(cc, b, address, data, length);
+}
+
+// Each plugin line in a314d.conf gets its own instance of the plugin, with
+// the services of the line registered to it on all boards. A plugin that
+// can't be loaded is logged and left out.
+static void load_plugins()
+{
+    for (auto &ps : plugin_services)
+    {
+        void *handle = dlopen(ps.path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (handle == nullptr)
+        {
+            logger_error("Unable to load plugin %s: %s\n", ps.path.c_str(), dlerror());
+            continue;
+        }
+
+        A314PluginEntry entry = (A314PluginEntry)dlsym(handle, A314_PLUGIN_ENTRY_NAME);
+        const A314Plugin *ops = entry != nullptr ? entry() : nullptr;
+        if (ops == nullptr || ops->abi_version != A314_PLUGIN_ABI_VERSION || ops->init == nullptr)
+        {
+            logger_error("%s is not a plugin for this version of a314d\n", ps.path.c_str());
+            dlclose(handle);
+            continue;
+        }
+
+        connections.emplace_back();
+
+        ClientConnection &cc = connections.back();
+        cc.fd = -1;
+        cc.id = next_connection_id++;
+        cc.board = &boards.front();
+        cc.warm_for = nullptr;
+        cc.cold_start_ns = 0;
+        cc.next_stream_id = 1;
+        cc.compression = COMPRESS_NONE;
+        cc.bytes_read = 0;
+
+        plugins.emplace_back();
+
+        Plugin &pl = plugins.back();
+        pl.path = ps.path;
+        pl.handle = handle;
+        pl.ops = ops;
+        pl.cc = &cc;
+        cc.plugin = &pl;
+
+        pl.host.abi_version = A314_PLUGIN_ABI_VERSION;
+        pl.host.context = &cc;
+        pl.host.connect_response = plugin_connect_response;
+        pl.host.data = plugin_data;
+        pl.host.eos = plugin_eos;
+        pl.host.reset = plugin_reset;
+        pl.host.read_mem = plugin_read_mem;
+        pl.host.write_mem = plugin_write_mem;
+
+        std::vector<const char *> argv;
+        for (auto &arg : ps.arguments)
+            argv.push_back(arg.c_str());
+
+        pl.state = ops->init(&pl.host, argv.size(), &argv[0]);
+        if (pl.state == nullptr)
+        {
+            logger_error("Plugin %s failed to start\n", ps.path.c_str());
+            connections.pop_back();
+            plugins.pop_back();
+            dlclose(handle);
+            continue;
+        }
+
+        add_registration(get_service_name(ps.service_name, true), &cc, nullptr);
+    }
+}
+
+static void unload_plugins()
+{
+    for (auto &pl : plugins)
+    {
+        if (pl.ops->shutdown)
+            pl.ops->shutdown(pl.state);
+        dlclose(pl.handle);
+    }
+    plugins.clear();
+}
+
+static void handle_received_message(ClientConnection *cc)
+{
+    if (cc->cold_start_ns != 0)
+    {
+        uint64_t elapsed = monotonic_ns() - cc->cold_start_ns;
+        spawn_stats.cold_starts++;
+        spawn_stats.ready_ns += elapsed;
+        spawn_stats.max_ready_ns = std::max(spawn_stats.max_ready_ns, elapsed);
+        cc->cold_start_ns = 0;
+    }
+
+    switch (cc->header.type)
+    {
+    case MSG_REGISTER_REQ:
+        handle_msg_register_req(cc);
+        break;
+    case MSG_DEREGISTER_REQ:
+        handle_msg_deregister_req(cc);
+        break;
+    case MSG_READ_MEM_REQ:
+        handle_msg_read_mem_req(cc);
+        break;
+    case MSG_WRITE_MEM_REQ:
+        handle_msg_write_mem_req(cc);
+        break;
+    case MSG_CONNECT:
+        handle_msg_connect(cc);
+        break;
+    case MSG_CONNECT_RESPONSE:
+        handle_msg_connect_response(cc);
+        break;
+    case MSG_DATA:
+        handle_msg_data(cc);
+        break;
+    case MSG_EOS:
+        handle_msg_eos(cc);
+        break;
+    case MSG_RESET:
+        handle_msg_reset(cc);
+        break;
+    case MSG_SUBSCRIBE_REQ:
+        handle_msg_subscribe_req(cc);
+        break;
+    case MSG_UNSUBSCRIBE_REQ:
+        handle_msg_unsubscribe_req(cc);
+        break;
+    case MSG_SNAPSHOT_REQ:
+        handle_msg_snapshot_req(cc);
+        break;
+    case MSG_COMPRESS_REQ:
+        handle_msg_compress_req(cc);
+        break;
+    case MSG_ALLOC_REQ:
+        handle_msg_alloc_req(cc);
+        break;
+    case MSG_FREE_REQ:
+        handle_msg_free_req(cc);
+        break;
+    default:
+        // This is bad, probably should disconnect from client.
+        logger_warn("Received a message of unknown type from client\n");
+        break;
+    }
+}
+
+// Services that have exited are reaped when a connection closes. One that
+// closes its socket before it exits is reaped at a later close.
+static void reap_children()
+{
+    while (waitpid(-1, nullptr, WNOHANG) > 0)
+        ;
+}
+
+static void close_and_remove_connection(ClientConnection *cc)
+{
+    if (cc->fd != -1)
+    {
+        shutdown(cc->fd, SHUT_WR);
+        close(cc->fd);
+    }
+
+    if (cc->warm_for != nullptr)
+    {
+        logger_warn("Warm instance of %s exited before it was used\n", cc->warm_for->service_name.c_str());
+        cc->warm_for->next_refill_ns = monotonic_ns() + 1000000000ULL;
+    }
+
+    remove_all_registrations(cc);
+    unsubscribe(cc, true, 0);
+
+    for (auto &b : boards)
+        free_window_slices(&b, cc, true, 0);
+
+    {
+        auto it = cc->associations.begin();
+        while (it != cc->associations.end())
+        {
+            auto ch = *it;
+
+            clear_packet_queue(ch);
+            create_and_enqueue_packet(ch, PKT_RESET, nullptr, 0);
+
+            ch->association = nullptr;
+            ch->stream_id = 0;
+
+            it = cc->associations.erase(it);
+        }
+    }
+
+    for (auto it = connections.begin(); it != connections.end(); it++)
+    {
+        if (&(*it) == cc)
+        {
+            connections.erase(it);
+            break;
+        }
+    }
+
+    reap_children();
+}
+
+static void remove_association(LogicalChannel *ch)
+{
+    auto &ass = ch->association->associations;
+    ass.erase(std::find(ass.begin(), ass.end(), ch));
+
+    ch->association = nullptr;
+    ch->stream_id = 0;
+}
+
+static void end_credit_stall(LogicalChannel *ch)
+{
+    ch->credit_stalled = false;
+    ch->board->credit_stall_ns += monotonic_ns() - ch->stalled_since_ns;
+}
+
+static void clear_packet_queue(LogicalChannel *ch)
+{
+    if (!ch->packet_queue.empty())
+    {
+        ch->packet_queue.clear();
+        if (ch->credit_stalled)
+            end_credit_stall(ch);
+        else
+        {
+            auto &sq = ch->board->send_queue[ch->ring];
+            sq.erase(std::find(sq.begin(), sq.end(), ch));
+        }
+    }
+}
+
+static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, int length)
+{
+    if (ch->packet_queue.empty())
+        ch->board->send_queue[ch->ring].push_back(ch);
+
+    ch->packet_queue.emplace_back();
+
+    PacketBuffer &pb = ch->packet_queue.back();
+    pb.type = type;
+    pb.data.resize(length);
+    if (data && length)
+        memcpy(&pb.data[0], data, length);
+}
+
+// DATA that is larger than the packets on the channel's board can carry is
+// sent as several packets.
+static void create_and_enqueue_data(LogicalChannel *ch, uint8_t *data, int length)
+{
+    int max_payload = ch->board->max_payload;
+    do
+    {
+        int n = std::min(length, max_payload);
+        create_and_enqueue_packet(ch, PKT_DATA, data, n);
+        data += n;
+        length -= n;
+    } while (length > 0);
+}
+
+static int find_builtin_service(const uint8_t *name, int length)
+{
+    static const struct
+    {
+        const char *name;
+        int builtin;
+    } builtins[] =
+    {
+        {"a314bench-echo", BUILTIN_ECHO},
+        {"a314bench-sink", BUILTIN_SINK},
+        {"a314bench-source", BUILTIN_SOURCE},
+    };
+
+    for (auto &e : builtins)
+        if ((int)strlen(e.name) == length && memcmp(e.name, name, length) == 0)
+            return e.builtin;
+    return BUILTIN_NONE;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static uint16_t get_be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+// Gives the Amiga back credit for DATA that has been taken by the channel's
+// client. The PKT_CREDIT goes ahead of what the channel has queued, as that
+// may be waiting for credit from the Amiga in turn. There is no point in
+// credit once the Amiga has sent EOS, and the channel id may then soon be
+// reused.
+static void give_credit(LogicalChannel *ch, int length)
+{
+    if (!ch->flow_control || ch->got_eos_from_ami)
+        return;
+
+    ch->consumed += length;
+    if (ch->consumed < CREDIT_GRANT_MIN)
+        return;
+
+    uint32_t credit = ch->consumed;
+    ch->consumed = 0;
+
+    if (!ch->packet_queue.empty() && ch->packet_queue.front().type == PKT_CREDIT)
+    {
+        PacketBuffer &pb = ch->packet_queue.front();
+        put_be32(&pb.data[0], get_be32(&pb.data[0]) + credit);
+        return;
+    }
+
+    if (ch->packet_queue.empty())
+        ch->board->send_queue[ch->ring].push_back(ch);
+    else if (ch->credit_stalled)
+    {
+        end_credit_stall(ch);
+        ch->board->send_queue[ch->ring].push_back(ch);
+    }
+
+    ch->packet_queue.emplace_front();
+
+    PacketBuffer &pb = ch->packet_queue.front();
+    pb.type = PKT_CREDIT;
+    pb.data.resize(4);
+    put_be32(&pb.data[0], credit);
+}
+
+// Called when a client has taken a DATA message, which for a socket is when
+// all of it has been written.
+static void data_delivered(ClientConnection *cc, int stream_id, int length)
+{
+    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, stream_id);
+    if (ch != nullptr)
+        give_credit(ch, length);
+}
+
+static void close_builtin(LogicalChannel *ch)
+{
+    if (ch->builtin == BUILTIN_SOURCE && ch->bench_remaining != 0)
+        ch->board->active_bench_sources--;
+
+    ch->got_eos_from_client = true;
+    ch->builtin = BUILTIN_NONE;
+    create_and_enqueue_packet(ch, PKT_EOS, nullptr, 0);
+}
+
+// Echo returns every DATA packet as is. Sink counts what it receives, and
+// answers the Amiga's EOS with [bytes:u32][elapsed_us:u32]. Source is
+// started with [size:u8][count:u32] and then sends count packets of size
+// bytes as fast as R2A allows, followed by EOS. Integers are big endian.
+static void handle_builtin_data(LogicalChannel *ch, uint8_t *data, int plen)
+{
+    if (ch->builtin == BUILTIN_ECHO)
+        create_and_enqueue_data(ch, data, plen);
+    else if (ch->builtin == BUILTIN_SINK)
+    {
+        if (ch->bench_start_ns == 0)
+            ch->bench_start_ns = monotonic_ns();
+        ch->bench_bytes += plen;
+    }
+    else if (ch->builtin == BUILTIN_SOURCE && plen >= 5 && ch->bench_start_ns == 0)
+    {
+        // [size:u16][count:u32] asks for packets that may be jumbo.
+        int size = plen >= 6 ? get_be16(&data[0]) : data[0];
+        ch->bench_size = std::min(size, ch->board->max_payload);
+        ch->bench_remaining = get_be32(&data[plen >= 6 ? 2 : 1]);
+        ch->bench_start_ns = monotonic_ns();
+
+        if (ch->bench_remaining == 0)
+            close_builtin(ch);
+        else
+            ch->board->active_bench_sources++;
+    }
+}
+
+static void handle_builtin_eos(LogicalChannel *ch)
+{
+    ch->got_eos_from_ami = true;
+
+    if (ch->builtin == BUILTIN_SINK)
+    {
+        uint64_t elapsed = ch->bench_start_ns ? monotonic_ns() - ch->bench_start_ns : 0;
+
+        uint8_t summary[8];
+        put_be32(&summary[0], ch->bench_bytes);
+        put_be32(&summary[4], (uint32_t)std::min<uint64_t>(elapsed / 1000, UINT32_MAX));
+        create_and_enqueue_packet(ch, PKT_DATA, summary, sizeof(summary));
+    }
+
+    close_builtin(ch);
+}
+
+// Keeps enough packets queued on every running source to fill R2A.
+static void refill_bench_sources(Board *b)
+{
+    if (b->active_bench_sources == 0)
+        return;
+
+    static uint8_t pattern[MAX_RING_SIZE];
+
+    for (auto &ch : b->channels)
+    {
+        if (ch.builtin != BUILTIN_SOURCE || ch.bench_remaining == 0)
+            continue;
+
+        int target = b->r2a_credit_limit[ch.ring] / 2 / (PKT_HDR_LEN + ch.bench_size) + 1;
+        while ((int)ch.packet_queue.size() < target && ch.bench_remaining != 0)
+        {
+            create_and_enqueue_packet(&ch, PKT_DATA, pattern, ch.bench_size);
+            ch.bench_remaining--;
+        }
+
+        if (ch.bench_remaining == 0)
+        {
+            b->active_bench_sources--;
+            close_builtin(&ch);
+        }
+    }
+}
+
+static ClientConnection *start_on_demand_service(OnDemandStart &on_demand)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+        logger_error("Unable to create socket pair for %s; errno = %d\n", on_demand.service_name.c_str(), errno);
+        spawn_stats.failures++;
+        return nullptr;
+    }
+
+    // Only the service's end is inherited.
+    fcntl(fds[1], F_SETFD, 0);
+
+    std::vector<std::string> args(on_demand.arguments);
+    args.push_back("-ondemand");
+    args.push_back(std::to_string(fds[1]));
+    std::vector<char *> args_arr;
+    for (auto &arg : args)
+        args_arr.push_back((char *)arg.c_str());
+    args_arr.push_back(nullptr);
+
+    // a314d blocks SIGTERM outside of epoll_pwait(), which the service
+    // shouldn't inherit.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &original_sigset);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+    uint64_t start = monotonic_ns();
+    pid_t pid;
+    int err = posix_spawnp(&pid, on_demand.program.c_str(), nullptr, &attr, &args_arr[0], environ);
+    uint64_t elapsed = monotonic_ns() - start;
+
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+
+    if (err != 0)
+    {
+        logger_error("Unable to start %s for service %s; error = %d\n", on_demand.program.c_str(), on_demand.service_name.c_str(), err);
+        close(fds[0]);
+        spawn_stats.failures++;
+        return nullptr;
+    }
+
+    spawn_stats.spawns++;
+    spawn_stats.spawn_ns += elapsed;
+    spawn_stats.max_spawn_ns = std::max(spawn_stats.max_spawn_ns, elapsed);
+
+    int fd = fds[0];
+
+    int status = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (status == -1)
+    {
+        logger_error("Unexpectedly unable to set client socket to non blocking; errno = %d\n", errno);
+        exit(-1);
+    }
+
+    connections.emplace_back();
+
+    ClientConnection &cc = connections.back();
+    cc.fd = fd;
+    cc.id = next_connection_id++;
+    cc.board = &boards.front();
+    cc.plugin = nullptr;
+    cc.warm_for = nullptr;
+    cc.cold_start_ns = 0;
+    cc.next_stream_id = 1;
+    cc.compression = COMPRESS_NONE;
+    cc.bytes_read = 0;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        logger_error("epoll_ctl() failed unexpectedly with errno = %d\n", errno);
+        exit(-1);
+    }
+
+    return &cc;
+}
+
+static void shutdown_spawn_stats()
+{
+    const SpawnStats &ss = spawn_stats;
+    if (ss.spawns == 0 && ss.failures == 0)
+        return;
+
+    logger_info("Started %llu on-demand service instances (%llu failed), spawn mean %.0f us max %.0f us\n",
+            (unsigned long long)ss.spawns, (unsigned long long)ss.failures,
+            ss.spawns ? ss.spawn_ns / 1e3 / ss.spawns : 0.0, ss.max_spawn_ns / 1e3);
+    if (ss.cold_starts != 0)
+        logger_info("  %llu started on CONNECT, ready after mean %.1f ms max %.1f ms\n",
+                (unsigned long long)ss.cold_starts, ss.ready_ns / 1e6 / ss.cold_starts, ss.max_ready_ns / 1e6);
+}
+
+static ClientConnection *take_warm_instance(OnDemandStart *on_demand)
+{
+    for (auto &cc : connections)
+    {
+        if (cc.warm_for == on_demand)
+        {
+            cc.warm_for = nullptr;
+            return &cc;
+        }
+    }
+    return nullptr;
+}
+
+// Once an instance has taken a CONNECT it is registered for its board, and
+// the board's later CONNECTs go to it, so a warm instance only shortens the
+// first CONNECT on a board after a314d starts or after the instance exits.
+// The pool is therefore kept at one instance for each board that has no
+// registered instance, up to --warm N, and warm instances beyond that are
+// stopped.
+static int warm_pool_target(OnDemandStart *on_demand)
+{
+    ServiceName *sn = get_service_name(on_demand->service_name, false);
+    if (sn == nullptr || sn->on_demand != on_demand)
+        return 0;
+
+    int target = 0;
+    for (auto &b : boards)
+        if (find_registration(sn, &b) == nullptr)
+            target++;
+    return std::min(target, on_demand->warm_size);
+}
+
+// Called on the client thread between events, so that an instance that was
+// taken from the pool is replaced after the CONNECT has been passed on, and
+// when a registered instance has exited.
+static void refill_warm_pools()
+{
+    uint64_t now = 0;
+
+    for (auto &on_demand : on_demand_services)
+    {
+        if (on_demand.warm_size == 0)
+            continue;
+
+        int target = warm_pool_target(&on_demand);
+
+        int warm = 0;
+        for (auto &cc : connections)
+            if (cc.warm_for == &on_demand)
+                warm++;
+
+        while (warm > target)
+        {
+            ClientConnection *cc = take_warm_instance(&on_demand);
+            close_and_remove_connection(cc);
+            warm--;
+        }
+
+        if (warm >= target)
+            continue;
+
+        if (on_demand.next_refill_ns != 0)
+        {
+            if (now == 0)
+                now = monotonic_ns();
+            if (now < on_demand.next_refill_ns)
+                continue;
+            on_demand.next_refill_ns = 0;
+        }
+
+        for (; warm < target; warm++)
+        {
+            ClientConnection *cc = start_on_demand_service(on_demand);
+            if (cc == nullptr)
+            {
+                on_demand.next_refill_ns = monotonic_ns() + 1000000000ULL;
+                break;
+            }
+            cc->warm_for = &on_demand;
+        }
+    }
+}
+
+// Returns the epoll timeout until a pool that is held back may be refilled,
+// or -1 if there is none.
+static int warm_pool_timeout()
+{
+    uint64_t due = 0;
+    for (auto &on_demand : on_demand_services)
+        if (on_demand.next_refill_ns != 0 && (due == 0 || on_demand.next_refill_ns < due))
+            due = on_demand.next_refill_ns;
+
+    if (due == 0)
+        return -1;
+
+    uint64_t now = monotonic_ns();
+    return due > now ? (int)((due - now + 999999) / 1000000) : 0;
+}
+
+static void handle_pkt_connect(Board *b, int ring, bool flow_control, int channel_id, uint8_t *data, int plen)
+{
+    for (auto &ch : b->channels)
+    {
+        if (ch.channel_id == channel_id)
+        {
+            // We should handle this in some constructive way.
+            // This signals that should reset all logical channels.
+            logger_error("Received a CONNECT packet on a channel that was believed to be previously allocated\n");
+            exit(-1);
+        }
+    }
+
+    b->channels.emplace_back();
 
-    if (init_server_socket() != 0)
-        return -1;
+    auto &ch = b->channels.back();
 
-    if (init_spi() != 0)
-        return -1;
+    ch.board = b;
+    ch.channel_id = channel_id;
+    ch.ring = ring;
+    ch.association = nullptr;
+    ch.stream_id = 0;
+    ch.got_eos_from_ami = false;
+    ch.got_eos_from_client = false;
+    ch.connect_pending = false;
+    ch.flow_control = flow_control;
+    ch.send_credit = CHANNEL_WINDOW;
+    ch.consumed = 0;
+    ch.credit_stalled = false;
+    ch.builtin = BUILTIN_NONE;
+
+    // A service registered for this board takes precedence over one that is
+    // registered for all boards, and one registered under the name over one
+    // registered under a prefix of it.
+    ServiceName *sn = resolve_service(b, data, plen);
+    RegisteredService *found = sn != nullptr ? find_registration(sn, b) : nullptr;
+
+    if (found != nullptr)
+    {
+        ClientConnection *cc = found->cc;
 
-    if (init_gpio() != 0)
-        return -1;
+        ch.association = cc;
+        ch.stream_id = cc->next_stream_id;
 
-    epfd = epoll_create1(EPOLL_CLOEXEC);
-    if (epfd == -1)
-        return -1;
+        cc->next_stream_id += 2;
+        cc->associations.push_back(&ch);
 
-    struct epoll_event ev;
-    ev.events = EPOLLPRI | EPOLLERR;
-    ev.data.fd = gpio_fd;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, gpio_fd, &ev) != 0)
-        return -1;
+        create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
+        return;
+    }
 
-    ev.events = EPOLLIN;
-    ev.data.fd = server_socket;
-    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server_socket, &ev) != 0)
-        return -1;
+    int builtin = find_builtin_service(data, plen);
+    if (builtin != BUILTIN_NONE)
+    {
+        ch.builtin = builtin;
+        ch.bench_remaining = 0;
+        ch.bench_bytes = 0;
+        ch.bench_start_ns = 0;
 
-    return 0;
-}
+        uint8_t response = CONNECT_OK;
+        create_and_enqueue_packet(&ch, PKT_CONNECT_RESPONSE, &response, 1);
+        return;
+    }
 
-static void shutdown_driver()
-{
-    if (epfd != -1)
-        close(epfd);
+    ClientConnection *cc = nullptr;
+    if (sn != nullptr && sn->on_demand != nullptr)
+    {
+        cc = take_warm_instance(sn->on_demand);
+        if (cc == nullptr)
+        {
+            // The CONNECT stays pending until the new instance answers it,
+            // while other channels carry on.
+            cc = start_on_demand_service(*sn->on_demand);
+            if (cc != nullptr)
+                cc->cold_start_ns = monotonic_ns();
+        }
+    }
 
-    shutdown_gpio();
-    shutdown_spi();
-    shutdown_server_socket();
+    if (cc != nullptr)
+    {
+        cc->board = b;
+
+        // Each board gets its own instance of an on-demand service, as
+        // memory requests go to the board it was started for. An instance
+        // of a service entered as PREFIX* serves every name of the prefix.
+        add_registration(sn, cc, b);
+
+        ch.association = cc;
+        ch.stream_id = cc->next_stream_id;
+
+        cc->next_stream_id += 2;
+        cc->associations.push_back(&ch);
+
+        create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
+        return;
+    }
+
+    uint8_t response = CONNECT_UNKNOWN_SERVICE;
+    create_and_enqueue_packet(&ch, PKT_CONNECT_RESPONSE, &response, 1);
 }
 
-void create_and_send_msg(ClientConnection *cc, int type, int stream_id, uint8_t *data, int length)
+// The Amiga answers a CONNECT from a client. As with a CONNECT from the
+// Amiga, the channel has flow control if the answer comes in an extended A2R
+// ring while that is agreed, which is before any DATA is sent on it.
+static void handle_pkt_connect_response(Board *b, bool flow_control, int channel_id, uint8_t *data, int plen)
 {
-    MessageBuffer mb;
-    mb.pos = 0;
-    mb.data.resize(sizeof(MessageHeader) + length);
+    for (auto &ch : b->channels)
+    {
+        if (ch.channel_id == channel_id)
+        {
+            if (!ch.connect_pending || ch.association == nullptr)
+                break;
 
-    MessageHeader *mh = (MessageHeader *)&mb.data[0];
-    mh->length = length;
-    mh->stream_id = stream_id;
-    mh->type = type;
-    if (length && data)
-        memcpy(&mb.data[sizeof(MessageHeader)], data, length);
+            ch.connect_pending = false;
 
-    if (!cc->message_queue.empty())
-    {
-        cc->message_queue.push_back(std::move(mb));
-        return;
+            uint8_t result = plen == 1 ? data[0] : CONNECT_UNKNOWN_SERVICE;
+            ClientConnection *cc = ch.association;
+            int stream_id = ch.stream_id;
+
+            if (result == CONNECT_OK)
+                ch.flow_control = flow_control;
+            else
+                remove_association(&ch);
+
+            create_and_send_msg(cc, MSG_CONNECT_RESPONSE, stream_id, &result, 1);
+            break;
+        }
     }
+}
 
-    while (1)
+static void handle_pkt_data(Board *b, int channel_id, uint8_t *data, int plen)
+{
+    for (auto &ch : b->channels)
     {
-        int left = mb.data.size() - mb.pos;
-        uint8_t *src = &mb.data[mb.pos];
-        ssize_t r = write(cc->fd, src, left);
-        if (r == -1)
+        if (ch.channel_id == channel_id)
         {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            if (ch.builtin != BUILTIN_NONE && !ch.got_eos_from_ami)
             {
-                cc->message_queue.push_back(std::move(mb));
-                return;
+                handle_builtin_data(&ch, data, plen);
+                give_credit(&ch, plen);
             }
-            else if (errno == ECONNRESET)
+            else if (ch.association != nullptr && !ch.got_eos_from_ami)
+                create_and_send_msg(ch.association, MSG_DATA, ch.stream_id, data, plen);
+
+            break;
+        }
+    }
+}
+
+static void handle_pkt_eos(Board *b, int channel_id)
+{
+    for (auto &ch : b->channels)
+    {
+        if (ch.channel_id == channel_id)
+        {
+            if (ch.builtin != BUILTIN_NONE && !ch.got_eos_from_ami)
+                handle_builtin_eos(&ch);
+            else if (ch.association != nullptr && !ch.got_eos_from_ami)
             {
-                // Do not close connection here; it will get done at some other place.
-                return;
+                ch.got_eos_from_ami = true;
+
+                // A plugin acts on the message right away, so the channel
+                // must be up to date before it is sent.
+                ClientConnection *cc = ch.association;
+                int stream_id = ch.stream_id;
+
+                if (ch.got_eos_from_client)
+                    remove_association(&ch);
+
+                create_and_send_msg(cc, MSG_EOS, stream_id, nullptr, 0);
             }
-            else
+            break;
+        }
+    }
+}
+
+static void handle_pkt_reset(Board *b, int channel_id)
+{
+    for (auto &ch : b->channels)
+    {
+        if (ch.channel_id == channel_id)
+        {
+            clear_packet_queue(&ch);
+
+            if (ch.builtin == BUILTIN_SOURCE && ch.bench_remaining != 0)
+                b->active_bench_sources--;
+            ch.builtin = BUILTIN_NONE;
+
+            if (ch.association != nullptr)
             {
-                logger_error("Write failed unexpectedly with errno = %d\n", errno);
-                exit(-1);
+                ClientConnection *cc = ch.association;
+                int stream_id = ch.stream_id;
+
+                remove_association(&ch);
+                create_and_send_msg(cc, MSG_RESET, stream_id, nullptr, 0);
             }
+
+            break;
         }
+    }
+}
+
+static void handle_pkt_credit(Board *b, int channel_id, uint8_t *data, int plen)
+{
+    if (plen < 4)
+        return;
 
-        mb.pos += r;
-        if (r == left)
+    for (auto &ch : b->channels)
+    {
+        if (ch.channel_id == channel_id)
         {
-            return;
+            if (!ch.flow_control)
+                break;
+
+            ch.send_credit += get_be32(data);
+
+            if (ch.credit_stalled && ch.send_credit >= (int)ch.packet_queue.front().data.size())
+            {
+                end_credit_stall(&ch);
+                b->send_queue[ch.ring].push_back(&ch);
+            }
+            break;
         }
     }
 }
 
-static void handle_msg_register_req(ClientConnection *cc)
+static void shutdown_flow_control(Board *b)
 {
-    uint8_t result = MSG_FAIL;
+    if (b->credit_stalls != 0)
+        logger_info("Logical channels on board %d waited for credit %llu times, for %.3f s in all\n",
+                b->index, (unsigned long long)b->credit_stalls, b->credit_stall_ns / 1e9);
+}
 
-    std::string service_name((char *)&cc->payload[0], cc->payload.size());
+static void remove_channel_if_not_associated_and_empty_pq(Board *b, int channel_id)
+{
+    for (auto it = b->channels.begin(); it != b->channels.end(); it++)
+    {
+        if (it->channel_id == channel_id)
+        {
+            if (it->association == nullptr && it->builtin == BUILTIN_NONE && it->packet_queue.empty())
+                b->channels.erase(it);
 
-    auto it = services.begin();
-    for (; it != services.end(); it++)
-        if (it->name == service_name)
             break;
+        }
+    }
+}
+
+static void handle_received_pkt(Board *b, int ring, bool flow_control, int ptype, int channel_id, uint8_t *data, int plen)
+{
+    if (ptype == PKT_CONNECT)
+        handle_pkt_connect(b, ring, flow_control, channel_id, data, plen);
+    else if (ptype == PKT_CONNECT_RESPONSE)
+        handle_pkt_connect_response(b, flow_control, channel_id, data, plen);
+    else if (ptype == PKT_DATA)
+        handle_pkt_data(b, channel_id, data, plen);
+    else if (ptype == PKT_EOS)
+        handle_pkt_eos(b, channel_id);
+    else if (ptype == PKT_RESET)
+        handle_pkt_reset(b, channel_id);
+    else if (ptype == PKT_CREDIT)
+        handle_pkt_credit(b, channel_id, data, plen);
+
+    remove_channel_if_not_associated_and_empty_pq(b, channel_id);
+}
+
+static int used_in_a2r(RingPair *rp)
+{
+    return (rp->channel_status[A2R_TAIL_OFFSET] - rp->channel_status[A2R_HEAD_OFFSET]) & (rp->a2r.size - 1);
+}
+
+static int used_in_r2a(RingPair *rp)
+{
+    return (rp->channel_status[R2A_TAIL_OFFSET] - rp->channel_status[R2A_HEAD_OFFSET]) & (rp->r2a.size - 1);
+}
+
+static bool any_r2a_pending(Board *b)
+{
+    for (int i = 0; i < b->r2a_count; i++)
+        if (!b->rings[i].r2a_pending.empty())
+            return true;
+    return false;
+}
+
+static void reset_ring_layout(Board *b)
+{
+    RingPair *rp = &b->rings[0];
+
+    rp->a2r.extended = false;
+    rp->a2r.jumbo = false;
+    rp->a2r.address = b->base_address + A2R_BUFFER_OFFSET;
+    rp->a2r.size = LEGACY_RING_SIZE;
+
+    rp->r2a.extended = false;
+    rp->r2a.jumbo = false;
+    rp->r2a.address = b->base_address + R2A_BUFFER_OFFSET;
+    rp->r2a.size = LEGACY_RING_SIZE;
+
+    b->a2r_count = 1;
+    b->r2a_count = 1;
+    for (auto &pair : b->rings)
+        pair.pointers_updated = false;
+
+    b->settings_reply_pending = false;
+    b->a2r_switched = false;
+}
+
+// The layout of the extended area that was accepted in settings_reply.
+static int ext_pair_count(Board *b)
+{
+    return (b->settings_reply[4] & SETTINGS_FLAG_QOS) ? QOS_CLASSES : 1;
+}
 
-    if (it == services.end())
+static unsigned int ext_pair_address(Board *b, int i)
+{
+    int pair_size = (1 << b->settings_reply[2]) + (1 << b->settings_reply[3]);
+    return b->ext_address + ext_pair_count(b) * EXT_POINTERS_LEN + i * pair_size;
+}
+
+// Called on the SPI thread for PKT_SETTINGS in A2R. Answers an OFFER, and
+// moves A2R to the extended area on SWITCHED.
+static void handle_pkt_settings(Board *b, uint8_t *data, int plen)
+{
+    if (plen >= 1 && data[0] == SETTINGS_SWITCHED && b->rings[0].r2a.extended && !b->rings[0].a2r.extended)
     {
-        services.emplace_back();
+        bool jumbo = (b->settings_reply[4] & SETTINGS_FLAG_JUMBO) != 0;
 
-        RegisteredService &srv = services.back();
-        srv.cc = cc;
-        srv.name = std::move(service_name);
+        b->a2r_count = ext_pair_count(b);
+        for (int i = 0; i < b->a2r_count; i++)
+        {
+            RingPair *rp = &b->rings[i];
+            rp->a2r.extended = true;
+            rp->a2r.jumbo = jumbo;
+            rp->a2r.address = ext_pair_address(b, i);
+            rp->a2r.size = 1 << b->settings_reply[2];
+            rp->channel_status[A2R_HEAD_OFFSET] = 0;
+            rp->channel_status[A2R_TAIL_OFFSET] = 0;
+        }
+        b->a2r_switched = true;
 
-        result = MSG_SUCCESS;
+        logger_info("Board %d is using %d byte A2R and %d byte R2A rings at address %06x%s%s%s\n",
+                b->index, b->rings[0].a2r.size, b->rings[0].r2a.size, b->ext_address,
+                jumbo ? ", with jumbo packets" : "", b->a2r_count > 1 ? ", one pair per QoS class" : "",
+                (b->settings_reply[4] & SETTINGS_FLAG_CREDIT) ? ", with per-channel flow control" : "");
+        return;
     }
 
-    create_and_send_msg(cc, MSG_REGISTER_RES, 0, &result, 1);
+    if (plen < SETTINGS_OFFER_LEN || data[0] != SETTINGS_OFFER || b->rings[0].r2a.extended || b->settings_reply_pending)
+        return;
+
+    int version = data[1];
+    int a2r_log2 = data[2];
+    int r2a_log2 = data[3];
+    int flags = data[4] & (SETTINGS_FLAG_JUMBO | SETTINGS_FLAG_QOS | SETTINGS_FLAG_CREDIT);
+    unsigned int address = get_be32(&data[5]);
+
+    int pairs = (flags & SETTINGS_FLAG_QOS) ? QOS_CLASSES : 1;
+    bool ok = version == SETTINGS_VERSION &&
+        a2r_log2 >= MIN_RING_LOG2 && a2r_log2 <= MAX_RING_LOG2 &&
+        r2a_log2 >= MIN_RING_LOG2 && r2a_log2 <= MAX_RING_LOG2 &&
+        (address & 1) == 0 && address + pairs * (EXT_POINTERS_LEN + (1 << a2r_log2) + (1 << r2a_log2)) <= 0x100000;
+
+    if (!ok)
+        logger_warn("Board %d offered rings that a314d can't use (version %d, sizes %d and %d, address %06x)\n",
+                b->index, version, 1 << a2r_log2, 1 << r2a_log2, address);
+
+    // A REFUSE carries the version that a314d speaks, in case the Amiga wants
+    // to try again with that.
+    b->settings_reply[0] = ok ? SETTINGS_ACCEPT : SETTINGS_REFUSE;
+    b->settings_reply[1] = SETTINGS_VERSION;
+    b->settings_reply[2] = a2r_log2;
+    b->settings_reply[3] = r2a_log2;
+    b->settings_reply[4] = flags;
+    b->settings_reply_pending = true;
+    b->ext_address = address;
 }
 
-static void handle_msg_deregister_req(ClientConnection *cc)
+// Buffers for A2R are rounded up to, and aligned to, cache lines.
+#define A2R_BUFFER_ALIGN        64
+
+// Called on the SPI thread. What is in an A2R ring is read into a buffer of
+// its own, in a single SPI message also when it wraps, and the buffer is
+// handed to the client thread as it is. The packets are parsed there, and
+// their payloads go to clients from the buffer, so that they aren't copied on
+// the way. If the client thread is behind then A2R is left as it is, which
+// makes the Amiga wait, and the SPI thread tries again shortly.
+static bool receive_from_ring(Board *b, int ring)
 {
-    uint8_t result = MSG_FAIL;
+    RingPair *rp = &b->rings[ring];
+
+    int head = rp->channel_status[A2R_HEAD_OFFSET];
+    int tail = rp->channel_status[A2R_TAIL_OFFSET];
+    int len = used_in_a2r(rp);
+    if (len == 0)
+        return false;
+
+    // Leaves room in the queue for the other messages to the client thread.
+    if (!b->to_client_backlog.empty() || b->to_client_queue.free_slots() < 128)
+    {
+        b->a2r_deferred = true;
+        return false;
+    }
+
+    uint8_t *buf = (uint8_t *)aligned_alloc(A2R_BUFFER_ALIGN, (len + A2R_BUFFER_ALIGN - 1) & ~(A2R_BUFFER_ALIGN - 1));
+    if (buf == nullptr)
+    {
+        logger_error("Unable to allocate a buffer for A2R\n");
+        exit(-1);
+    }
+
+    if (head < tail)
+        spi_read_mem_split(b, rp->a2r.address + head, len, 0, 0, buf);
+    else
+        spi_read_mem_split(b, rp->a2r.address + head, rp->a2r.size - head, rp->a2r.address, tail, buf);
+
+    // PKT_SETTINGS only comes in the legacy A2R, and is handled here.
+    if (!rp->a2r.extended)
+    {
+        int pos = 0;
+        while (pos < len)
+        {
+            int plen = buf[pos];
+            if (buf[pos + 1] == PKT_SETTINGS)
+            {
+                handle_pkt_settings(b, &buf[pos + PKT_HDR_LEN], plen);
+
+                // SWITCHED is the last packet in the legacy A2R.
+                if (b->a2r_switched)
+                {
+                    len = pos + PKT_HDR_LEN + plen;
+                    break;
+                }
+            }
+            pos += PKT_HDR_LEN + plen;
+        }
+    }
+
+    ThreadMessage tm;
+    tm.kind = TM_A2R;
+    tm.ring = ring;
+    tm.type = rp->a2r.jumbo;
+    tm.flow_control = rp->a2r.extended && (b->settings_reply[4] & SETTINGS_FLAG_CREDIT) != 0;
+    tm.length = len;
+    tm.buffer.reset(buf);
+    send_to_client(b, std::move(tm));
+
+    rp->channel_status[A2R_HEAD_OFFSET] = rp->channel_status[A2R_TAIL_OFFSET];
+    rp->pointers_updated = true;
+    b->channel_status_updated |= A_EVENT_A2R_HEAD;
+    return true;
+}
+
+// The rings are read in order of QoS class.
+static bool receive_from_a2r(Board *b)
+{
+    bool any = false;
+    for (int i = 0; i < b->a2r_count && !b->a2r_switched; i++)
+    {
+        if (receive_from_ring(b, i))
+            any = true;
+    }
+    return any;
+}
+
+// Called on the client thread. Hands packets to the SPI thread, round robin
+// between the channels of each QoS class, as long as the class has R2A
+// credit left. Control goes first, and bulk last. A channel that has used up
+// its own credit leaves the send queue until the Amiga gives some back.
+static bool flush_send_queue(Board *b)
+{
+    bool any = false;
+
+    for (int i = 0; i < QOS_CLASSES; i++)
+    {
+        auto &sq = b->send_queue[i];
+
+        while (!sq.empty())
+        {
+            LogicalChannel *ch = sq.front();
+            PacketBuffer &pb = ch->packet_queue.front();
+
+            if (ch->flow_control && pb.type == PKT_DATA && ch->send_credit < (int)pb.data.size())
+            {
+                sq.pop_front();
+                ch->credit_stalled = true;
+                ch->stalled_since_ns = monotonic_ns();
+                b->credit_stalls++;
+                continue;
+            }
+
+            int plen = PKT_HDR_LEN + pb.data.size();
+            if (b->r2a_credit[i] < plen)
+                break;
+
+            ThreadMessage tm;
+            tm.kind = TM_PACKET;
+            tm.type = pb.type;
+            tm.channel_id = ch->channel_id;
+            tm.generation = b->channels_generation;
+            tm.ring = i;
+            tm.data = std::move(pb.data);
+            send_to_spi(b, std::move(tm));
+
+            b->r2a_credit[i] -= plen;
+            if (pb.type == PKT_DATA)
+                ch->send_credit -= plen - PKT_HDR_LEN;
+            any = true;
+
+            ch->packet_queue.pop_front();
+
+            sq.pop_front();
+
+            if (!ch->packet_queue.empty())
+                sq.push_back(ch);
+            else
+                remove_channel_if_not_associated_and_empty_pq(b, ch->channel_id);
+        }
+    }
+
+    return any;
+}
 
-    std::string service_name((char *)&cc->payload[0], cc->payload.size());
+static void write_channel_status(Board *b);
+
+// Writes length bytes at the tail of an R2A ring, which has room for them.
+static void write_to_r2a(Board *b, RingPair *rp, uint8_t *p, int length)
+{
+    int tail = rp->channel_status[R2A_TAIL_OFFSET];
+    int at_end = rp->r2a.size - tail;
+    if (at_end < length)
+    {
+        spi_write_mem(b, rp->r2a.address + tail, p, at_end);
+        p += at_end;
+        length -= at_end;
+        tail = 0;
+    }
+
+    spi_write_mem(b, rp->r2a.address + tail, p, length);
+    tail = (tail + length) & (rp->r2a.size - 1);
+
+    rp->channel_status[R2A_TAIL_OFFSET] = tail;
+    rp->pointers_updated = true;
+    b->channel_status_updated |= A_EVENT_R2A_TAIL;
+}
+
+// Called on the SPI thread. The answer to an OFFER goes ahead of the pending
+// packets, and after an ACCEPT they are written to the extended R2A rings.
+static bool send_settings_reply(Board *b)
+{
+    RingPair *legacy = &b->rings[0];
+
+    uint8_t pkt[3 + sizeof(b->settings_reply)];
+    if (legacy->r2a.size - 1 - used_in_r2a(legacy) < (int)sizeof(pkt))
+        return false;
+
+    pkt[0] = sizeof(b->settings_reply);
+    pkt[1] = PKT_SETTINGS;
+    pkt[2] = 0;
+    memcpy(&pkt[3], b->settings_reply, sizeof(b->settings_reply));
+    write_to_r2a(b, legacy, pkt, sizeof(pkt));
+    b->settings_reply_pending = false;
+
+    if (b->settings_reply[0] != SETTINGS_ACCEPT)
+        return true;
+
+    // The Amiga must see ACCEPT at the tail of the legacy R2A before it
+    // looks anywhere else.
+    write_channel_status(b);
+
+    b->r2a_count = ext_pair_count(b);
+    for (int i = 0; i < b->r2a_count; i++)
+    {
+        RingPair *rp = &b->rings[i];
+        rp->r2a.extended = true;
+        rp->r2a.jumbo = (b->settings_reply[4] & SETTINGS_FLAG_JUMBO) != 0;
+        rp->r2a.address = ext_pair_address(b, i) + (1 << b->settings_reply[2]);
+        rp->r2a.size = 1 << b->settings_reply[3];
+        rp->channel_status[R2A_HEAD_OFFSET] = 0;
+        rp->channel_status[R2A_TAIL_OFFSET] = 0;
+
+        ThreadMessage tm;
+        tm.kind = TM_R2A_RESIZED;
+        tm.ring = i;
+        tm.type = rp->r2a.jumbo;
+        tm.length = rp->r2a.size;
+        send_to_client(b, std::move(tm));
+    }
+    return true;
+}
+
+// Called on the SPI thread. Writes as many of the pending packets as there
+// is room for in an R2A ring, and gives the credit back to the client thread.
+static bool flush_ring(Board *b, int ring)
+{
+    RingPair *rp = &b->rings[ring];
+
+    int left = rp->r2a.size - 1 - used_in_r2a(rp);
+    int hdr_len = rp->r2a.jumbo ? JUMBO_PKT_HDR_LEN : PKT_HDR_LEN;
+
+    int pos = 0;
+
+    // The client thread was charged for a legacy header, and that is what
+    // it gets back, whatever header the packet was written with.
+    int credit_length = 0;
+
+    while (!rp->r2a_pending.empty())
+    {
+        ThreadMessage &tm = rp->r2a_pending.front();
+
+        int plen = hdr_len + tm.data.size();
+        if (left < plen)
+            break;
 
-    for (auto it = services.begin(); it != services.end(); it++)
-    {
-        if (it->name == service_name && it->cc == cc)
+        if (rp->r2a.jumbo)
         {
-            services.erase(it);
-            result = MSG_SUCCESS;
-            break;
+            put_be16(&b->send_buf[pos], tm.data.size());
+            pos += 2;
         }
-    }
+        else
+            b->send_buf[pos++] = tm.data.size();
+        b->send_buf[pos++] = tm.type;
+        b->send_buf[pos++] = tm.channel_id;
+        if (!tm.data.empty())
+            memcpy(&b->send_buf[pos], &tm.data[0], tm.data.size());
+        pos += tm.data.size();
 
-    create_and_send_msg(cc, MSG_DEREGISTER_RES, 0, &result, 1);
-}
+        credit_length += PKT_HDR_LEN + tm.data.size();
+        rp->r2a_pending.pop_front();
 
-static void handle_msg_read_mem_req(ClientConnection *cc)
-{
-    uint32_t address = *(uint32_t *)&(cc->payload[0]);
-    uint32_t length = *(uint32_t *)&(cc->payload[4]);
+        left -= plen;
+    }
+
+    int to_write = pos;
+    if (!to_write)
+        return false;
 
-    spi_read_mem(address, length);
+    ThreadMessage credit;
+    credit.kind = TM_CREDIT;
+    credit.ring = ring;
+    credit.length = credit_length;
+    send_to_client(b, std::move(credit));
 
-    create_and_send_msg(cc, MSG_READ_MEM_RES, 0, &rx_buf[READ_SRAM_HDR_LEN], length);
+    write_to_r2a(b, rp, b->send_buf, to_write);
+    return true;
 }
 
-static void handle_msg_write_mem_req(ClientConnection *cc)
+static bool flush_r2a(Board *b)
 {
-    uint32_t address = *(uint32_t *)&(cc->payload[0]);
-    uint32_t length = cc->payload.size() - 4;
-
-    spi_write_mem(address, &(cc->payload[4]), length);
+    bool any = false;
+    if (b->settings_reply_pending)
+    {
+        if (!send_settings_reply(b))
+            return false;
+        any = true;
+    }
 
-    create_and_send_msg(cc, MSG_WRITE_MEM_RES, 0, nullptr, 0);
+    for (int i = 0; i < b->r2a_count; i++)
+    {
+        if (flush_ring(b, i))
+            any = true;
+    }
+    return any;
 }
 
-static LogicalChannel *get_associated_channel_by_stream_id(ClientConnection *cc, int stream_id)
+static bool watchdog_expecting_irq(Board *b)
 {
-    for (auto ch : cc->associations)
+    if (watchdog_deadline_ms == 0 || !b->have_base_address)
+        return false;
+
+    // With channels open the Amiga may write to A2R at any time, and a lost
+    // edge would go unnoticed even with both rings empty.
+    if (b->open_channel_count.load(std::memory_order_relaxed) != 0 || any_r2a_pending(b))
+        return true;
+
+    for (int i = 0; i < b->r2a_count; i++)
     {
-        if (ch->stream_id == stream_id)
-            return ch;
+        if (used_in_r2a(&b->rings[i]) != 0)
+            return true;
     }
-    return nullptr;
+    return false;
 }
 
-static void handle_msg_connect(ClientConnection *cc)
+// Returns the epoll timeout until the watchdog is due, or -1 if the watchdog
+// isn't waiting for anything.
+static int watchdog_timeout(Board *b)
 {
-    // We currently don't handle that a client tries to connect to a service on the Amiga.
+    if (!watchdog_expecting_irq(b))
+        return -1;
+
+    uint64_t due = b->watchdog.last_activity_ns + (uint64_t)watchdog_deadline_ms * 1000000;
+    uint64_t now = monotonic_ns();
+    return due > now ? (int)((due - now + 999999) / 1000000) : 0;
 }
 
-static void handle_msg_connect_response(ClientConnection *cc)
+static void shutdown_watchdog(Board *b)
 {
-    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, cc->header.stream_id);
-    if (!ch)
-        return;
-
-    create_and_enqueue_packet(ch, PKT_CONNECT_RESPONSE, &cc->payload[0], cc->payload.size());
-
-    if (cc->payload[0] != CONNECT_OK)
-        remove_association(ch);
+    if (b->watchdog.polls != 0)
+        logger_info("Watchdog on board %d polled R_EVENTS %llu times, and recovered %llu lost IRQs\n",
+                b->index, (unsigned long long)b->watchdog.polls, (unsigned long long)b->watchdog.recoveries);
 }
 
-static void handle_msg_data(ClientConnection *cc)
+static void start_latency_probe(Board *b)
 {
-    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, cc->header.stream_id);
-    if (!ch)
+    if (b->latency.timer_fd == -1)
         return;
 
-    create_and_enqueue_packet(ch, PKT_DATA, &cc->payload[0], cc->header.length);
+    b->latency.start_ns = monotonic_ns();
+
+    uint64_t first = b->latency.start_ns + LATENCY_PROBE_PERIOD_NS;
+
+    struct itimerspec its;
+    its.it_value.tv_sec = first / 1000000000ULL;
+    its.it_value.tv_nsec = first % 1000000000ULL;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = LATENCY_PROBE_PERIOD_NS;
+    timerfd_settime(b->latency.timer_fd, TFD_TIMER_ABSTIME, &its, nullptr);
 }
 
-static void handle_msg_eos(ClientConnection *cc)
+static void handle_latency_probe(Board *b)
 {
-    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, cc->header.stream_id);
-    if (!ch || ch->got_eos_from_client)
-        return;
+    uint64_t now = monotonic_ns();
 
-    ch->got_eos_from_client = true;
+    uint64_t count;
+    if (read(b->latency.timer_fd, &count, sizeof(count)) != sizeof(count))
+        return;
 
-    create_and_enqueue_packet(ch, PKT_EOS, nullptr, 0);
+    // Expirations that were missed altogether show up as a late last one.
+    b->latency.expirations += count;
+    uint64_t due = b->latency.start_ns + b->latency.expirations * LATENCY_PROBE_PERIOD_NS;
+    uint64_t late_us = now > due ? (now - due) / 1000 : 0;
 
-    if (ch->got_eos_from_ami)
-        remove_association(ch);
+    b->latency.samples++;
+    b->latency.hist[std::min<uint64_t>(late_us, 255)]++;
+    b->latency.max_us = std::max(b->latency.max_us, late_us);
 }
 
-static void handle_msg_reset(ClientConnection *cc)
+static void shutdown_latency_probe(Board *b)
 {
-    LogicalChannel *ch = get_associated_channel_by_stream_id(cc, cc->header.stream_id);
-    if (!ch)
+    if (b->latency.timer_fd == -1)
         return;
 
-    remove_association(ch);
+    close(b->latency.timer_fd);
+    b->latency.timer_fd = -1;
 
-    clear_packet_queue(ch);
-    create_and_enqueue_packet(ch, PKT_RESET, nullptr, 0);
+    uint64_t n = b->latency.samples;
+    if (n != 0)
+        logger_info("Scheduling latency of the SPI thread of board %d: %llu samples, p50 %llu us, p99 %llu us, max %llu us\n",
+                b->index, (unsigned long long)n, (unsigned long long)histogram_percentile(b->latency.hist, n, 50),
+                (unsigned long long)histogram_percentile(b->latency.hist, n, 99), (unsigned long long)b->latency.max_us);
 }
 
-static void handle_received_message(ClientConnection *cc)
+static void read_base_address(Board *b)
 {
-    switch (cc->header.type)
+    b->have_base_address = false;
+
+    unsigned int ba1 = 0;
+    for (int i = 0; i < 5; i++)
+        ba1 |= spi_read_cmem(b, i) << (i * 4);
+
+    if ((ba1 & 1) == 1)
     {
-    case MSG_REGISTER_REQ:
-        handle_msg_register_req(cc);
-        break;
-    case MSG_DEREGISTER_REQ:
-        handle_msg_deregister_req(cc);
-        break;
-    case MSG_READ_MEM_REQ:
-        handle_msg_read_mem_req(cc);
-        break;
-    case MSG_WRITE_MEM_REQ:
-        handle_msg_write_mem_req(cc);
-        break;
-    case MSG_CONNECT:
-        handle_msg_connect(cc);
-        break;
-    case MSG_CONNECT_RESPONSE:
-        handle_msg_connect_response(cc);
-        break;
-    case MSG_DATA:
-        handle_msg_data(cc);
-        break;
-    case MSG_EOS:
-        handle_msg_eos(cc);
-        break;
-    case MSG_RESET:
-        handle_msg_reset(cc);
-        break;
-    default:
-        // This is bad, probably should disconnect from client.
-        logger_warn("Received a message of unknown type from client\n");
-        break;
+        unsigned int ba2 = 0;
+        for (int i = 0; i < 5; i++)
+            ba2 |= spi_read_cmem(b, i) << (i * 4);
+
+        if (ba1 == ba2)
+        {
+            b->have_base_address = true;
+            b->base_address = ba1 & ~1;
+        }
     }
+
+    reset_ring_layout(b);
 }
 
-static void close_and_remove_connection(ClientConnection *cc)
+static void read_channel_status(Board *b)
 {
-    shutdown(cc->fd, SHUT_WR);
-    close(cc->fd);
+    RingPair *legacy = &b->rings[0];
 
+    if (!legacy->a2r.extended || !legacy->r2a.extended)
     {
-        auto it = services.begin();
-        while (it != services.end())
+        spi_read_mem(b, b->base_address, 4);
+
+        uint8_t *p = &b->rx_buf[READ_SRAM_HDR_LEN];
+        if (!legacy->a2r.extended)
         {
-            if (it->cc == cc)
-                it = services.erase(it);
-            else
-                it++;
+            legacy->channel_status[A2R_TAIL_OFFSET] = p[A2R_TAIL_OFFSET];
+            legacy->channel_status[A2R_HEAD_OFFSET] = p[A2R_HEAD_OFFSET];
+        }
+        if (!legacy->r2a.extended)
+        {
+            legacy->channel_status[R2A_HEAD_OFFSET] = p[R2A_HEAD_OFFSET];
+            legacy->channel_status[R2A_TAIL_OFFSET] = p[R2A_TAIL_OFFSET];
         }
     }
 
+    // R2A is the first to move, so while any ring is extended every pair in
+    // the extended area has its R2A ring in use.
+    if (legacy->r2a.extended)
     {
-        auto it = cc->associations.begin();
-        while (it != cc->associations.end())
+        int length = b->r2a_count * EXT_POINTERS_LEN;
+
+        // A read over SPI isn't atomic with the Amiga's word writes. A pointer
+        // that doesn't match its complement was caught half way through an
+        // update, and is read again. If it never matches, as when the Amiga
+        // has been reset or the area is corrupt, the pointers that were last
+        // read are kept, and the watchdog or the next base address recovers.
+        uint8_t *status = &b->rx_buf[READ_SRAM_HDR_LEN];
+        bool torn = true;
+        for (int read = 0; read < EXT_POINTERS_READS && torn; read++)
         {
-            auto ch = *it;
-
-            clear_packet_queue(ch);
-            create_and_enqueue_packet(ch, PKT_RESET, nullptr, 0);
+            spi_read_mem(b, b->ext_address, length);
 
-            ch->association = nullptr;
-            ch->stream_id = 0;
+            torn = false;
+            for (int i = 0; i < length; i += 4)
+                if (get_be16(&status[i + 2]) != (uint16_t)~get_be16(&status[i]))
+                    torn = true;
+        }
 
-            it = cc->associations.erase(it);
+        if (torn)
+        {
+            if (!b->ext_pointers_torn)
+                logger_warn("Board %d: the extended ring pointers were torn in %d reads in a row, keeping the last ones\n",
+                        b->index, EXT_POINTERS_READS);
+            b->ext_pointers_torn = true;
+            b->channel_status_updated = 0;
+            return;
         }
-    }
+        b->ext_pointers_torn = false;
 
-    for (auto it = connections.begin(); it != connections.end(); it++)
-    {
-        if (&(*it) == cc)
+        for (int i = 0; i < b->r2a_count; i++)
         {
-            connections.erase(it);
-            break;
+            RingPair *rp = &b->rings[i];
+            uint8_t *pointers = &status[i * EXT_POINTERS_LEN];
+            if (rp->a2r.extended)
+            {
+                rp->channel_status[A2R_TAIL_OFFSET] = get_be16(&pointers[EXT_A2R_TAIL_OFFSET]);
+                rp->channel_status[A2R_HEAD_OFFSET] = get_be16(&pointers[EXT_A2R_HEAD_OFFSET]);
+            }
+            rp->channel_status[R2A_HEAD_OFFSET] = get_be16(&pointers[EXT_R2A_HEAD_OFFSET]);
+            rp->channel_status[R2A_TAIL_OFFSET] = get_be16(&pointers[EXT_R2A_TAIL_OFFSET]);
         }
     }
-}
-
-static void remove_association(LogicalChannel *ch)
-{
-    auto &ass = ch->association->associations;
-    ass.erase(std::find(ass.begin(), ass.end(), ch));
 
-    ch->association = nullptr;
-    ch->stream_id = 0;
+    b->channel_status_updated = 0;
 }
 
-static void clear_packet_queue(LogicalChannel *ch)
+// Writes the pointers that a314d owns, R2A tail and A2R head, to whichever
+// layout each ring is in, for the pairs where they have moved. R2A is always
+// the first to move.
+static void put_ext_pointer(uint8_t *p, uint16_t v)
 {
-    if (!ch->packet_queue.empty())
-    {
-        ch->packet_queue.clear();
-        send_queue.erase(std::find(send_queue.begin(), send_queue.end(), ch));
-    }
+    put_be16(&p[0], v);
+    put_be16(&p[2], ~v);
 }
 
-static void create_and_enqueue_packet(LogicalChannel *ch, uint8_t type, uint8_t *data, uint8_t length)
+static void write_ring_pointers(Board *b)
 {
-    if (ch->packet_queue.empty())
-        send_queue.push_back(ch);
-
-    ch->packet_queue.emplace_back();
-
-    PacketBuffer &pb = ch->packet_queue.back();
-    pb.type = type;
-    pb.data.resize(length);
-    if (data && length)
-        memcpy(&pb.data[0], data, length);
-}
+    uint8_t p[8];
 
-static void handle_pkt_connect(int channel_id, uint8_t *data, int plen)
-{
-    for (auto &ch : channels)
+    RingPair *legacy = &b->rings[0];
+    if (!legacy->r2a.extended)
     {
-        if (ch.channel_id == channel_id)
-        {
-            // We should handle this in some constructive way.
-            // This signals that should reset all logical channels.
-            logger_error("Received a CONNECT packet on a channel that was believed to be previously allocated\n");
-            exit(-1);
-        }
+        p[0] = legacy->channel_status[R2A_TAIL_OFFSET];
+        p[1] = legacy->channel_status[A2R_HEAD_OFFSET];
+        spi_write_mem(b, b->base_address + R2A_TAIL_OFFSET, p, 2);
+        legacy->pointers_updated = false;
+        return;
     }
 
-    channels.emplace_back();
-
-    auto &ch = channels.back();
-
-    ch.channel_id = channel_id;
-    ch.association = nullptr;
-    ch.stream_id = 0;
-    ch.got_eos_from_ami = false;
-    ch.got_eos_from_client = false;
-
-    std::string service_name((char *)data, plen);
-
-    for (auto &srv : services)
+    for (int i = 0; i < b->r2a_count; i++)
     {
-        if (srv.name == service_name)
-        {
-            ClientConnection *cc = srv.cc;
+        RingPair *rp = &b->rings[i];
+        if (!rp->pointers_updated)
+            continue;
 
-            ch.association = cc;
-            ch.stream_id = cc->next_stream_id;
+        unsigned int address = b->ext_address + i * EXT_POINTERS_LEN + EXT_R2A_TAIL_OFFSET;
+        put_ext_pointer(&p[0], rp->channel_status[R2A_TAIL_OFFSET]);
 
-            cc->next_stream_id += 2;
-            cc->associations.push_back(&ch);
-
-            create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
-            return;
+        if (rp->a2r.extended)
+        {
+            put_ext_pointer(&p[4], rp->channel_status[A2R_HEAD_OFFSET]);
+            spi_write_mem(b, address, p, 8);
         }
-    }
-
-    for (auto &on_demand : on_demand_services)
-    {
-        if (on_demand.service_name == service_name)
+        else
         {
-            int fds[2];
-            int status = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
-            if (status != 0)
-            {
-                logger_error("Unexpectedly not able to create socket pair.\n");
-                exit(-1);
-            }
+            spi_write_mem(b, address, p, 4);
 
-            pid_t child = fork();
-            if (child == -1)
-            {
-                logger_error("Unexpectedly was not able to fork.\n");
-                exit(-1);
-            }
-            else if (child == 0)
-            {
-                close(fds[0]);
-                int fd = fds[1];
-
-                std::vector<std::string> args(on_demand.arguments);
-                args.push_back("-ondemand");
-                args.push_back(std::to_string(fd));
-                std::vector<const char *> args_arr;
-                for (auto &arg : args)
-                    args_arr.push_back(arg.c_str());
-                args_arr.push_back(nullptr);
-
-                execvp(on_demand.program.c_str(), (char* const*) &args_arr[0]);
-            }
-            else
+            // Until SWITCHED the only A2R ring is the legacy one.
+            if (i == 0)
             {
-                close(fds[1]);
-                int fd = fds[0];
-
-                int status = fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
-                if (status == -1)
-                {
-                    logger_error("Unexpectedly unable to set close-on-exec flag on client socket descriptor; errno = %d\n", errno);
-                    exit(-1);
-                }
-
-                status = fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
-                if (status == -1)
-                {
-                    logger_error("Unexpectedly unable to set client socket to non blocking; errno = %d\n", errno);
-                    exit(-1);
-                }
-
-                int flag = 1;
-                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
-
-                connections.emplace_back();
-
-                ClientConnection &cc = connections.back();
-                cc.fd = fd;
-                cc.next_stream_id = 1;
-                cc.bytes_read = 0;
-
-                struct epoll_event ev;
-                ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-                ev.data.fd = fd;
-                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
-                {
-                    logger_error("epoll_ctl() failed unexpectedly with errno = %d\n", errno);
-                    exit(-1);
-                }
-
-                services.emplace_back();
-
-                RegisteredService &srv = services.back();
-                srv.cc = &cc;
-                srv.name = std::move(service_name);
-
-                ch.association = &cc;
-                ch.stream_id = cc.next_stream_id;
-
-                cc.next_stream_id += 2;
-                cc.associations.push_back(&ch);
-
-                create_and_send_msg(ch.association, MSG_CONNECT, ch.stream_id, data, plen);
-                return;
+                p[0] = rp->channel_status[A2R_HEAD_OFFSET];
+                spi_write_mem(b, b->base_address + A2R_HEAD_OFFSET, p, 1);
             }
         }
-    }
 
-    uint8_t response = CONNECT_UNKNOWN_SERVICE;
-    create_and_enqueue_packet(&ch, PKT_CONNECT_RESPONSE, &response, 1);
+        rp->pointers_updated = false;
+    }
 }
 
-static void handle_pkt_data(int channel_id, uint8_t *data, int plen)
+static void write_channel_status(Board *b)
 {
-    for (auto &ch : channels)
+    if (b->channel_status_updated != 0)
     {
-        if (ch.channel_id == channel_id)
-        {
-            if (ch.association != nullptr && !ch.got_eos_from_ami)
-                create_and_send_msg(ch.association, MSG_DATA, ch.stream_id, data, plen);
+        write_ring_pointers(b);
+        spi_write_cmem(b, A_EVENTS_ADDRESS, b->channel_status_updated);
+        b->channel_status_updated = 0;
 
-            break;
-        }
+        // The Amiga has been signalled, so give it a full deadline to answer.
+        b->watchdog.last_activity_ns = monotonic_ns();
     }
 }
 
-static void handle_pkt_eos(int channel_id)
+static void close_all_logical_channels(Board *b)
 {
-    for (auto &ch : channels)
-    {
-        if (ch.channel_id == channel_id)
-        {
-            if (ch.association != nullptr && !ch.got_eos_from_ami)
-            {
-                ch.got_eos_from_ami = true;
+    if (!b->channels.empty())
+        logger_info("Base address of board %d was updated while logical channels are open -- closing channels\n", b->index);
 
-                create_and_send_msg(ch.association, MSG_EOS, ch.stream_id, nullptr, 0);
-
-                if (ch.got_eos_from_client)
-                    remove_association(&ch);
-            }
-            break;
-        }
-    }
-}
+    b->active_bench_sources = 0;
 
-static void handle_pkt_reset(int channel_id)
-{
-    for (auto &ch : channels)
+    for (auto &ch : b->channels)
     {
-        if (ch.channel_id == channel_id)
+        if (ch.association != nullptr)
         {
-            clear_packet_queue(&ch);
+            ClientConnection *cc = ch.association;
+            int stream_id = ch.stream_id;
 
-            if (ch.association != nullptr)
-            {
-                create_and_send_msg(ch.association, MSG_RESET, ch.stream_id, nullptr, 0);
-                remove_association(&ch);
-            }
-
-            break;
+            remove_association(&ch);
+            create_and_send_msg(cc, MSG_RESET, stream_id, nullptr, 0);
         }
     }
+
+    // Cleared last, as a plugin may queue packets while it is told about
+    // the resets.
+    for (auto &sq : b->send_queue)
+        sq.clear();
+    b->channels.clear();
 }
 
-static void remove_channel_if_not_associated_and_empty_pq(int channel_id)
+static void handle_a314_events(Board *b, uint8_t events);
+
+static void handle_a314_irq(Board *b)
 {
-    for (auto it = channels.begin(); it != channels.end(); it++)
-    {
-        if (it->channel_id == channel_id)
-        {
-            if (it->association == nullptr && it->packet_queue.empty())
-                channels.erase(it);
+    b->watchdog.last_activity_ns = monotonic_ns();
 
-            break;
-        }
+    if (b->profiler.enabled)
+        profile_irq_begin(b);
+
+    uint8_t events = spi_ack_irq(b);
+    if (events == 0)
+    {
+        if (b->profiler.enabled)
+            b->profiler.spurious_irqs++;
+        return;
     }
+
+    handle_a314_events(b, events);
 }
 
-static void handle_received_pkt(int ptype, int channel_id, uint8_t *data, int plen)
+static void handle_watchdog_timeout(Board *b)
 {
-    if (ptype == PKT_CONNECT)
-        handle_pkt_connect(channel_id, data, plen);
-    else if (ptype == PKT_DATA)
-        handle_pkt_data(channel_id, data, plen);
-    else if (ptype == PKT_EOS)
-        handle_pkt_eos(channel_id);
-    else if (ptype == PKT_RESET)
-        handle_pkt_reset(channel_id);
+    b->watchdog.last_activity_ns = monotonic_ns();
+    b->watchdog.polls++;
+
+    uint8_t events = spi_ack_irq(b);
+    if (events == 0)
+        return;
+
+    b->watchdog.recoveries++;
+    logger_debug("Watchdog recovered events %d that were not signalled by an IRQ\n", events);
+
+    if (b->profiler.enabled)
+        profile_irq_begin(b);
 
-    remove_channel_if_not_associated_and_empty_pq(channel_id);
+    handle_a314_events(b, events);
 }
 
-static bool receive_from_a2r()
+static void service_rings(Board *b, uint8_t events)
 {
-    int head = channel_status[A2R_HEAD_OFFSET];
-    int tail = channel_status[A2R_TAIL_OFFSET];
-    int len = (tail - head) & 255;
-    if (len == 0)
-        return false;
+    read_channel_status(b);
 
-    if (head < tail)
+    int a2r_used = 0;
+    int r2a_used = 0;
+    bool a2r_full = false;
+    bool r2a_extended = b->rings[0].r2a.extended;
+    if (b->profiler.enabled)
     {
-        spi_read_mem(base_address + 4 + head, tail - head);
-        memcpy(recv_buf, &rx_buf[READ_SRAM_HDR_LEN], len);
+        for (int i = 0; i < b->a2r_count; i++)
+        {
+            RingPair *rp = &b->rings[i];
+            a2r_used += used_in_a2r(rp);
+            if (rp->a2r.size - 1 - used_in_a2r(rp) < PROFILE_A2R_FULL_ROOM)
+                a2r_full = true;
+        }
+        for (int i = 0; i < b->r2a_count; i++)
+            r2a_used += used_in_r2a(&b->rings[i]);
     }
-    else
-    {
-        spi_read_mem(base_address + 4 + head, 256 - head);
-        memcpy(recv_buf, &rx_buf[READ_SRAM_HDR_LEN], 256 - head);
 
-        if (tail != 0)
+    bool any_rcvd = receive_from_a2r(b);
+    bool any_sent = flush_r2a(b);
+
+    if (b->profiler.enabled)
+    {
+        // Left out on the IRQ where R2A changed rings.
+        int bytes_out = 0;
+        if (r2a_extended == b->rings[0].r2a.extended)
         {
-            spi_read_mem(base_address + 4, tail);
-            memcpy(&recv_buf[len - tail], &rx_buf[READ_SRAM_HDR_LEN], tail);
+            for (int i = 0; i < b->r2a_count; i++)
+                bytes_out += used_in_r2a(&b->rings[i]);
+            bytes_out -= r2a_used;
         }
+        profile_irq_end(b, events, a2r_used, r2a_used, any_rcvd ? a2r_used : 0, bytes_out, a2r_full, any_r2a_pending(b));
     }
 
-    uint8_t *p = recv_buf;
-    while (p < recv_buf + len)
+    if (any_rcvd || any_sent)
+        write_channel_status(b);
+
+    // The Amiga may already have written to the extended A2R, and signalled
+    // that with the same IRQ.
+    if (b->a2r_switched)
     {
-        uint8_t plen = *p++;
-        uint8_t ptype = *p++;
-        uint8_t channel_id = *p++;
-        handle_received_pkt(ptype, channel_id, p, plen);
-        p += plen;
+        b->a2r_switched = false;
+        service_rings(b, events);
     }
-
-    channel_status[A2R_HEAD_OFFSET] = channel_status[A2R_TAIL_OFFSET];
-    channel_status_updated |= A_EVENT_A2R_HEAD;
-    return true;
 }
 
-static bool flush_send_queue()
+static void handle_a314_events(Board *b, uint8_t events)
 {
-    int tail = channel_status[R2A_TAIL_OFFSET];
-    int head = channel_status[R2A_HEAD_OFFSET];
-    int len = (tail - head) & 255;
-    int left = 255 - len;
+    if ((events & R_EVENT_BASE_ADDRESS) || !b->have_base_address)
+    {
+        // Packets for the old channels that are still on their way from the
+        // client thread are recognized by their generation, and dropped.
+        for (auto &rp : b->rings)
+            rp.r2a_pending.clear();
+        b->spi_generation++;
+
+        ThreadMessage tm;
+        tm.kind = TM_CHANNELS_RESET;
+        tm.generation = b->spi_generation;
+        send_to_client(b, std::move(tm));
+
+        read_base_address(b);
+    }
 
-    int pos = 0;
+    if (!b->have_base_address)
+        return;
+
+    service_rings(b, events);
+}
 
-    while (!send_queue.empty())
+// WRITE_MEM requests that arrive in the same batch from the client thread
+// are merged where they overlap or touch, the later bytes winning, so that
+// many small writes become few SPI transfers. The bursts are written, and
+// the requests answered in the order they came, before the next read of
+// shared memory and before the batch's packets go to the R2A rings.
+static void flush_write_mem(Board *b)
+{
+    for (auto &wb : b->write_bursts)
     {
-        LogicalChannel *ch = send_queue.front();
-        PacketBuffer &pb = ch->packet_queue.front();
+        spi_write_mem(b, wb.address, &wb.data[0], wb.data.size());
+        b->mem_write_bursts++;
+    }
+    b->write_bursts.clear();
+
+    for (auto &tm : b->write_completions)
+        send_to_client(b, std::move(tm));
+    b->write_completions.clear();
+}
 
-        int ptype = pb.type;
-        int plen = 3 + pb.data.size();
+static void combine_write_mem(Board *b, ThreadMessage &tm)
+{
+    b->mem_writes++;
 
-        if (left < plen)
-            break;
+    unsigned int start = tm.address;
+    unsigned int end = start + tm.data.size();
 
-        send_buf[pos++] = pb.data.size();
-        send_buf[pos++] = ptype;
-        send_buf[pos++] = ch->channel_id;
-        memcpy(&send_buf[pos], &pb.data[0], pb.data.size());
-        pos += pb.data.size();
+    if (start != end)
+    {
+        // Find the span that the write covers together with every burst it
+        // overlaps or touches. Merging may grow the span into further
+        // bursts, so repeat until it is stable.
+        bool grown = true;
+        while (grown)
+        {
+            grown = false;
+            for (auto &wb : b->write_bursts)
+            {
+                unsigned int wb_end = wb.address + wb.data.size();
+                if (wb.address <= end && start <= wb_end && (wb.address < start || wb_end > end))
+                {
+                    start = std::min(start, wb.address);
+                    end = std::max(end, wb_end);
+                    grown = true;
+                }
+            }
+        }
 
-        ch->packet_queue.pop_front();
+        if (end - start > sizeof(b->tx_buf) - WRITE_SRAM_HDR_LEN)
+        {
+            flush_write_mem(b);
+            start = tm.address;
+            end = start + tm.data.size();
+        }
 
-        send_queue.pop_front();
+        // The common case, a write that touches no other, keeps its buffer.
+        if (start == tm.address && end == start + tm.data.size())
+        {
+            bool covers = false;
+            for (auto &wb : b->write_bursts)
+                if (wb.address >= start && wb.address + wb.data.size() <= end)
+                    covers = true;
 
-        if (!ch->packet_queue.empty())
-            send_queue.push_back(ch);
-        else
-            remove_channel_if_not_associated_and_empty_pq(ch->channel_id);
+            if (!covers)
+            {
+                b->write_bursts.push_back(WriteBurst{start, std::move(tm.data)});
+                tm.data.clear();
+                b->write_completions.push_back(std::move(tm));
+                return;
+            }
+        }
 
-        left -= plen;
-    }
+        WriteBurst merged;
+        merged.address = start;
+        merged.data.resize(end - start);
 
-    int to_write = pos;
-    if (!to_write)
-        return false;
+        auto it = b->write_bursts.begin();
+        while (it != b->write_bursts.end())
+        {
+            if (it->address >= start && it->address + it->data.size() <= end)
+            {
+                memcpy(&merged.data[it->address - start], &it->data[0], it->data.size());
+                it = b->write_bursts.erase(it);
+            }
+            else
+                it++;
+        }
 
-    uint8_t *p = send_buf;
-    int at_end = 256 - tail;
-    if (at_end < to_write)
-    {
-        spi_write_mem(base_address + 260 + tail, p, at_end);
-        p += at_end;
-        to_write -= at_end;
-        tail = 0;
+        memcpy(&merged.data[tm.address - start], &tm.data[0], tm.data.size());
+        b->write_bursts.push_back(std::move(merged));
     }
 
-    spi_write_mem(base_address + 260 + tail, p, to_write);
-    tail = (tail + to_write) & 255;
-
-    channel_status[R2A_TAIL_OFFSET] = tail;
-    channel_status_updated |= A_EVENT_R2A_TAIL;
-    return true;
+    tm.data.clear();
+    b->write_completions.push_back(std::move(tm));
 }
 
-static void read_base_address()
+static void shutdown_write_mem(Board *b)
 {
-    have_base_address = false;
-
-    unsigned int ba1 = 0;
-    for (int i = 0; i < 5; i++)
-        ba1 |= spi_read_cmem(i) << (i * 4);
+    if (b->mem_writes != 0)
+        logger_info("Memory writes on board %d went to SPI as %llu bursts for %llu requests\n",
+                b->index, (unsigned long long)b->mem_write_bursts, (unsigned long long)b->mem_writes);
+}
 
-    if ((ba1 & 1) == 1)
+// Called on the SPI thread for each message from the client thread.
+static void handle_client_thread_message(Board *b, ThreadMessage &tm)
+{
+    if (tm.kind == TM_PACKET)
     {
-        unsigned int ba2 = 0;
-        for (int i = 0; i < 5; i++)
-            ba2 |= spi_read_cmem(i) << (i * 4);
-
-        if (ba1 == ba2)
+        if (tm.generation == b->spi_generation)
+            b->rings[tm.ring].r2a_pending.push_back(std::move(tm));
+    }
+    else if (tm.kind == TM_READ_MEM)
+    {
+        flush_write_mem(b);
+        spi_read_mem(b, tm.address, tm.length);
+        tm.data.assign(&b->rx_buf[READ_SRAM_HDR_LEN], &b->rx_buf[READ_SRAM_HDR_LEN + tm.length]);
+        send_to_client(b, std::move(tm));
+    }
+    else if (tm.kind == TM_WRITE_MEM)
+        combine_write_mem(b, tm);
+    else if (tm.kind == TM_SNAPSHOT)
+    {
+        flush_write_mem(b);
+        uint8_t *buf = (uint8_t *)aligned_alloc(A2R_BUFFER_ALIGN, (tm.length + A2R_BUFFER_ALIGN - 1) & ~(A2R_BUFFER_ALIGN - 1));
+        if (buf == nullptr)
         {
-            have_base_address = true;
-            base_address = ba1 & ~1;
+            logger_error("Unable to allocate a buffer for a snapshot\n");
+            exit(-1);
         }
+
+        spi_read_mem_split(b, tm.address, tm.length, 0, 0, buf);
+        tm.buffer.reset(buf);
+        send_to_client(b, std::move(tm));
     }
+    else if (tm.kind == TM_STOP)
+        b->spi_stop = true;
 }
 
-static void read_channel_status()
+static void handle_client_thread_messages(Board *b)
 {
-    spi_read_mem(base_address, 4);
+    ThreadMessage *tm;
+    while ((tm = b->to_spi_queue.front()) != nullptr)
+    {
+        handle_client_thread_message(b, *tm);
+        b->to_spi_queue.pop();
+    }
+
+    flush_write_mem(b);
 
-    for (int i = 0; i < 4; i++)
-        channel_status[i] = rx_buf[READ_SRAM_HDR_LEN + i];
+    if (b->have_base_address && any_r2a_pending(b) && flush_r2a(b))
+        write_channel_status(b);
+}
 
-    channel_status_updated = 0;
+static ClientConnection *get_connection_by_id(uint32_t id)
+{
+    for (auto &cc : connections)
+        if (cc.id == id)
+            return &cc;
+    return nullptr;
 }
 
-static void write_channel_status()
+// Called on the client thread for PKT_SETTINGS WINDOW in A2R.
+static void handle_window_offer(Board *b, const uint8_t *data, int plen)
 {
-    if (channel_status_updated != 0)
+    if (plen < SETTINGS_WINDOW_LEN)
+        return;
+
+    unsigned int address = get_be32(&data[1]);
+    unsigned int length = get_be32(&data[5]);
+    if (b->window_length != 0 || length < WINDOW_ALIGN || address >= 0x100000 || length > 0x100000 - address)
     {
-        spi_write_mem(base_address + 2, &channel_status[R2A_TAIL_OFFSET], 2);
-        spi_write_cmem(A_EVENTS_ADDRESS, channel_status_updated);
-        channel_status_updated = 0;
+        logger_warn("Board %d offered a transfer window that a314d can't use (address %06x, length %u)\n",
+                b->index, address, length);
+        return;
     }
+
+    b->window_address = address;
+    b->window_length = length;
+    logger_info("Board %d has a %u byte transfer window at address %06x\n", b->index, length, address);
 }
 
-static void close_all_logical_channels()
+// Called on the client thread when the Amiga publishes a new base address.
+// Clients that still have slices of the window learn that the Amiga went
+// away from the RESET of their logical channels.
+static void drop_window(Board *b)
 {
-    send_queue.clear();
+    if (!b->window_slices.empty())
+        logger_warn("Board %d gave up its transfer window with %d slices in use\n",
+                b->index, (int)b->window_slices.size());
+
+    b->window_length = 0;
+    b->window_slices.clear();
+    b->window_used = 0;
+}
 
-    auto it = channels.begin();
-    while (it != channels.end())
+// The packets read from an A2R ring are parsed where they are, in the buffer
+// that came from the SPI thread. PKT_SETTINGS has already been handled there,
+// apart from WINDOW and LISTEN.
+static void handle_a2r(Board *b, ThreadMessage &tm)
+{
+    uint8_t *buf = tm.buffer.get();
+    uint8_t *p = buf;
+    while (p < buf + tm.length)
     {
-        LogicalChannel &ch = *it;
+        int plen;
+        if (tm.type)
+        {
+            plen = get_be16(p);
+            p += 2;
+        }
+        else
+            plen = *p++;
 
-        if (ch.association != nullptr)
+        int ptype = *p++;
+        int channel_id = *p++;
+
+        if (ptype != PKT_SETTINGS)
+            handle_received_pkt(b, tm.ring, tm.flow_control, ptype, channel_id, plen == 0 ? nullptr : p, plen);
+        else if (plen >= 1 && p[0] == SETTINGS_WINDOW)
+            handle_window_offer(b, p, plen);
+        else if (plen >= 1 && p[0] == SETTINGS_LISTEN && !b->amiga_listens)
         {
-            create_and_send_msg(ch.association, MSG_RESET, ch.stream_id, nullptr, 0);
-            remove_association(&ch);
+            logger_info("Board %d accepts logical channels opened by clients\n", b->index);
+            b->amiga_listens = true;
         }
 
-        it = channels.erase(it);
+        p += plen;
     }
 }
 
-static void handle_a314_irq()
+// Called on the client thread for each message from the SPI thread.
+static void handle_spi_thread_message(Board *b, ThreadMessage &tm)
 {
-    uint8_t events = spi_ack_irq();
-    if (events == 0)
-        return;
-
-    if ((events & R_EVENT_BASE_ADDRESS) || !have_base_address)
+    if (tm.kind == TM_A2R)
     {
-        if (have_base_address && !channels.empty())
-            logger_info("Base address was updated while logical channels are open -- closing channels\n");
-
-        close_all_logical_channels();
-        read_base_address();
+        handle_a2r(b, tm);
+        trigger_a2r_snapshots(b);
     }
+    else if (tm.kind == TM_SNAPSHOT)
+        handle_snapshot_read(tm);
+    else if (tm.kind == TM_CREDIT)
+        b->r2a_credit[tm.ring] += tm.length;
+    else if (tm.kind == TM_R2A_RESIZED)
+    {
+        int limit = 2 * tm.length;
+        b->r2a_credit[tm.ring] += limit - b->r2a_credit_limit[tm.ring];
+        b->r2a_credit_limit[tm.ring] = limit;
+        if (tm.type)
+            b->max_payload = tm.length - 1 - JUMBO_PKT_HDR_LEN;
+    }
+    else if (tm.kind == TM_CHANNELS_RESET)
+    {
+        close_all_logical_channels(b);
+        drop_window(b);
+        b->amiga_listens = false;
+        b->channels_generation = tm.generation;
+        reset_r2a_credit(b);
+    }
+    else if (tm.kind == TM_READ_MEM || tm.kind == TM_WRITE_MEM)
+    {
+        ClientConnection *cc = get_connection_by_id(tm.connection_id);
+        if (cc == nullptr)
+            return;
 
-    if (!have_base_address)
-        return;
-
-    read_channel_status();
+        if (tm.kind == TM_READ_MEM)
+        {
+            CompressedPayload cp = {};
+            send_mem_msg(cc, MSG_READ_MEM_RES, 0, tm.data.empty() ? nullptr : &tm.data[0], tm.data.size(), cp);
+        }
+        else
+            create_and_send_msg(cc, MSG_WRITE_MEM_RES, 0, nullptr, 0);
+    }
+}
 
-    bool any_rcvd = receive_from_a2r();
-    bool any_sent = flush_send_queue();
+static void handle_spi_thread_messages(Board *b)
+{
+    ThreadMessage *tm;
+    while ((tm = b->to_client_queue.front()) != nullptr)
+    {
+        handle_spi_thread_message(b, *tm);
+        b->to_client_queue.pop();
+    }
 
-    if (any_rcvd || any_sent)
-        write_channel_status();
+    refill_bench_sources(b);
+    flush_send_queue(b);
 }
 
 static void handle_client_connection_event(ClientConnection *cc, struct epoll_event *ev)
@@ -1315,7 +5133,12 @@ static void handle_client_connection_event(ClientConnection *cc, struct epoll_ev
 
             mb.pos += r;
             if (r == left)
+            {
+                MessageHeader *mh = (MessageHeader *)&mb.data[0];
+                if (mh->type == MSG_DATA)
+                    data_delivered(cc, mh->stream_id, mh->length);
                 cc->message_queue.pop_front();
+            }
         }
     }
 }
@@ -1353,7 +5176,13 @@ static void handle_server_socket_ready()
 
     ClientConnection &cc = connections.back();
     cc.fd = fd;
+    cc.id = next_connection_id++;
+    cc.board = &boards.front();
+    cc.plugin = nullptr;
+    cc.warm_for = nullptr;
+    cc.cold_start_ns = 0;
     cc.next_stream_id = 1;
+    cc.compression = COMPRESS_NONE;
     cc.bytes_read = 0;
 
     struct epoll_event ev;
@@ -1366,18 +5195,160 @@ static void handle_server_socket_ready()
     }
 }
 
+static void *spi_thread_main(void *arg)
+{
+    Board *b = (Board *)arg;
+
+    if (b->cpu != -1)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(b->cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            logger_warn("Unable to pin the SPI thread of board %d to CPU %d\n", b->index, b->cpu);
+    }
+
+    if (realtime_priority != 0)
+    {
+        struct sched_param sp;
+        sp.sched_priority = realtime_priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+        if (err != 0)
+            logger_warn("Unable to run the SPI thread of board %d at SCHED_FIFO priority %d; error = %d\n", b->index, realtime_priority, err);
+    }
+
+    start_latency_probe(b);
+
+    handle_a314_irq(b);
+
+    // Only the sysfs GPIO reports an initial event that has to be skipped.
+    bool first_gpio_event = b->virtual_name == nullptr;
+
+    while (!b->spi_stop)
+    {
+        int timeout = watchdog_timeout(b);
+
+        int verify_timeout = spi_verify_timeout(b);
+        if (verify_timeout != -1 && (timeout == -1 || verify_timeout < timeout))
+            timeout = verify_timeout;
+
+        // Retry soon if A2R was left unread, or messages are waiting for room
+        // in the queue to the client thread.
+        if ((b->a2r_deferred || !b->to_client_backlog.empty()) && (timeout == -1 || timeout > 1))
+            timeout = 1;
+
+        struct epoll_event ev;
+        int n = epoll_wait(b->epfd, &ev, 1, timeout);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            logger_error("epoll_wait failed with unexpected errno = %d\n", errno);
+            exit(-1);
+        }
+
+        flush_to_client_backlog(b);
+
+        if (spi_verify_timeout(b) == 0)
+            verify_spi(b);
+
+        if (b->a2r_deferred && b->to_client_backlog.empty())
+        {
+            b->a2r_deferred = false;
+            if (b->have_base_address)
+                service_rings(b, 0);
+        }
+
+        if (n == 0)
+        {
+            if (watchdog_timeout(b) == 0)
+                handle_watchdog_timeout(b);
+        }
+        else if (ev.data.fd == b->gpio_fd)
+        {
+            logger_trace("Epoll event: gpio is ready, events = %d\n", ev.events);
+
+            if (b->virtual_name != nullptr)
+                b->virtual_board.drain_irq();
+            else
+            {
+                lseek(b->gpio_fd, 0, SEEK_SET);
+
+                char buf;
+                if (read(b->gpio_fd, &buf, 1) != 1)
+                {
+                    logger_error("Read from GPIO value file, and unexpectedly didn't return 1 byte\n");
+                    exit(-1);
+                }
+            }
+
+            if (first_gpio_event)
+            {
+                logger_debug("Received first GPIO event, which is ignored\n");
+                first_gpio_event = false;
+            }
+            else
+            {
+                logger_trace("GPIO interupted\n");
+                handle_a314_irq(b);
+            }
+        }
+        else if (ev.data.fd == b->spi_wake_fd)
+        {
+            drain_wake_fd(b->spi_wake_fd);
+            handle_client_thread_messages(b);
+        }
+        else if (ev.data.fd == b->latency.timer_fd)
+            handle_latency_probe(b);
+    }
+
+    return nullptr;
+}
+
 static void main_loop()
 {
-    handle_a314_irq();
+    // Memory is locked in realtime mode, so the SPI threads get stacks of a
+    // size that they need rather than the default 8 MB.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (realtime_priority != 0)
+        pthread_attr_setstacksize(&attr, 256 * 1024);
+
+    for (auto &b : boards)
+    {
+        if (pthread_create(&b.thread, &attr, spi_thread_main, &b) != 0)
+        {
+            logger_error("Unable to start the SPI thread of board %d\n", b.index);
+            exit(-1);
+        }
+    }
+
+    pthread_attr_destroy(&attr);
 
-    bool first_gpio_event = true;
     bool shutting_down = false;
+    uint64_t shutdown_deadline_ns = 0;
     bool done = false;
 
     while (!done)
     {
+        int timeout = -1;
+        if (shutting_down)
+        {
+            uint64_t now = monotonic_ns();
+            timeout = shutdown_deadline_ns > now ? (int)((shutdown_deadline_ns - now + 999999) / 1000000) : 0;
+        }
+        else
+        {
+            refill_warm_pools();
+            timeout = warm_pool_timeout();
+
+            int snapshot_timeout = run_snapshots();
+            if (snapshot_timeout != -1 && (timeout == -1 || snapshot_timeout < timeout))
+                timeout = snapshot_timeout;
+        }
+
         struct epoll_event ev;
-        int timeout = shutting_down ? 10000 : -1;
         int n = epoll_pwait(epfd, &ev, 1, timeout, &original_sigset);
         if (n == -1)
         {
@@ -1387,16 +5358,17 @@ static void main_loop()
 
                 shutdown_server_socket();
 
+                for (auto &cc : connections)
+                    cc.warm_for = nullptr;
+
                 while (!connections.empty())
                     close_and_remove_connection(&connections.front());
 
-                if (flush_send_queue())
-                    write_channel_status();
+                for (auto &b : boards)
+                    flush_send_queue(&b);
 
-                if (!channels.empty())
-                    shutting_down = true;
-                else
-                    done = true;
+                shutting_down = true;
+                shutdown_deadline_ns = monotonic_ns() + 10000000000ULL;
             }
             else
             {
@@ -1406,41 +5378,25 @@ static void main_loop()
         }
         else if (n == 0)
         {
-            if (shutting_down)
+            if (shutting_down && monotonic_ns() >= shutdown_deadline_ns)
                 done = true;
-            else
-            {
-                logger_error("epoll_pwait returned 0 which is unexpected since no timeout was set\n");
-                exit(-1);
-            }
         }
         else
         {
-            if (ev.data.fd == gpio_fd)
+            Board *woken = nullptr;
+            for (auto &b : boards)
             {
-                logger_trace("Epoll event: gpio is ready, events = %d\n", ev.events);
-
-                lseek(gpio_fd, 0, SEEK_SET);
-
-                char buf;
-                if (read(gpio_fd, &buf, 1) != 1)
+                if (ev.data.fd == b.client_wake_fd)
                 {
-                    logger_error("Read from GPIO value file, and unexpectedly didn't return 1 byte\n");
-                    exit(-1);
+                    woken = &b;
+                    break;
                 }
+            }
 
-                if (first_gpio_event)
-                {
-                    logger_debug("Received first GPIO event, which is ignored\n");
-                    first_gpio_event = false;
-                }
-                else
-                {
-                    logger_trace("GPIO interupted\n");
-                    handle_a314_irq();
-                    if (shutting_down && channels.empty())
-                        done = true;
-                }
+            if (woken != nullptr)
+            {
+                drain_wake_fd(woken->client_wake_fd);
+                handle_spi_thread_messages(woken);
             }
             else if (ev.data.fd == server_socket)
             {
@@ -1466,25 +5422,181 @@ static void main_loop()
 
                 ClientConnection *cc = &(*it);
                 handle_client_connection_event(cc, &ev);
+            }
+
+            // A client or a plugin may have sent packets to channels on any
+            // board.
+            for (auto &b : boards)
+                flush_send_queue(&b);
+        }
 
-                if (flush_send_queue())
-                    write_channel_status();
+        // Done once every packet has been written to R2A, on every board.
+        bool drained = true;
+        for (auto &b : boards)
+        {
+            b.open_channel_count.store(b.channels.size(), std::memory_order_relaxed);
+            if (!b.channels.empty())
+                drained = false;
+            for (int i = 0; i < QOS_CLASSES; i++)
+            {
+                if (b.r2a_credit[i] != b.r2a_credit_limit[i])
+                    drained = false;
             }
         }
+
+        if (shutting_down && drained)
+            done = true;
+    }
+
+    for (auto &b : boards)
+    {
+        ThreadMessage tm;
+        tm.kind = TM_STOP;
+        send_to_spi(&b, std::move(tm));
     }
+
+    for (auto &b : boards)
+        pthread_join(b.thread, nullptr);
+}
+
+#ifndef A314D_NO_MAIN
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] [config file]\n", program);
+    fprintf(stderr, "  -p, --profile FILE    record ring occupancy and SPI duty cycle to FILE\n");
+    fprintf(stderr, "  -P, --port PORT       listen for clients on PORT instead of 7110\n");
+    fprintf(stderr, "  -b, --board SPEC      serve the board DEVICE[:GPIO], or virtual:NAME; may be repeated\n");
+    fprintf(stderr, "                        (default %s:%s)\n", DEFAULT_SPI_DEVICE, DEFAULT_IRQ_GPIO);
+    fprintf(stderr, "  -v, --virtual NAME    same as --board virtual:NAME\n");
+    fprintf(stderr, "  -w, --watchdog MS     poll for lost IRQs after MS ms without one (default 100, 0 = off)\n");
+    fprintf(stderr, "  -c, --spi-cpu CPU,... pin the SPI thread of each board, in order, to a CPU\n");
+    fprintf(stderr, "  -W, --warm SERVICE[:N] keep up to N (default 1) instances of an on-demand service started for boards that have none; may be repeated\n");
+    fprintf(stderr, "  -R, --realtime PRIO   lock memory, run the SPI threads at SCHED_FIFO priority PRIO (1-99),\n");
+    fprintf(stderr, "                        and report their scheduling latency\n");
+    fprintf(stderr, "  -s, --spi-speed HZ    run SPI at HZ (default %u)\n", speed);
+    fprintf(stderr, "  -C, --spi-calibrate ADDRESS  find the fastest SPI clock that reads back test patterns\n");
+    fprintf(stderr, "                        written to %d bytes of SRAM at ADDRESS, which the Amiga must not use\n", CALIBRATE_LENGTH);
+    fprintf(stderr, "  -V, --spi-verify SECONDS  repeat the test that often, and slow down if it fails\n");
+    fprintf(stderr, "  -K, --spi-core-hz HZ  the core clock that the SPI clocks tried are divided from\n");
+    fprintf(stderr, "                        (default read from debugfs, or %u)\n", DEFAULT_SPI_CORE_HZ);
 }
 
 int main(int argc, char **argv)
 {
     std::string conf_filename("/etc/opt/a314/a314d.conf");
+    const char *spi_cpus = nullptr;
+    std::vector<std::string> warm_specs;
+
+    static const struct option long_options[] =
+    {
+        {"profile", required_argument, nullptr, 'p'},
+        {"port", required_argument, nullptr, 'P'},
+        {"board", required_argument, nullptr, 'b'},
+        {"virtual", required_argument, nullptr, 'v'},
+        {"watchdog", required_argument, nullptr, 'w'},
+        {"spi-cpu", required_argument, nullptr, 'c'},
+        {"warm", required_argument, nullptr, 'W'},
+        {"realtime", required_argument, nullptr, 'R'},
+        {"spi-speed", required_argument, nullptr, 's'},
+        {"spi-calibrate", required_argument, nullptr, 'C'},
+        {"spi-verify", required_argument, nullptr, 'V'},
+        {"spi-core-hz", required_argument, nullptr, 'K'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:P:b:v:w:c:W:R:s:C:V:K:h", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            profile_filename = optarg;
+            break;
+        case 'P':
+            server_port = atoi(optarg);
+            break;
+        case 'b':
+            add_board_from_spec(optarg);
+            break;
+        case 'v':
+            add_virtual_board(optarg);
+            break;
+        case 'w':
+            watchdog_deadline_ms = atoi(optarg);
+            break;
+        case 'c':
+            spi_cpus = optarg;
+            break;
+        case 'W':
+            warm_specs.push_back(optarg);
+            break;
+        case 'R':
+            realtime_priority = std::max(1, std::min(99, atoi(optarg)));
+            break;
+        case 's':
+            speed = strtoul(optarg, nullptr, 0);
+            break;
+        case 'C':
+            calibrate_spi_enabled = true;
+            calibrate_address = strtoul(optarg, nullptr, 0) & 0xfffff;
+            break;
+        case 'V':
+            spi_verify_s = atoi(optarg);
+            break;
+        case 'K':
+            spi_core_hz = strtoul(optarg, nullptr, 0);
+            break;
+        default:
+            print_usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
 
-    if (argc >= 2)
-        conf_filename = argv[1];
+    if (optind < argc)
+        conf_filename = argv[optind];
+
+    if (spi_verify_s != 0 && !calibrate_spi_enabled)
+    {
+        logger_warn("--spi-verify needs the scratch region given with --spi-calibrate\n");
+        spi_verify_s = 0;
+    }
 
     load_config_file(conf_filename.c_str());
+    enter_on_demand_services();
+
+    for (auto &spec : warm_specs)
+    {
+        size_t colon = spec.find(':');
+        std::string name = spec.substr(0, colon);
+        int n = colon == std::string::npos ? 1 : atoi(spec.c_str() + colon + 1);
+
+        auto it = std::find_if(on_demand_services.begin(), on_demand_services.end(),
+                [&](const OnDemandStart &od) { return od.service_name == name; });
+        if (it == on_demand_services.end())
+            logger_warn("--warm %s: there is no on-demand service %s in the configuration file\n", spec.c_str(), name.c_str());
+        else
+            it->warm_size = n;
+    }
+
+    if (boards.empty())
+        add_board();
+
+    for (auto &b : boards)
+    {
+        if (spi_cpus == nullptr)
+            break;
+
+        b.cpu = atoi(spi_cpus);
+
+        spi_cpus = strchr(spi_cpus, ',');
+        if (spi_cpus != nullptr)
+            spi_cpus++;
+    }
 
     if (init_driver() == 0)
         main_loop();
     shutdown_driver();
     return 0;
 }
+#endif
@@ -0,0 +1,682 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+// Microbenchmarks for the a314d core paths, run against the virtual A314
+// board and the simulated Amiga instead of SPI hardware.
+//
+// The a314d translation unit is included directly so that its internal
+// functions can be timed in isolation. Every result is printed as a single
+// JSON object per line on stdout.
+
+#define A314D_NO_MAIN
+#include "a314d.cc"
+
+#include <poll.h>
+#include <pthread.h>
+
+#include "../a314sim/sim_amiga.h"
+
+static double bench_duration = 1.0;
+static int bench_max_streams = 16;
+
+static std::string board_name(const char *what)
+{
+    return std::string("bench-") + what + "-" + std::to_string(getpid());
+}
+
+static void report(const char *benchmark, int payload, uint64_t ops, uint64_t bytes, uint64_t ns, const char *extra = "")
+{
+    double s = ns / 1e9;
+    printf("{\"benchmark\": \"%s\", \"payload\": %d, \"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mbytes_per_sec\": %.3f, \"ns_per_op\": %.1f%s}\n",
+            benchmark, payload, (unsigned long long)ops, s, ops / s, bytes / s / 1e6, ops ? (double)ns / ops : 0.0, extra);
+    fflush(stdout);
+}
+
+static void drain_fd(int fd)
+{
+    static uint8_t buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void set_nonblocking(int fd)
+{
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// The microbenchmarks play both of a314d's threads on the calling thread:
+// the SPI thread's side through handle_a314_irq(f.b) and
+// handle_client_thread_messages(f.b), and the client thread's side through
+// flush_send_queue(f.b) and the functions below.
+
+// Hands everything the SPI thread has queued to the client thread's handler,
+// without letting the client thread move more packets towards R2A.
+static void drain_to_client_queue(Board *b)
+{
+    ThreadMessage *tm;
+    while ((tm = b->to_client_queue.front()) != nullptr)
+    {
+        handle_spi_thread_message(b, *tm);
+        b->to_client_queue.pop();
+    }
+}
+
+static void drain_to_spi_queue(Board *b)
+{
+    while (b->to_spi_queue.front() != nullptr)
+        b->to_spi_queue.pop();
+}
+
+// State shared by the in-process microbenchmarks: a314d's Pi side opened on
+// a private virtual board, a simulated Amiga on the other side, and a fake
+// client connection whose peer end is drained by the benchmark.
+struct CoreFixture
+{
+    std::string name;
+    Board *b;
+    VirtualA314 amiga_board;
+    SimAmiga *amiga;
+    ClientConnection *cc;
+    int peer_fd;
+    std::vector<int> sockets;
+};
+
+static int setup_core(CoreFixture &f, int channel_count)
+{
+    f.name = board_name("core");
+    VirtualA314::unlink(f.name.c_str());
+
+    f.b = add_virtual_board(f.name.c_str());
+    if (init_spi(f.b) != 0 || init_thread_queues(f.b) != 0)
+        return -1;
+
+    if (f.amiga_board.open(f.name.c_str(), VIRTUAL_A314_AMIGA) != 0)
+        return -1;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        return -1;
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+
+    int size = 1024 * 1024;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+    connections.emplace_back();
+    ClientConnection &cc = connections.back();
+    cc.fd = fds[0];
+    cc.board = f.b;
+    cc.next_stream_id = 1;
+    cc.bytes_read = 0;
+    f.cc = &cc;
+    f.peer_fd = fds[1];
+
+    add_registration(get_service_name("bench", true), &cc, nullptr);
+
+    f.amiga = new SimAmiga(f.amiga_board);
+    f.amiga->start();
+    handle_a314_irq(f.b);
+    handle_spi_thread_messages(f.b);
+
+    for (int i = 0; i < channel_count; i++)
+        f.sockets.push_back(f.amiga->connect("bench"));
+    f.amiga->service();
+    handle_a314_irq(f.b);
+    handle_spi_thread_messages(f.b);
+    drain_fd(f.peer_fd);
+
+    uint8_t ok = CONNECT_OK;
+    for (auto ch : f.cc->associations)
+        create_and_enqueue_packet(ch, PKT_CONNECT_RESPONSE, &ok, 1);
+    flush_send_queue(f.b);
+    handle_client_thread_messages(f.b);
+    f.amiga->service();
+    handle_a314_irq(f.b);
+    handle_spi_thread_messages(f.b);
+
+    return f.b->channels.size() == (size_t)channel_count ? 0 : -1;
+}
+
+static void teardown_core(CoreFixture &f)
+{
+    close(f.peer_fd);
+    close_and_remove_connection(f.cc);
+    close_all_logical_channels(f.b);
+
+    drain_to_spi_queue(f.b);
+    drain_to_client_queue(f.b);
+    shutdown_thread_queues(f.b);
+
+    delete f.amiga;
+    f.amiga_board.close();
+    shutdown_spi(f.b);
+    VirtualA314::unlink(f.name.c_str());
+    boards.clear();
+}
+
+// A2R: the simulated Amiga fills the ring with DATA packets, and the time
+// spent in handle_a314_irq(f.b) to read and parse them, and in
+// handle_spi_thread_messages(f.b) to dispatch them to the client connection, is
+// measured.
+static void bench_a2r_parse(CoreFixture &f, int payload)
+{
+    std::vector<uint8_t> data(payload, 0x5a);
+
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t busy = 0;
+    uint64_t end = monotonic_ns() + (uint64_t)(bench_duration * 1e9);
+    size_t next = 0;
+
+    while (monotonic_ns() < end)
+    {
+        while (f.amiga->queued_packets() < 32)
+        {
+            f.amiga->write(f.sockets[next], &data[0], payload);
+            next = (next + 1) % f.sockets.size();
+        }
+
+        uint64_t sent = f.amiga->packets_sent;
+        f.amiga->service();
+        sent = f.amiga->packets_sent - sent;
+
+        uint64_t start = monotonic_ns();
+        handle_a314_irq(f.b);
+        handle_spi_thread_messages(f.b);
+        busy += monotonic_ns() - start;
+
+        packets += sent;
+        bytes += sent * payload;
+
+        f.b->virtual_board.drain_irq();
+        drain_fd(f.peer_fd);
+    }
+
+    report("a2r_parse_dispatch", payload, packets, bytes, busy);
+}
+
+static size_t queued_in_channels(Board *b)
+{
+    size_t n = 0;
+    for (auto &ch : b->channels)
+        n += ch.packet_queue.size();
+    return n;
+}
+
+// R2A: packets are queued on all channels, and the time spent handing them to
+// the SPI thread in flush_send_queue(f.b), and packing them into the ring in
+// handle_client_thread_messages(f.b), is measured.
+static void bench_r2a_pack(CoreFixture &f, int payload)
+{
+    std::vector<uint8_t> data(payload, 0xa5);
+
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t busy = 0;
+    uint64_t end = monotonic_ns() + (uint64_t)(bench_duration * 1e9);
+
+    while (monotonic_ns() < end)
+    {
+        for (auto ch : f.cc->associations)
+            while (ch->packet_queue.size() < 4)
+                create_and_enqueue_packet(ch, PKT_DATA, &data[0], payload);
+
+        size_t before = queued_in_channels(f.b);
+
+        uint64_t start = monotonic_ns();
+        flush_send_queue(f.b);
+        handle_client_thread_messages(f.b);
+        busy += monotonic_ns() - start;
+
+        size_t sent = before - queued_in_channels(f.b);
+        packets += sent;
+        bytes += sent * payload;
+
+        // Let the Amiga consume R2A, pick up the new head, and give the
+        // credit back.
+        f.amiga->service();
+        read_channel_status(f.b);
+        if (flush_r2a(f.b))
+            write_channel_status(f.b);
+        drain_to_client_queue(f.b);
+    }
+
+    for (auto ch : f.cc->associations)
+        clear_packet_queue(ch);
+    f.b->rings[0].r2a_pending.clear();
+    f.b->r2a_credit[0] = R2A_CREDIT;
+
+    report("r2a_pack", payload, packets, bytes, busy);
+}
+
+// Client framing: create_and_send_msg() of MSG_DATA to the client socket.
+static void bench_framing(CoreFixture &f, int payload)
+{
+    std::vector<uint8_t> data(payload, 0x33);
+    int stream_id = f.cc->associations.front()->stream_id;
+
+    uint64_t msgs = 0;
+    uint64_t busy = 0;
+    uint64_t end = monotonic_ns() + (uint64_t)(bench_duration * 1e9);
+
+    while (monotonic_ns() < end)
+    {
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < 64; i++)
+            create_and_send_msg(f.cc, MSG_DATA, stream_id, &data[0], payload);
+        busy += monotonic_ns() - start;
+        msgs += 64;
+
+        drain_fd(f.peer_fd);
+        f.cc->message_queue.clear();
+    }
+
+    report("client_framing", payload, msgs, msgs * payload, busy);
+}
+
+// Client deframing: MSG_DATA messages written by the client are read,
+// deframed and turned into packets by handle_client_connection_event().
+static void bench_deframing(CoreFixture &f, int payload)
+{
+    LogicalChannel *ch = f.cc->associations.front();
+
+    std::vector<uint8_t> batch;
+    int batch_msgs = std::max(1, 32768 / (int)(sizeof(MessageHeader) + payload));
+    for (int i = 0; i < batch_msgs; i++)
+    {
+        MessageHeader mh;
+        mh.length = payload;
+        mh.stream_id = ch->stream_id;
+        mh.type = MSG_DATA;
+        batch.insert(batch.end(), (uint8_t *)&mh, (uint8_t *)&mh + sizeof(mh));
+        batch.insert(batch.end(), payload, 0x77);
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+
+    uint64_t msgs = 0;
+    uint64_t busy = 0;
+    uint64_t end = monotonic_ns() + (uint64_t)(bench_duration * 1e9);
+
+    while (monotonic_ns() < end)
+    {
+        if (write(f.peer_fd, &batch[0], batch.size()) != (ssize_t)batch.size())
+            break;
+
+        uint64_t start = monotonic_ns();
+        handle_client_connection_event(f.cc, &ev);
+        busy += monotonic_ns() - start;
+        msgs += batch_msgs;
+
+        clear_packet_queue(ch);
+    }
+
+    report("client_deframing", payload, msgs, msgs * payload, busy);
+}
+
+// Compression of a MSG_READ_MEM_RES payload for a remote client, on screen
+// like bitplanes: mostly background, with some windows and text.
+static void bench_compress(int payload)
+{
+    std::vector<uint8_t> data(payload, 0);
+    uint32_t seed = 1;
+    for (int row = 0; row < payload / 80; row++)
+    {
+        if (row % 64 < 12)
+            memset(&data[row * 80], 0xff, 80);
+        else if (row % 64 < 40)
+            for (int col = 4; col < 76; col++)
+            {
+                seed = seed * 1103515245 + 12345;
+                data[row * 80 + col] = (seed >> 16) & 0x7e;
+            }
+    }
+
+    std::vector<uint8_t> out;
+    uint64_t ops = 0;
+    uint64_t busy = 0;
+    uint64_t end = monotonic_ns() + (uint64_t)(bench_duration * 1e9);
+
+    while (monotonic_ns() < end)
+    {
+        uint64_t start = monotonic_ns();
+        for (int i = 0; i < 16; i++)
+            compress_payload(&data[0], payload, out);
+        busy += monotonic_ns() - start;
+        ops += 16;
+    }
+
+    char extra[64];
+    snprintf(extra, sizeof(extra), ", \"compressed\": %zu", out.empty() ? (size_t)payload : out.size());
+    report("compress_payload", payload, ops, ops * payload, busy, extra);
+}
+
+// Resolving the name of a CONNECT with count services registered, for names
+// that are registered as they are and for names that only match a prefix.
+static void bench_service_lookup(CoreFixture &f, int count)
+{
+    char name[32];
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(name, sizeof(name), "service-%d", i);
+        add_registration(get_service_name(name, true), f.cc, nullptr);
+    }
+    add_registration(get_service_name("picmd-*", true), f.cc, nullptr);
+
+    for (bool prefix : {false, true})
+    {
+        std::vector<std::string> names;
+        for (int i = 0; i < 64; i++)
+            names.push_back((prefix ? "picmd-" : "service-") + std::to_string(i * 7919 % count));
+
+        uint64_t ops = 0;
+        uint64_t busy = 0;
+        uint64_t misses = 0;
+        uint64_t end = monotonic_ns() + (uint64_t)(bench_duration * 1e9);
+
+        while (monotonic_ns() < end)
+        {
+            uint64_t start = monotonic_ns();
+            for (auto &n : names)
+                if (resolve_service(f.b, (const uint8_t *)n.data(), n.size()) == nullptr)
+                    misses++;
+            busy += monotonic_ns() - start;
+            ops += names.size();
+        }
+
+        char extra[96];
+        snprintf(extra, sizeof(extra), ", \"services\": %d, \"prefix\": %s, \"misses\": %llu",
+                count, prefix ? "true" : "false", (unsigned long long)misses);
+        report("service_lookup", 0, ops, 0, busy, extra);
+    }
+
+    remove_all_registrations(f.cc);
+    add_registration(get_service_name("bench", true), f.cc, nullptr);
+}
+
+// End-to-end echo: main_loop() runs on its own thread against a virtual
+// board, a client thread registers an echo service over TCP, and the
+// simulated Amiga keeps one packet in flight per stream.
+
+static void *daemon_thread_main(void *)
+{
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &ss, nullptr);
+
+    if (init_driver() == 0)
+        main_loop();
+    shutdown_driver();
+    return nullptr;
+}
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (len)
+    {
+        ssize_t r = read(fd, p, len);
+        if (r <= 0)
+            return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (len)
+    {
+        ssize_t r = write(fd, p, len);
+        if (r <= 0)
+            return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool send_client_msg(int fd, int type, int stream_id, const uint8_t *data, int length)
+{
+    std::vector<uint8_t> m(sizeof(MessageHeader) + length);
+    MessageHeader *mh = (MessageHeader *)&m[0];
+    mh->length = length;
+    mh->stream_id = stream_id;
+    mh->type = type;
+    if (length)
+        memcpy(&m[sizeof(MessageHeader)], data, length);
+    return write_full(fd, &m[0], m.size());
+}
+
+static int connect_to_daemon()
+{
+    for (int retry = 0; retry < 100; retry++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(server_port);
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            int flag = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+            return fd;
+        }
+        close(fd);
+        sleep_10ms();
+    }
+    return -1;
+}
+
+static void *echo_thread_main(void *arg)
+{
+    int fd = *(int *)arg;
+
+    const char *name = "bench-echo";
+    send_client_msg(fd, MSG_REGISTER_REQ, 0, (const uint8_t *)name, strlen(name));
+
+    std::vector<uint8_t> payload;
+    while (1)
+    {
+        MessageHeader mh;
+        if (!read_full(fd, &mh, sizeof(mh)))
+            break;
+        payload.resize(mh.length);
+        if (mh.length && !read_full(fd, &payload[0], mh.length))
+            break;
+
+        uint8_t ok = CONNECT_OK;
+        if (mh.type == MSG_CONNECT)
+            send_client_msg(fd, MSG_CONNECT_RESPONSE, mh.stream_id, &ok, 1);
+        else if (mh.type == MSG_DATA)
+            send_client_msg(fd, MSG_DATA, mh.stream_id, payload.data(), mh.length);
+        else if (mh.type == MSG_EOS)
+            send_client_msg(fd, MSG_EOS, mh.stream_id, nullptr, 0);
+    }
+    return nullptr;
+}
+
+static void wait_for_irq(SimAmiga &amiga, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd = amiga.irq_fd();
+    pfd.events = POLLIN;
+    poll(&pfd, 1, timeout_ms);
+    amiga.service();
+}
+
+static void bench_echo(SimAmiga &amiga, int streams, int payload)
+{
+    std::vector<uint8_t> data(payload, 0xee);
+    std::map<int, uint64_t> sent_at;
+    std::vector<uint32_t> latencies;
+    int connected = 0;
+    uint64_t round_trips = 0;
+
+    amiga.on_connect_response = [&](int, int result) { if (result == 0) connected++; };
+    amiga.on_data = [&](int s, const uint8_t *, int)
+    {
+        uint64_t now = monotonic_ns();
+        latencies.push_back((uint32_t)std::min<uint64_t>((now - sent_at[s]) / 1000, UINT32_MAX));
+        round_trips++;
+        sent_at[s] = now;
+        amiga.write(s, &data[0], payload);
+    };
+    amiga.on_eos = nullptr;
+
+    std::vector<int> sockets;
+    for (int i = 0; i < streams; i++)
+        sockets.push_back(amiga.connect("bench-echo"));
+    amiga.service();
+
+    while (connected < streams)
+        wait_for_irq(amiga, 100);
+
+    uint64_t start = monotonic_ns();
+    for (int s : sockets)
+    {
+        sent_at[s] = start;
+        amiga.write(s, &data[0], payload);
+    }
+    amiga.service();
+
+    uint64_t end = start + (uint64_t)(bench_duration * 1e9);
+    while (monotonic_ns() < end)
+        wait_for_irq(amiga, 10);
+    uint64_t elapsed = monotonic_ns() - start;
+
+    amiga.on_data = nullptr;
+    for (int s : sockets)
+        amiga.eos(s);
+    amiga.service();
+    for (int i = 0; i < 100 && amiga.open_sockets() != 0; i++)
+        wait_for_irq(amiga, 10);
+
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&](int p) { return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * p / 100)]; };
+
+    char extra[160];
+    snprintf(extra, sizeof(extra), ", \"streams\": %d, \"latency_us_p50\": %u, \"latency_us_p99\": %u, \"latency_us_max\": %u",
+            streams, pct(50), pct(99), latencies.empty() ? 0 : latencies.back());
+    report("echo", payload, round_trips, round_trips * payload * 2, elapsed, extra);
+
+    amiga.on_connect_response = nullptr;
+}
+
+static int run_echo_benchmarks()
+{
+    std::string name = board_name("echo");
+    VirtualA314::unlink(name.c_str());
+    add_virtual_board(name.c_str());
+
+    VirtualA314 amiga_board;
+    if (amiga_board.open(name.c_str(), VIRTUAL_A314_AMIGA) != 0)
+        return -1;
+
+    pthread_t daemon_thread;
+    pthread_create(&daemon_thread, nullptr, daemon_thread_main, nullptr);
+
+    int echo_fd = connect_to_daemon();
+    if (echo_fd == -1)
+    {
+        logger_error("Unable to connect to a314d on port %d\n", server_port);
+        exit(-1);
+    }
+
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, nullptr, echo_thread_main, &echo_fd);
+
+    SimAmiga amiga(amiga_board);
+    amiga.start();
+
+    // Give the echo client time to register before the first CONNECT.
+    for (int i = 0; i < 10; i++)
+        sleep_10ms();
+
+    for (int payload : {16, 252})
+        for (int streams = 1; streams <= bench_max_streams; streams *= 2)
+            bench_echo(amiga, streams, payload);
+
+    pthread_kill(daemon_thread, SIGTERM);
+    pthread_join(daemon_thread, nullptr);
+
+    shutdown(echo_fd, SHUT_RDWR);
+    pthread_join(echo_thread, nullptr);
+    close(echo_fd);
+
+    amiga_board.close();
+    VirtualA314::unlink(name.c_str());
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"duration", required_argument, nullptr, 'd'},
+        {"streams", required_argument, nullptr, 'n'},
+        {"port", required_argument, nullptr, 'P'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    server_port = 7111;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:n:P:", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            bench_duration = atof(optarg);
+            break;
+        case 'n':
+            bench_max_streams = atoi(optarg);
+            break;
+        case 'P':
+            server_port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d seconds per benchmark] [-n max streams] [-P port]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGTERM is only meant for the thread that runs main_loop().
+    sigset_t ss;
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &ss, nullptr);
+
+    CoreFixture f;
+    if (setup_core(f, 8) != 0)
+    {
+        logger_error("Unable to set up the virtual A314\n");
+        return -1;
+    }
+
+    for (int payload : {16, 64, 252})
+        bench_a2r_parse(f, payload);
+    for (int payload : {16, 64, 252})
+        bench_r2a_pack(f, payload);
+    for (int payload : {16, 252, 4096})
+        bench_framing(f, payload);
+    for (int payload : {16, 64, 252})
+        bench_deframing(f, payload);
+    for (int payload : {10240, 40960})
+        bench_compress(payload);
+    for (int count : {16, 1024})
+        bench_service_lookup(f, count);
+
+    teardown_core(f);
+
+    return run_echo_benchmarks();
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#ifndef A314D_PLUGIN_H
+#define A314D_PLUGIN_H
+
+#include <stdint.h>
+
+// Services that run inside a314d, loaded from a shared object that is named
+// in a314d.conf:
+//
+//   myservice   /opt/a314/myservice.so   [arguments...]
+//
+// A plugin sees the same streams as a client on the socket protocol: it is
+// told about CONNECT, DATA, EOS and RESET on a stream, answers with the same
+// operations through A314PluginHost, and reads and writes Amiga memory, but
+// without socket framing or another process in between. The interface is
+// plain C so that plugins don't depend on the compiler a314d was built with.
+//
+// All callbacks are made on a314d's client thread, and the host functions
+// may only be called from within a callback. They must not block.
+
+#define A314_PLUGIN_ABI_VERSION     1
+
+// Values for the result of connect_response().
+#define A314_PLUGIN_CONNECT_OK              0
+#define A314_PLUGIN_CONNECT_UNKNOWN_SERVICE 3
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct A314PluginHost
+{
+    int abi_version;
+
+    // Passed back as the first argument of every host function.
+    void *context;
+
+    // Accept or refuse a stream that the plugin was told about in connect().
+    void (*connect_response)(void *context, int stream_id, uint8_t result);
+
+    // data is copied before the call returns. More than fits in a packet on
+    // the board, 252 bytes unless jumbo packets are in use, is sent as
+    // several packets.
+    void (*data)(void *context, int stream_id, const uint8_t *data, int length);
+
+    void (*eos)(void *context, int stream_id);
+    void (*reset)(void *context, int stream_id);
+
+    // Memory operations on the given board. They complete in the order they
+    // were issued, with read_mem_res() and write_mem_res().
+    void (*read_mem)(void *context, int board, uint32_t address, uint32_t length);
+    void (*write_mem)(void *context, int board, uint32_t address, const uint8_t *data, uint32_t length);
+};
+
+struct A314Plugin
+{
+    int abi_version;
+
+    // Called once when a314d starts, with the arguments from a314d.conf (the
+    // first one is the path of the plugin). Returns the state that is passed
+    // to the other callbacks, or null if the plugin can't run. host stays
+    // valid until shutdown().
+    void *(*init)(const struct A314PluginHost *host, int argc, const char *const *argv);
+    void (*shutdown)(void *state);
+
+    // The Amiga on board opened a stream to service_name, which is not zero
+    // terminated. Answer with connect_response(), now or later.
+    void (*connect)(void *state, int stream_id, int board, const char *service_name, int length);
+
+    // data points into a314d's buffers, and is only valid during the call.
+    void (*data)(void *state, int stream_id, const uint8_t *data, int length);
+
+    // After eos() has been both received and sent, and after reset(), the
+    // stream id is no longer in use.
+    void (*eos)(void *state, int stream_id);
+    void (*reset)(void *state, int stream_id);
+
+    void (*read_mem_res)(void *state, const uint8_t *data, uint32_t length);
+    void (*write_mem_res)(void *state);
+};
+
+// Every plugin exports this function.
+typedef const struct A314Plugin *(*A314PluginEntry)(void);
+#define A314_PLUGIN_ENTRY_NAME      "a314_plugin_entry"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#!/usr/bin/python3
+# -*- coding: utf-8 -*-
+
+# Reads a profile file written by a314d --profile, and prints a summary
+# report, or the time series as CSV with --csv.
+
+import struct
+import sys
+
+PROFILE_MAGIC = b'A314PRF1'
+SAMPLE_FORMAT = '=IIHHHHBB'
+SAMPLE_SIZE = struct.calcsize(SAMPLE_FORMAT)
+
+PROFILE_FLAG_A2R_FULL = 1
+PROFILE_FLAG_R2A_FULL = 2
+
+def read_samples(filename):
+    with open(filename, 'rb') as f:
+        if f.read(8) != PROFILE_MAGIC:
+            sys.stderr.write('%s is not an a314d profile file\n' % filename)
+            exit(-1)
+        data = f.read()
+    n = len(data) // SAMPLE_SIZE
+    return [struct.unpack_from(SAMPLE_FORMAT, data, i * SAMPLE_SIZE) for i in range(n)]
+
+def percentile(values, percent):
+    if not values:
+        return 0
+    s = sorted(values)
+    rank = max(0, (len(s) * percent + 99) // 100 - 1)
+    return s[rank]
+
+def print_csv(samples):
+    print('time_us,spi_busy_ns,a2r_used,r2a_used,bytes_in,bytes_out,events,a2r_full,r2a_full')
+    t = 0
+    for (delta_us, spi_ns, a2r, r2a, b_in, b_out, events, flags) in samples:
+        t += delta_us
+        print('%d,%d,%d,%d,%d,%d,%d,%d,%d' % (t, spi_ns, a2r, r2a, b_in, b_out, events,
+            1 if flags & PROFILE_FLAG_A2R_FULL else 0, 1 if flags & PROFILE_FLAG_R2A_FULL else 0))
+
+def print_summary(samples):
+    n = len(samples)
+    if n == 0:
+        print('No samples')
+        return
+
+    wall_us = sum(s[0] for s in samples)
+    spi_ns = sum(s[1] for s in samples)
+    a2r = [s[2] for s in samples]
+    r2a = [s[3] for s in samples]
+    bytes_in = sum(s[4] for s in samples)
+    bytes_out = sum(s[5] for s in samples)
+    a2r_full = sum(1 for s in samples if s[7] & PROFILE_FLAG_A2R_FULL)
+    r2a_full = sum(1 for s in samples if s[7] & PROFILE_FLAG_R2A_FULL)
+
+    print('Samples:        %d over %.3f s (%.1f IRQs/s)' % (n, wall_us / 1e6, n * 1e6 / wall_us if wall_us else 0))
+    print('SPI busy (IRQ): %.3f s, %.2f%% of wall time' % (spi_ns / 1e9, 100.0 * spi_ns / (wall_us * 1e3) if wall_us else 0))
+    print('A2R occupancy:  mean %.1f, p99 %d, full in %.2f%% of IRQs' % (float(sum(a2r)) / n, percentile(a2r, 99), 100.0 * a2r_full / n))
+    print('R2A occupancy:  mean %.1f, p99 %d, full in %.2f%% of IRQs' % (float(sum(r2a)) / n, percentile(r2a, 99), 100.0 * r2a_full / n))
+    print('Bytes in:       %d (%.1f per IRQ)' % (bytes_in, float(bytes_in) / n))
+    print('Bytes out:      %d (%.1f per IRQ)' % (bytes_out, float(bytes_out) / n))
+
+if __name__ == '__main__':
+    args = sys.argv[1:]
+    csv = '--csv' in args
+    args = [a for a in args if a != '--csv']
+    if len(args) != 1:
+        sys.stderr.write('Usage: %s [--csv] PROFILE\n' % sys.argv[0])
+        exit(-1)
+
+    samples = read_samples(args[0])
+    if csv:
+        print_csv(samples)
+    else:
+        print_summary(samples)
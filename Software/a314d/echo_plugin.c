@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+// Example a314d plugin: accepts every stream and sends back what the Amiga
+// sends on it, like the bench-echo client of a314d_bench but without leaving
+// a314d. Load it with a line in a314d.conf such as:
+//
+//   echo   /opt/a314/echo_plugin.so
+
+#include <stdlib.h>
+
+#include "a314d_plugin.h"
+
+struct EchoState
+{
+    const struct A314PluginHost *host;
+};
+
+static void *echo_init(const struct A314PluginHost *host, int argc, const char *const *argv)
+{
+    (void)argc;
+    (void)argv;
+
+    struct EchoState *es = (struct EchoState *)malloc(sizeof(struct EchoState));
+    if (es != NULL)
+        es->host = host;
+    return es;
+}
+
+static void echo_shutdown(void *state)
+{
+    free(state);
+}
+
+static void echo_connect(void *state, int stream_id, int board, const char *service_name, int length)
+{
+    (void)board;
+    (void)service_name;
+    (void)length;
+
+    struct EchoState *es = (struct EchoState *)state;
+    es->host->connect_response(es->host->context, stream_id, A314_PLUGIN_CONNECT_OK);
+}
+
+static void echo_data(void *state, int stream_id, const uint8_t *data, int length)
+{
+    struct EchoState *es = (struct EchoState *)state;
+    es->host->data(es->host->context, stream_id, data, length);
+}
+
+static void echo_eos(void *state, int stream_id)
+{
+    struct EchoState *es = (struct EchoState *)state;
+    es->host->eos(es->host->context, stream_id);
+}
+
+static const struct A314Plugin echo_plugin =
+{
+    .abi_version = A314_PLUGIN_ABI_VERSION,
+    .init = echo_init,
+    .shutdown = echo_shutdown,
+    .connect = echo_connect,
+    .data = echo_data,
+    .eos = echo_eos,
+};
+
+const struct A314Plugin *a314_plugin_entry(void)
+{
+    return &echo_plugin;
+}
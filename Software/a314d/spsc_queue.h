@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+
+// Bounded lock-free queue for exactly one producer thread and one consumer
+// thread. N must be a power of two.
+//
+// push() reports whether the consumer may have found the queue empty, in
+// which case the producer has to wake it up. The consumer always pops until
+// it finds the queue empty before it goes to sleep. The fences in push() and
+// pop() make sure that either the consumer sees the new item, or the
+// producer sees that the consumer has caught up with it.
+template <typename T, size_t N>
+class SpscQueue
+{
+public:
+    SpscQueue() : head_(0), tail_(0)
+    {
+        static_assert((N & (N - 1)) == 0, "N must be a power of two");
+    }
+
+    // Producer side. Returns false, and leaves item alone, if the queue is
+    // full.
+    bool push(T &&item, bool *was_empty = nullptr)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t head = head_.load(std::memory_order_acquire);
+        if (tail - head == N)
+            return false;
+
+        items_[tail & (N - 1)] = std::move(item);
+        tail_.store(tail + 1, std::memory_order_release);
+
+        if (was_empty != nullptr)
+        {
+            // head may have moved on since it was loaded above.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            *was_empty = head_.load(std::memory_order_relaxed) == tail;
+        }
+        return true;
+    }
+
+    size_t free_slots() const
+    {
+        return N - (tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_acquire));
+    }
+
+    // Consumer side. front() returns nullptr if the queue is empty.
+    T *front()
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire))
+            return nullptr;
+        return &items_[head & (N - 1)];
+    }
+
+    void pop()
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        items_[head & (N - 1)] = T();
+        head_.store(head + 1, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+private:
+    T items_[N];
+
+    // Each index is written by one side only; keep them on separate cache
+    // lines so that the two threads don't bounce a line between them.
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+};
+
+#endif
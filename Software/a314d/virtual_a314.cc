@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "virtual_a314.h"
+
+#define VIRTUAL_A314_MAGIC      0x41333134
+
+// SPI commands, as decoded by HDL/spi_controller.v.
+#define READ_SRAM_CMD           0
+#define WRITE_SRAM_CMD          1
+#define READ_CMEM_CMD           2
+#define WRITE_CMEM_CMD          3
+
+#define READ_SRAM_HDR_LEN       4
+#define WRITE_SRAM_HDR_LEN      3
+
+#define R_EVENTS_ADDRESS        12
+#define R_ENABLE_ADDRESS        13
+#define A_EVENTS_ADDRESS        14
+#define A_ENABLE_ADDRESS        15
+
+struct VirtualA314State
+{
+    uint32_t magic;
+    uint32_t spinlock;
+
+    uint8_t data[12];
+    uint8_t r_events;
+    uint8_t r_enable;
+    uint8_t a_events;
+    uint8_t a_enable;
+    uint8_t r_armed;
+
+    uint8_t sram[VIRTUAL_A314_SRAM_SIZE];
+};
+
+static void doorbell_address(struct sockaddr_un *addr, socklen_t *len, const char *name, VirtualA314Side side)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    // Abstract socket namespace; the first byte of sun_path is zero.
+    int n = snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, "a314-%s-%s", name, side == VIRTUAL_A314_PI ? "pi" : "amiga");
+    *len = offsetof(struct sockaddr_un, sun_path) + 1 + n;
+}
+
+VirtualA314::VirtualA314() : state_(nullptr), side_(VIRTUAL_A314_PI), irq_fd_(-1), pending_irq_(0), spi_speed_hz_(0), spi_max_hz_(0)
+{
+    name_[0] = 0;
+}
+
+VirtualA314::~VirtualA314()
+{
+    close();
+}
+
+int VirtualA314::open(const char *name, VirtualA314Side side)
+{
+    side_ = side;
+    snprintf(name_, sizeof(name_), "%s", name);
+
+    const char *max_hz = getenv("A314_VIRTUAL_SPI_MAX_HZ");
+    spi_max_hz_ = max_hz != nullptr ? strtoul(max_hz, nullptr, 0) : 0;
+
+    char path[128];
+    snprintf(path, sizeof(path), "/dev/shm/a314-%s", name);
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return -1;
+
+    if (ftruncate(fd, sizeof(VirtualA314State)) != 0)
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    void *p = mmap(nullptr, sizeof(VirtualA314State), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return -1;
+
+    state_ = (VirtualA314State *)p;
+
+    // The first side to map a fresh file brings CMEM to its power-on state.
+    uint32_t expected = 0;
+    if (__atomic_compare_exchange_n(&state_->magic, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        state_->r_enable = 7;
+        state_->a_enable = 3;
+        state_->r_armed = 1;
+        __atomic_store_n(&state_->magic, VIRTUAL_A314_MAGIC, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        while (__atomic_load_n(&state_->magic, __ATOMIC_ACQUIRE) != VIRTUAL_A314_MAGIC)
+            ;
+    }
+
+    irq_fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (irq_fd_ == -1)
+    {
+        close();
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    socklen_t alen;
+    doorbell_address(&addr, &alen, name_, side_);
+    if (bind(irq_fd_, (struct sockaddr *)&addr, alen) != 0)
+    {
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void VirtualA314::close()
+{
+    if (irq_fd_ != -1)
+        ::close(irq_fd_);
+    irq_fd_ = -1;
+
+    if (state_ != nullptr)
+        munmap(state_, sizeof(VirtualA314State));
+    state_ = nullptr;
+}
+
+void VirtualA314::unlink(const char *name)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/dev/shm/a314-%s", name);
+    ::unlink(path);
+}
+
+void VirtualA314::drain_irq()
+{
+    char buf[16];
+    while (recv(irq_fd_, buf, sizeof(buf), 0) > 0)
+        ;
+}
+
+void VirtualA314::lock()
+{
+    while (__atomic_exchange_n(&state_->spinlock, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+// Doorbells are rung after the lock is released, so that the woken side
+// doesn't have to spin on it.
+void VirtualA314::unlock()
+{
+    __atomic_store_n(&state_->spinlock, 0, __ATOMIC_RELEASE);
+
+    if (pending_irq_ & (1 << VIRTUAL_A314_PI))
+        raise_irq(VIRTUAL_A314_PI);
+    if (pending_irq_ & (1 << VIRTUAL_A314_AMIGA))
+        raise_irq(VIRTUAL_A314_AMIGA);
+    pending_irq_ = 0;
+}
+
+void VirtualA314::raise_irq(VirtualA314Side to)
+{
+    struct sockaddr_un addr;
+    socklen_t alen;
+    doorbell_address(&addr, &alen, name_, to);
+
+    // If the other side isn't listening, or its queue is full, then the
+    // event is still latched in CMEM and is picked up on its next poll.
+    char c = 1;
+    sendto(irq_fd_, &c, 1, MSG_DONTWAIT, (struct sockaddr *)&addr, alen);
+}
+
+// Called with the lock held.
+void VirtualA314::check_r_trigger()
+{
+    if (state_->r_armed && (state_->r_events & state_->r_enable) != 0)
+    {
+        state_->r_armed = 0;
+        pending_irq_ |= 1 << VIRTUAL_A314_PI;
+    }
+}
+
+// Called with the lock held.
+void VirtualA314::check_a_trigger()
+{
+    if ((state_->a_events & state_->a_enable) != 0)
+        pending_irq_ |= 1 << VIRTUAL_A314_AMIGA;
+}
+
+// Moves the data in transfer t, which starts pos bytes into an SRAM command,
+// between the transfer's buffers and SRAM.
+void VirtualA314::sram_transfer(int cmd, unsigned int address, unsigned int pos, const VirtualSpiTransfer &t)
+{
+    unsigned int hdr_len = cmd == READ_SRAM_CMD ? READ_SRAM_HDR_LEN : WRITE_SRAM_HDR_LEN;
+    unsigned int offset = pos < hdr_len ? hdr_len - pos : 0;
+    if (offset >= t.len)
+        return;
+
+    address += pos + offset - hdr_len;
+    unsigned int n = t.len - offset;
+    for (unsigned int i = 0; i < n; )
+    {
+        unsigned int a = (address + i) & (VIRTUAL_A314_SRAM_SIZE - 1);
+        unsigned int chunk = std::min(n - i, VIRTUAL_A314_SRAM_SIZE - a);
+        if (cmd == READ_SRAM_CMD && t.rx != nullptr)
+            memcpy(&t.rx[offset + i], &state_->sram[a], chunk);
+        else if (cmd == WRITE_SRAM_CMD && t.tx != nullptr)
+            memcpy(&state_->sram[a], &t.tx[offset + i], chunk);
+        i += chunk;
+    }
+
+    if (cmd == READ_SRAM_CMD && t.rx != nullptr && spi_max_hz_ != 0 && spi_speed_hz_ > spi_max_hz_)
+        t.rx[t.len - 1] ^= 1;
+}
+
+void VirtualA314::spi_message(const VirtualSpiTransfer *transfers, int count)
+{
+    int i = 0;
+    while (i < count)
+    {
+        const uint8_t *tx = transfers[i].tx;
+        int cmd = tx[0] >> 4;
+
+        // CMEM commands are always a single transfer.
+        if (cmd != READ_SRAM_CMD && cmd != WRITE_SRAM_CMD)
+        {
+            spi_transfer(tx, transfers[i].rx, transfers[i].len);
+            i++;
+            continue;
+        }
+
+        unsigned int address = ((tx[0] << 16) | (tx[1] << 8) | tx[2]) & 0xfffff;
+
+        // SRAM is accessed by both sides without taking the lock, like the
+        // real board; the fence orders it against the CMEM event handshake.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        unsigned int pos = 0;
+        while (i < count)
+        {
+            const VirtualSpiTransfer &t = transfers[i++];
+            sram_transfer(cmd, address, pos, t);
+            pos += t.len;
+            if (t.cs_change)
+                break;
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+void VirtualA314::spi_transfer(const uint8_t *tx, uint8_t *rx, unsigned int len)
+{
+    if (len == 0)
+        return;
+
+    int cmd = tx[0] >> 4;
+
+    if (cmd == READ_SRAM_CMD || cmd == WRITE_SRAM_CMD)
+    {
+        VirtualSpiTransfer t = {tx, rx, len, false};
+        spi_message(&t, 1);
+        return;
+    }
+
+    int address = tx[0] & 0xf;
+
+    lock();
+
+    if (cmd == READ_CMEM_CMD && len >= 2)
+    {
+        uint8_t value;
+        if (address == R_EVENTS_ADDRESS)
+        {
+            value = state_->r_events;
+            state_->r_events = 0;
+            state_->r_armed = 1;
+        }
+        else if (address == R_ENABLE_ADDRESS)
+            value = state_->r_enable;
+        else if (address == A_EVENTS_ADDRESS || address == A_ENABLE_ADDRESS)
+            value = 0;
+        else
+            value = state_->data[address];
+        rx[1] = value;
+    }
+    else if (cmd == WRITE_CMEM_CMD && len >= 2)
+    {
+        uint8_t value = tx[1] & 0xf;
+        if (address == R_ENABLE_ADDRESS)
+        {
+            state_->r_enable = value;
+            check_r_trigger();
+        }
+        else if (address == A_EVENTS_ADDRESS)
+        {
+            state_->a_events |= value;
+            check_a_trigger();
+        }
+    }
+
+    unlock();
+}
+
+uint8_t VirtualA314::read_cp_nibble(int index)
+{
+    uint8_t value;
+
+    lock();
+
+    if (index == R_EVENTS_ADDRESS || index == R_ENABLE_ADDRESS)
+        value = 0;
+    else if (index == A_EVENTS_ADDRESS)
+    {
+        value = state_->a_events;
+        state_->a_events = 0;
+    }
+    else if (index == A_ENABLE_ADDRESS)
+        value = state_->a_enable;
+    else
+        value = state_->data[index];
+
+    unlock();
+    return value;
+}
+
+void VirtualA314::write_cp_nibble(int index, uint8_t value)
+{
+    value &= 0xf;
+
+    lock();
+
+    if (index < 12)
+        state_->data[index] = value;
+    else if (index == R_EVENTS_ADDRESS)
+    {
+        state_->r_events |= value;
+        check_r_trigger();
+    }
+    else if (index == A_ENABLE_ADDRESS)
+    {
+        state_->a_enable = value;
+        check_a_trigger();
+    }
+
+    unlock();
+}
+
+uint8_t *VirtualA314::sram()
+{
+    return state_->sram;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#ifndef VIRTUAL_A314_H
+#define VIRTUAL_A314_H
+
+#include <stdint.h>
+
+// Software model of the A314 board, used in place of spidev and the IRQ GPIO
+// when a314d is started with --virtual NAME.
+//
+// The SRAM and CMEM of the board live in a shared memory file,
+// /dev/shm/a314-NAME, so that a simulated Amiga in another process (or
+// thread) can play the other side of the board. The two interrupt lines are
+// modelled as datagram doorbells on abstract unix sockets; a side's irq_fd()
+// becomes readable when its interrupt line is raised.
+//
+// CMEM behaves as in HDL/cmem.v: reading R_EVENTS over SPI clears it and
+// re-arms the Raspberry IRQ, and the Amiga interrupt is asserted as long as
+// A_EVENTS & A_ENABLE is non-zero.
+
+#define VIRTUAL_A314_SRAM_SIZE  (1024 * 1024)
+
+enum VirtualA314Side
+{
+    VIRTUAL_A314_PI,
+    VIRTUAL_A314_AMIGA,
+};
+
+struct VirtualA314State;
+
+// A transfer of an SPI message, like struct spi_ioc_transfer. tx may be null
+// where nothing but the command is sent, and rx where what is received is
+// not wanted. cs_change deselects the board after the transfer, so that the
+// next one starts a new command.
+struct VirtualSpiTransfer
+{
+    const uint8_t *tx;
+    uint8_t *rx;
+    unsigned int len;
+    bool cs_change;
+};
+
+class VirtualA314
+{
+public:
+    VirtualA314();
+    ~VirtualA314();
+
+    int open(const char *name, VirtualA314Side side);
+    void close();
+
+    // Removes the shared memory file, so that the next open starts from
+    // a powered-on board.
+    static void unlink(const char *name);
+
+    bool is_open() const { return state_ != nullptr; }
+
+    // Readable when the interrupt line towards this side has been raised.
+    int irq_fd() const { return irq_fd_; }
+    void drain_irq();
+
+    // Raspberry side: full-duplex SPI transfer, using the same command
+    // encoding as the FPGA's SPI controller.
+    void spi_transfer(const uint8_t *tx, uint8_t *rx, unsigned int len);
+
+    // Several transfers, in one or more commands, in the way of
+    // SPI_IOC_MESSAGE. An SRAM command may go on over several transfers, so
+    // that what it reads lands where each transfer says.
+    void spi_message(const VirtualSpiTransfer *transfers, int count);
+
+    // The SPI clock that a314d runs the board at. If A314_VIRTUAL_SPI_MAX_HZ
+    // is set in the environment, SRAM reads at a faster clock come back with
+    // a bit flipped, like a board or cable that doesn't keep up, so that SPI
+    // calibration can be tried without one.
+    void set_spi_speed(uint32_t hz) { spi_speed_hz_ = hz; }
+
+    // Amiga side: clock port access to CMEM, and direct access to SRAM.
+    uint8_t read_cp_nibble(int index);
+    void write_cp_nibble(int index, uint8_t value);
+    uint8_t *sram();
+
+private:
+    void lock();
+    void unlock();
+    void raise_irq(VirtualA314Side to);
+    void check_r_trigger();
+    void check_a_trigger();
+    void sram_transfer(int cmd, unsigned int address, unsigned int pos, const VirtualSpiTransfer &t);
+
+    VirtualA314State *state_;
+    VirtualA314Side side_;
+    int irq_fd_;
+    int pending_irq_;
+    uint32_t spi_speed_hz_;
+    uint32_t spi_max_hz_;
+    char name_[64];
+};
+
+#endif
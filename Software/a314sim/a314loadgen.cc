@@ -0,0 +1,863 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+// Load generator for a314d. It plays the Amiga side of the protocol through
+// a virtual A314 board (see a314d/virtual_a314.h), and the Pi side services
+// through ordinary client connections to a314d, so that a314d can be driven
+// with hundreds of logical channels without any hardware.
+//
+// Three traffic classes are modelled on the existing services:
+//   fs     a314fs-like request/response; every request makes the service
+//          move a 4096 byte block with READ_MEM/WRITE_MEM before replying.
+//   audio  piaudio-like periodic traffic; every period the Amiga reports a
+//          free buffer and the service fills it with a 1800 byte WRITE_MEM.
+//   bulk   remotewb-like bulk reads; every request makes the service read
+//          a 61440 byte frame with READ_MEM.
+//   push   streams that a Pi side client opens to a service on the Amiga,
+//          and pushes an event on every period, without being asked.
+// On top of that, streams can be churned with EOS, and RESET storms can be
+// injected that reset every open stream at once.
+
+#include <arpa/inet.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sim_amiga.h"
+
+#define MSG_REGISTER_REQ        1
+#define MSG_REGISTER_RES        2
+#define MSG_READ_MEM_REQ        5
+#define MSG_READ_MEM_RES        6
+#define MSG_WRITE_MEM_REQ       7
+#define MSG_WRITE_MEM_RES       8
+#define MSG_CONNECT             9
+#define MSG_CONNECT_RESPONSE    10
+#define MSG_DATA                11
+#define MSG_EOS                 12
+#define MSG_RESET               13
+
+#define CLASS_FS                0
+#define CLASS_AUDIO             1
+#define CLASS_BULK              2
+#define CLASS_PUSH              3
+#define CLASS_COUNT             4
+
+static const char *class_names[CLASS_COUNT] = {"fs", "audio", "bulk", "push"};
+
+// Size of the memory operation done by the service for each request.
+static const int class_mem_bytes[CLASS_COUNT] = {4096, 1800, 3 * 256 * 80, 0};
+
+// Memory in the virtual A314 that the services read and write.
+static const unsigned int class_mem_base[CLASS_COUNT] = {0x10000, 0x20000, 0x30000, 0};
+
+#pragma pack(push, 1)
+struct MessageHeader
+{
+    uint32_t length;
+    uint32_t stream_id;
+    uint8_t type;
+};
+#pragma pack(pop)
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A Pi side service, connected to a314d over TCP. All I/O is non-blocking;
+// outgoing messages are buffered until the socket is writable.
+struct ServiceClient
+{
+    int cls;
+    int fd;
+
+    std::vector<uint8_t> out;
+    size_t out_pos;
+
+    std::vector<uint8_t> in;
+
+    // Streams waiting for their memory operation to complete, in the order
+    // the requests were sent; a314d answers memory requests in order.
+    std::deque<uint32_t> pending_mem;
+
+    uint64_t mem_bytes;
+};
+
+struct Stream
+{
+    int cls;
+    bool connected;
+    bool busy;
+    uint64_t sent_at;
+    uint64_t next_due;
+};
+
+// A push stream, as seen by the Pi side client that opened it. Its stream
+// id is the client's own, which is even.
+struct PushStream
+{
+    bool connected;
+    uint64_t next_due;
+};
+
+struct ClassStats
+{
+    uint64_t requests;
+    uint64_t late;
+    std::vector<uint32_t> latencies_us;
+};
+
+static const char *board = "loadgen";
+static int server_port = 7110;
+static const char *spawn_path = nullptr;
+static pid_t daemon_pid = 0;
+static double duration = 10.0;
+static int class_streams[CLASS_COUNT] = {16, 4, 2, 0};
+static double audio_period_ms = 20.0;
+static double churn_rate = 0.0;
+static double storm_interval = 0.0;
+static bool json_output = false;
+
+static VirtualA314 amiga_board;
+static SimAmiga *amiga;
+static ServiceClient clients[CLASS_COUNT];
+
+static std::map<int, Stream> streams;
+static std::map<uint32_t, PushStream> push_streams;
+static uint32_t next_push_stream_id = 2;
+
+// a314d refuses push streams until it has read the Amiga's PKT_SETTINGS
+// LISTEN, which races with the first MSG_CONNECTs. Refusals until a push
+// stream has been accepted are retried, and not counted.
+static bool push_accepted = false;
+
+// Classes of streams that couldn't be opened yet, because all stream ids
+// were taken by streams that are still being closed.
+static std::deque<int> reopen_queue;
+
+static ClassStats stats[CLASS_COUNT];
+
+static uint64_t connects = 0;
+static uint64_t connect_failures = 0;
+static uint64_t resets_sent = 0;
+static uint64_t resets_received = 0;
+static uint64_t eos_sent = 0;
+static uint64_t storms = 0;
+
+static long rss_kb = 0;
+static long rss_peak_kb = 0;
+
+static void read_daemon_memory()
+{
+    if (daemon_pid == 0)
+        return;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)daemon_pid);
+    FILE *f = fopen(path, "rt");
+    if (f == nullptr)
+        return;
+
+    char line[256];
+    while (fgets(line, sizeof(line), f) != nullptr)
+    {
+        long v;
+        if (sscanf(line, "VmRSS: %ld", &v) == 1)
+            rss_kb = v;
+        else if (sscanf(line, "VmHWM: %ld", &v) == 1)
+            rss_peak_kb = std::max(rss_peak_kb, v);
+    }
+    fclose(f);
+}
+
+static void queue_msg(ServiceClient &c, int type, uint32_t stream_id, const void *data, int length, const void *data2 = nullptr, int length2 = 0)
+{
+    MessageHeader mh;
+    mh.length = length + length2;
+    mh.stream_id = stream_id;
+    mh.type = type;
+    c.out.insert(c.out.end(), (uint8_t *)&mh, (uint8_t *)&mh + sizeof(mh));
+    if (length)
+        c.out.insert(c.out.end(), (const uint8_t *)data, (const uint8_t *)data + length);
+    if (length2)
+        c.out.insert(c.out.end(), (const uint8_t *)data2, (const uint8_t *)data2 + length2);
+}
+
+static void flush_client(ServiceClient &c)
+{
+    while (c.out_pos < c.out.size())
+    {
+        ssize_t r = write(c.fd, &c.out[c.out_pos], c.out.size() - c.out_pos);
+        if (r <= 0)
+        {
+            if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            fprintf(stderr, "Connection to a314d lost\n");
+            exit(-1);
+        }
+        c.out_pos += r;
+    }
+
+    if (c.out_pos == c.out.size())
+    {
+        c.out.clear();
+        c.out_pos = 0;
+    }
+}
+
+static void open_push_stream()
+{
+    uint32_t stream_id;
+    do
+    {
+        stream_id = next_push_stream_id;
+        next_push_stream_id = next_push_stream_id == 254 ? 2 : next_push_stream_id + 2;
+    } while (push_streams.find(stream_id) != push_streams.end());
+
+    PushStream &ps = push_streams[stream_id];
+    ps.connected = false;
+    ps.next_due = 0;
+    connects++;
+
+    std::string name = std::string("loadgen-") + class_names[CLASS_PUSH];
+    queue_msg(clients[CLASS_PUSH], MSG_CONNECT, stream_id, name.c_str(), name.size());
+}
+
+static void handle_push_msg(const MessageHeader &mh, const uint8_t *payload)
+{
+    auto it = push_streams.find(mh.stream_id);
+    if (it == push_streams.end())
+        return;
+
+    if (mh.type == MSG_CONNECT_RESPONSE && mh.length == 1 && payload[0] == 0)
+    {
+        it->second.connected = true;
+        it->second.next_due = monotonic_ns();
+        push_accepted = true;
+    }
+    else if (mh.type == MSG_CONNECT_RESPONSE && !push_accepted)
+    {
+        connects--;
+        push_streams.erase(it);
+        open_push_stream();
+    }
+    else if (mh.type == MSG_CONNECT_RESPONSE || mh.type == MSG_RESET)
+    {
+        if (mh.type == MSG_CONNECT_RESPONSE)
+            connect_failures++;
+        else
+            resets_received++;
+        push_streams.erase(it);
+        open_push_stream();
+    }
+}
+
+static void handle_service_msg(ServiceClient &c, const MessageHeader &mh, const uint8_t *payload)
+{
+    if (c.cls == CLASS_PUSH)
+        handle_push_msg(mh, payload);
+    else if (mh.type == MSG_CONNECT)
+    {
+        uint8_t ok = 0;
+        queue_msg(c, MSG_CONNECT_RESPONSE, mh.stream_id, &ok, 1);
+    }
+    else if (mh.type == MSG_DATA)
+    {
+        uint32_t address = class_mem_base[c.cls];
+        uint32_t length = class_mem_bytes[c.cls];
+
+        bool read = c.cls == CLASS_BULK || (c.cls == CLASS_FS && mh.length != 0 && payload[0] == 1);
+        if (read)
+        {
+            uint32_t req[2] = {address, length};
+            queue_msg(c, MSG_READ_MEM_REQ, 0, req, sizeof(req));
+        }
+        else
+        {
+            static std::vector<uint8_t> block(65536, 0x55);
+            queue_msg(c, MSG_WRITE_MEM_REQ, 0, &address, 4, &block[0], length);
+        }
+        c.pending_mem.push_back(mh.stream_id);
+    }
+    else if (mh.type == MSG_READ_MEM_RES || mh.type == MSG_WRITE_MEM_RES)
+    {
+        if (c.pending_mem.empty())
+            return;
+
+        uint32_t stream_id = c.pending_mem.front();
+        c.pending_mem.pop_front();
+        c.mem_bytes += class_mem_bytes[c.cls];
+
+        // The stream may have been reset while the memory operation was
+        // in flight; a314d then drops the reply.
+        uint8_t reply[16] = {0};
+        queue_msg(c, MSG_DATA, stream_id, reply, c.cls == CLASS_FS ? 16 : 1);
+    }
+    else if (mh.type == MSG_EOS)
+        queue_msg(c, MSG_EOS, mh.stream_id, nullptr, 0);
+}
+
+static void read_client(ServiceClient &c)
+{
+    uint8_t buf[65536];
+    while (1)
+    {
+        ssize_t r = read(c.fd, buf, sizeof(buf));
+        if (r == 0)
+        {
+            fprintf(stderr, "a314d closed the connection\n");
+            exit(-1);
+        }
+        if (r < 0)
+            break;
+        c.in.insert(c.in.end(), buf, buf + r);
+    }
+
+    size_t pos = 0;
+    while (c.in.size() - pos >= sizeof(MessageHeader))
+    {
+        MessageHeader mh;
+        memcpy(&mh, &c.in[pos], sizeof(mh));
+        if (c.in.size() - pos - sizeof(mh) < mh.length)
+            break;
+        handle_service_msg(c, mh, &c.in[pos + sizeof(mh)]);
+        pos += sizeof(mh) + mh.length;
+    }
+    c.in.erase(c.in.begin(), c.in.begin() + pos);
+}
+
+static int connect_client(ServiceClient &c, int cls)
+{
+    c.cls = cls;
+    c.out_pos = 0;
+    c.mem_bytes = 0;
+
+    for (int retry = 0; retry < 200; retry++)
+    {
+        c.fd = socket(AF_INET, SOCK_STREAM, 0);
+
+        struct sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(server_port);
+
+        if (connect(c.fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+        {
+            int flag = 1;
+            setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+
+            // The push client opens streams rather than serving them.
+            if (cls == CLASS_PUSH)
+            {
+                fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+                return 0;
+            }
+
+            std::string name = std::string("loadgen-") + class_names[cls];
+            MessageHeader mh = {(uint32_t)name.size(), 0, MSG_REGISTER_REQ};
+            write(c.fd, &mh, sizeof(mh));
+            write(c.fd, name.c_str(), name.size());
+
+            uint8_t res[sizeof(MessageHeader) + 1];
+            if (recv(c.fd, res, sizeof(res), MSG_WAITALL) != sizeof(res) || res[sizeof(MessageHeader)] != 1)
+            {
+                fprintf(stderr, "Unable to register service %s\n", name.c_str());
+                return -1;
+            }
+
+            fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL, 0) | O_NONBLOCK);
+            return 0;
+        }
+
+        close(c.fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+static void open_stream(int cls)
+{
+    std::string name = std::string("loadgen-") + class_names[cls];
+    int s = amiga->connect(name.c_str());
+    if (s == -1)
+    {
+        reopen_queue.push_back(cls);
+        return;
+    }
+
+    Stream &st = streams[s];
+    st.cls = cls;
+    st.connected = false;
+    st.busy = false;
+    st.sent_at = 0;
+    st.next_due = 0;
+    connects++;
+}
+
+static void send_request(int s, Stream &st, uint64_t now)
+{
+    uint8_t req[24] = {0};
+    int len = 1;
+    if (st.cls == CLASS_FS)
+    {
+        // Alternate between reads and writes, as a314fs does.
+        req[0] = stats[CLASS_FS].requests & 1;
+        len = sizeof(req);
+    }
+
+    if (amiga->write(s, req, len))
+    {
+        st.busy = true;
+        st.sent_at = now;
+    }
+}
+
+static void on_connect_response(int s, int result)
+{
+    auto it = streams.find(s);
+    if (it == streams.end())
+        return;
+
+    if (result != 0)
+    {
+        int cls = it->second.cls;
+        streams.erase(it);
+        connect_failures++;
+        open_stream(cls);
+        return;
+    }
+
+    it->second.connected = true;
+    it->second.next_due = monotonic_ns();
+}
+
+// The Amiga end of a push stream, which gets the time the event was sent.
+static void on_push_data(const uint8_t *data, int length)
+{
+    if (length != sizeof(uint64_t))
+        return;
+
+    uint64_t sent_at;
+    memcpy(&sent_at, data, sizeof(sent_at));
+
+    ClassStats &cs = stats[CLASS_PUSH];
+    cs.requests++;
+    cs.latencies_us.push_back((uint32_t)((monotonic_ns() - sent_at) / 1000));
+}
+
+static void on_data(int s, const uint8_t *data, int length)
+{
+    if ((s & 1) == 0)
+    {
+        on_push_data(data, length);
+        return;
+    }
+
+    auto it = streams.find(s);
+    if (it == streams.end() || !it->second.busy)
+        return;
+
+    Stream &st = it->second;
+    uint64_t now = monotonic_ns();
+    uint32_t latency = (uint32_t)((now - st.sent_at) / 1000);
+
+    ClassStats &cs = stats[st.cls];
+    cs.requests++;
+    cs.latencies_us.push_back(latency);
+    if (st.cls == CLASS_AUDIO && latency > audio_period_ms * 1000)
+        cs.late++;
+
+    st.busy = false;
+}
+
+static void on_closed(int s)
+{
+    auto it = streams.find(s);
+    if (it == streams.end())
+        return;
+
+    int cls = it->second.cls;
+    streams.erase(it);
+    open_stream(cls);
+}
+
+static void on_reset(int s)
+{
+    resets_received++;
+    on_closed(s);
+}
+
+static void reset_storm()
+{
+    storms++;
+
+    std::vector<int> open;
+    for (auto &e : streams)
+        open.push_back(e.first);
+
+    for (int s : open)
+    {
+        int cls = streams[s].cls;
+        amiga->reset(s);
+        streams.erase(s);
+        resets_sent++;
+        open_stream(cls);
+    }
+}
+
+static void churn_one()
+{
+    std::vector<int> idle;
+    for (auto &e : streams)
+        if (e.second.connected && !e.second.busy)
+            idle.push_back(e.first);
+
+    if (idle.empty())
+        return;
+
+    int s = idle[rand() % idle.size()];
+    if (amiga->eos(s))
+    {
+        // The stream is re-opened when the EOS from the service arrives.
+        streams[s].connected = false;
+        streams[s].busy = true;
+        eos_sent++;
+    }
+}
+
+static void run()
+{
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + (uint64_t)(duration * 1e9);
+    uint64_t audio_period = (uint64_t)(audio_period_ms * 1e6);
+    uint64_t next_churn = churn_rate > 0 ? start + (uint64_t)(1e9 / churn_rate) : UINT64_MAX;
+    uint64_t next_storm = storm_interval > 0 ? start + (uint64_t)(storm_interval * 1e9) : UINT64_MAX;
+    uint64_t next_sample = start;
+
+    while (1)
+    {
+        uint64_t now = monotonic_ns();
+        if (now >= end)
+            break;
+
+        if (now >= next_sample)
+        {
+            read_daemon_memory();
+            next_sample = now + 1000000000ULL;
+        }
+
+        if (now >= next_churn)
+        {
+            churn_one();
+            next_churn += (uint64_t)(1e9 / churn_rate);
+        }
+
+        if (now >= next_storm)
+        {
+            reset_storm();
+            next_storm += (uint64_t)(storm_interval * 1e9);
+        }
+
+        uint64_t next_wakeup = std::min(std::min(end, next_sample), std::min(next_churn, next_storm));
+
+        for (size_t n = reopen_queue.size(); n != 0; n--)
+        {
+            int cls = reopen_queue.front();
+            reopen_queue.pop_front();
+            open_stream(cls);
+        }
+
+        for (auto &e : streams)
+        {
+            Stream &st = e.second;
+            if (!st.connected || st.busy)
+                continue;
+
+            if (st.cls == CLASS_AUDIO)
+            {
+                if (now >= st.next_due)
+                {
+                    send_request(e.first, st, now);
+                    st.next_due = std::max(st.next_due + audio_period, now);
+                }
+                next_wakeup = std::min(next_wakeup, st.next_due);
+            }
+            else
+                send_request(e.first, st, now);
+        }
+
+        for (auto &e : push_streams)
+        {
+            PushStream &ps = e.second;
+            if (!ps.connected)
+                continue;
+
+            if (now >= ps.next_due)
+            {
+                queue_msg(clients[CLASS_PUSH], MSG_DATA, e.first, &now, sizeof(now));
+                ps.next_due = std::max(ps.next_due + audio_period, now);
+            }
+            next_wakeup = std::min(next_wakeup, ps.next_due);
+        }
+
+        amiga->service();
+
+        struct pollfd pfds[1 + CLASS_COUNT];
+        pfds[0].fd = amiga->irq_fd();
+        pfds[0].events = POLLIN;
+        for (int i = 0; i < CLASS_COUNT; i++)
+        {
+            flush_client(clients[i]);
+            pfds[1 + i].fd = clients[i].fd;
+            pfds[1 + i].events = POLLIN | (clients[i].out.empty() ? 0 : POLLOUT);
+        }
+
+        now = monotonic_ns();
+        int timeout = next_wakeup > now ? (int)std::min<uint64_t>((next_wakeup - now + 999999) / 1000000, 100) : 0;
+        poll(pfds, 1 + CLASS_COUNT, timeout);
+
+        if (pfds[0].revents & POLLIN)
+            amiga->service();
+
+        for (int i = 0; i < CLASS_COUNT; i++)
+        {
+            if (pfds[1 + i].revents & POLLIN)
+                read_client(clients[i]);
+            flush_client(clients[i]);
+        }
+    }
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, int p)
+{
+    if (v.empty())
+        return 0;
+    return v[std::min(v.size() - 1, v.size() * p / 100)];
+}
+
+static void print_report(double elapsed)
+{
+    read_daemon_memory();
+
+    uint64_t mem_bytes = 0;
+    for (int i = 0; i < CLASS_COUNT; i++)
+        mem_bytes += clients[i].mem_bytes;
+
+    if (json_output)
+    {
+        printf("{\"seconds\": %.3f, \"streams\": %zu, \"connects\": %llu, \"connect_failures\": %llu, "
+                "\"resets_sent\": %llu, \"resets_received\": %llu, \"eos_sent\": %llu, \"storms\": %llu, "
+                "\"a2r_packets\": %llu, \"a2r_bytes\": %llu, \"r2a_packets\": %llu, \"r2a_bytes\": %llu, \"mem_bytes\": %llu, "
+                "\"daemon_rss_kb\": %ld, \"daemon_peak_rss_kb\": %ld, \"classes\": {",
+                elapsed, streams.size() + push_streams.size(), (unsigned long long)connects, (unsigned long long)connect_failures,
+                (unsigned long long)resets_sent, (unsigned long long)resets_received, (unsigned long long)eos_sent, (unsigned long long)storms,
+                (unsigned long long)amiga->packets_sent, (unsigned long long)amiga->bytes_sent,
+                (unsigned long long)amiga->packets_received, (unsigned long long)amiga->bytes_received,
+                (unsigned long long)mem_bytes, rss_kb, rss_peak_kb);
+    }
+    else
+    {
+        printf("Duration:           %.3f s\n", elapsed);
+        printf("Open streams:       %zu (%llu connects, %llu failed)\n", streams.size() + push_streams.size(), (unsigned long long)connects, (unsigned long long)connect_failures);
+        printf("Resets:             %llu sent, %llu received, %llu storms, %llu EOS churned\n",
+                (unsigned long long)resets_sent, (unsigned long long)resets_received, (unsigned long long)storms, (unsigned long long)eos_sent);
+        printf("A2R:                %llu packets, %.1f KB/s\n", (unsigned long long)amiga->packets_sent, amiga->bytes_sent / elapsed / 1024);
+        printf("R2A:                %llu packets, %.1f KB/s\n", (unsigned long long)amiga->packets_received, amiga->bytes_received / elapsed / 1024);
+        printf("Memory operations:  %.1f KB/s\n", mem_bytes / elapsed / 1024);
+        if (daemon_pid != 0)
+            printf("a314d memory:       %ld KB resident, %ld KB peak\n", rss_kb, rss_peak_kb);
+    }
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        ClassStats &cs = stats[i];
+        std::sort(cs.latencies_us.begin(), cs.latencies_us.end());
+        uint32_t max = cs.latencies_us.empty() ? 0 : cs.latencies_us.back();
+
+        if (json_output)
+            printf("%s\"%s\": {\"requests\": %llu, \"per_sec\": %.1f, \"late\": %llu, \"latency_us_p50\": %u, \"latency_us_p90\": %u, \"latency_us_p99\": %u, \"latency_us_max\": %u}",
+                    i ? ", " : "", class_names[i], (unsigned long long)cs.requests, cs.requests / elapsed, (unsigned long long)cs.late,
+                    percentile(cs.latencies_us, 50), percentile(cs.latencies_us, 90), percentile(cs.latencies_us, 99), max);
+        else
+            printf("%-6s %4d streams: %8llu requests (%.1f/s), latency us p50 %u p90 %u p99 %u max %u%s\n",
+                    class_names[i], class_streams[i], (unsigned long long)cs.requests, cs.requests / elapsed,
+                    percentile(cs.latencies_us, 50), percentile(cs.latencies_us, 90), percentile(cs.latencies_us, 99), max,
+                    i == CLASS_AUDIO ? (", " + std::to_string(cs.late) + " late").c_str() : "");
+    }
+
+    if (json_output)
+        printf("}}\n");
+}
+
+static void spawn_daemon()
+{
+    daemon_pid = fork();
+    if (daemon_pid == 0)
+    {
+        std::string port = std::to_string(server_port);
+        execl(spawn_path, spawn_path, "--virtual", board, "--port", port.c_str(), "/dev/null", (char *)nullptr);
+        fprintf(stderr, "Unable to start %s\n", spawn_path);
+        _exit(-1);
+    }
+}
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program);
+    fprintf(stderr, "  -b, --board NAME        virtual A314 board name (default loadgen)\n");
+    fprintf(stderr, "  -P, --port PORT         a314d client port (default 7110)\n");
+    fprintf(stderr, "  -s, --spawn PATH        start PATH as a314d on the virtual board\n");
+    fprintf(stderr, "  -p, --pid PID           report memory use of an already running a314d\n");
+    fprintf(stderr, "  -d, --duration SECONDS  length of the run (default 10)\n");
+    fprintf(stderr, "  -f, --fs N              a314fs-like request/response streams (default 16)\n");
+    fprintf(stderr, "  -a, --audio N           piaudio-like periodic streams (default 4)\n");
+    fprintf(stderr, "  -k, --bulk N            remotewb-like bulk read streams (default 2)\n");
+    fprintf(stderr, "  -u, --push N            streams opened from the Pi that push an event every period (default 0)\n");
+    fprintf(stderr, "  -t, --period MS         audio and push period (default 20)\n");
+    fprintf(stderr, "  -c, --churn RATE        streams closed with EOS and re-opened per second\n");
+    fprintf(stderr, "  -r, --storm SECONDS     interval between RESET storms\n");
+    fprintf(stderr, "  -j, --json              print the report as JSON\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] =
+    {
+        {"board", required_argument, nullptr, 'b'},
+        {"port", required_argument, nullptr, 'P'},
+        {"spawn", required_argument, nullptr, 's'},
+        {"pid", required_argument, nullptr, 'p'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"fs", required_argument, nullptr, 'f'},
+        {"audio", required_argument, nullptr, 'a'},
+        {"bulk", required_argument, nullptr, 'k'},
+        {"push", required_argument, nullptr, 'u'},
+        {"period", required_argument, nullptr, 't'},
+        {"churn", required_argument, nullptr, 'c'},
+        {"storm", required_argument, nullptr, 'r'},
+        {"json", no_argument, nullptr, 'j'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:P:s:p:d:f:a:k:u:t:c:r:j", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': board = optarg; break;
+        case 'P': server_port = atoi(optarg); break;
+        case 's': spawn_path = optarg; break;
+        case 'p': daemon_pid = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'f': class_streams[CLASS_FS] = atoi(optarg); break;
+        case 'a': class_streams[CLASS_AUDIO] = atoi(optarg); break;
+        case 'k': class_streams[CLASS_BULK] = atoi(optarg); break;
+        case 'u': class_streams[CLASS_PUSH] = atoi(optarg); break;
+        case 't': audio_period_ms = atof(optarg); break;
+        case 'c': churn_rate = atof(optarg); break;
+        case 'r': storm_interval = atof(optarg); break;
+        case 'j': json_output = true; break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    int total = class_streams[CLASS_FS] + class_streams[CLASS_AUDIO] + class_streams[CLASS_BULK];
+    if (total > 128)
+    {
+        // The Amiga allocates odd 8-bit stream ids, so at most 128 logical
+        // channels can be open at the same time.
+        fprintf(stderr, "At most 128 streams can be open at the same time\n");
+        return -1;
+    }
+
+    // The streams that are opened from the Pi get the even stream ids.
+    if (class_streams[CLASS_PUSH] > 127)
+    {
+        fprintf(stderr, "At most 127 push streams can be open at the same time\n");
+        return -1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (spawn_path != nullptr)
+    {
+        VirtualA314::unlink(board);
+        spawn_daemon();
+    }
+
+    if (amiga_board.open(board, VIRTUAL_A314_AMIGA) != 0)
+    {
+        fprintf(stderr, "Unable to open virtual A314 %s\n", board);
+        return -1;
+    }
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        if (connect_client(clients[i], i) != 0)
+        {
+            fprintf(stderr, "Unable to connect to a314d on port %d\n", server_port);
+            if (daemon_pid != 0 && spawn_path != nullptr)
+                kill(daemon_pid, SIGTERM);
+            return -1;
+        }
+    }
+
+    amiga = new SimAmiga(amiga_board);
+    amiga->on_connect_response = on_connect_response;
+    amiga->on_data = on_data;
+    amiga->on_eos = on_closed;
+    amiga->on_reset = on_reset;
+    amiga->listen((std::string("loadgen-") + class_names[CLASS_PUSH]).c_str());
+    amiga->start();
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        for (int j = 0; j < class_streams[i]; j++)
+        {
+            if (i == CLASS_PUSH)
+                open_push_stream();
+            else
+                open_stream(i);
+        }
+    }
+
+    uint64_t start = monotonic_ns();
+    run();
+    print_report((monotonic_ns() - start) / 1e9);
+
+    if (spawn_path != nullptr)
+    {
+        kill(daemon_pid, SIGTERM);
+        waitpid(daemon_pid, nullptr, 0);
+        VirtualA314::unlink(board);
+    }
+
+    return 0;
+}
@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#include <string.h>
+
+#include "sim_amiga.h"
+
+// Offsets in the communication area.
+#define A2R_TAIL_OFFSET         0
+#define R2A_HEAD_OFFSET         1
+#define R2A_TAIL_OFFSET         2
+#define A2R_HEAD_OFFSET         3
+#define A2R_BUFFER_OFFSET       4
+#define R2A_BUFFER_OFFSET       260
+#define COM_AREA_SIZE           516
+
+#define LEGACY_RING_SIZE        256
+
+// Offsets in a ring pair's pointers in the extended area, with 16 bit big
+// endian pointers that are each followed by their complement. The pointers
+// of all pairs come first, then the A2R and R2A ring of each pair.
+#define EXT_A2R_TAIL_OFFSET     0
+#define EXT_R2A_HEAD_OFFSET     4
+#define EXT_R2A_TAIL_OFFSET     8
+#define EXT_A2R_HEAD_OFFSET     12
+#define EXT_POINTERS_LEN        16
+
+// Payload of PKT_SETTINGS; see a314d.cc.
+#define SETTINGS_OFFER          1
+#define SETTINGS_ACCEPT         2
+#define SETTINGS_REFUSE         3
+#define SETTINGS_SWITCHED       4
+#define SETTINGS_WINDOW         5
+#define SETTINGS_LISTEN         6
+
+#define SETTINGS_VERSION        1
+
+#define SETTINGS_FLAG_JUMBO     1
+#define SETTINGS_FLAG_QOS       2
+#define SETTINGS_FLAG_CREDIT    4
+
+// Addresses to variables in CMEM.
+#define R_EVENTS_ADDRESS        12
+#define A_EVENTS_ADDRESS        14
+#define A_ENABLE_ADDRESS        15
+
+// Events that are communicated via IRQ from Amiga to Raspberry.
+#define R_EVENT_A2R_TAIL        1
+#define R_EVENT_R2A_HEAD        2
+#define R_EVENT_BASE_ADDRESS    4
+
+// Events that are communicated from Raspberry to Amiga.
+#define A_EVENT_R2A_TAIL        1
+#define A_EVENT_A2R_HEAD        2
+
+SimAmiga::SimAmiga(VirtualA314 &board, unsigned int com_area)
+    : packets_sent(0), packets_received(0), bytes_sent(0), bytes_received(0), irqs_raised(0), credit_stalls(0),
+      board_(board), com_area_(com_area), next_stream_id_(1), queued_packets_(0), held_bytes_(0),
+      a2r_count_(1), r2a_count_(1), offer_a2r_log2_(0), offer_r2a_log2_(0), offer_jumbo_(false), offer_qos_(false),
+      offer_credit_(false), offer_outstanding_(false), offer_window_size_(0), credit_(false), switch_a2r_count_(0)
+{
+    a2r_[0] = {false, false, LEGACY_RING_SIZE, 0, A2R_BUFFER_OFFSET};
+    r2a_[0] = {false, false, LEGACY_RING_SIZE, 0, R2A_BUFFER_OFFSET};
+}
+
+static int ring_log2(int size)
+{
+    int log2 = 0;
+    while ((1 << log2) < size)
+        log2++;
+    return log2;
+}
+
+void SimAmiga::offer_rings(int a2r_size, int r2a_size, bool jumbo, bool qos, bool credit)
+{
+    offer_a2r_log2_ = a2r_size ? ring_log2(a2r_size) : 0;
+    offer_r2a_log2_ = r2a_size ? ring_log2(r2a_size) : 0;
+    offer_jumbo_ = jumbo;
+    offer_qos_ = qos;
+    offer_credit_ = credit;
+}
+
+void SimAmiga::offer_window(int size)
+{
+    offer_window_size_ = size;
+}
+
+int SimAmiga::max_payload() const
+{
+    // Packets that are queued after SWITCHED go to the extended A2R.
+    const Ring &ring = switch_a2r_count_ != 0 ? switch_a2r_[0] : a2r_[0];
+    return ring.jumbo ? ring.size - 1 - 4 : SIM_MAX_PAYLOAD;
+}
+
+SimAmiga::Ring SimAmiga::ext_ring(int pair, int pairs, bool r2a, bool jumbo)
+{
+    int a2r_size = 1 << offer_a2r_log2_;
+    int r2a_size = 1 << offer_r2a_log2_;
+
+    Ring ring;
+    ring.extended = true;
+    ring.jumbo = jumbo;
+    ring.size = r2a ? r2a_size : a2r_size;
+    ring.pointers = pair * EXT_POINTERS_LEN;
+    ring.buffer = SIM_AMIGA_EXT_AREA_OFFSET + pairs * EXT_POINTERS_LEN + pair * (a2r_size + r2a_size) + (r2a ? a2r_size : 0);
+    return ring;
+}
+
+int SimAmiga::read_pointer(const Ring &ring, int legacy_offset, int ext_offset)
+{
+    if (!ring.extended)
+        return ca()[legacy_offset];
+
+    // a314d writes the pointers over SPI a byte at a time. A pointer that
+    // doesn't match its complement is read again.
+    volatile uint8_t *p = ext() + ring.pointers + ext_offset;
+    while (true)
+    {
+        uint8_t hi = p[0];
+        uint8_t lo = p[1];
+        uint8_t check_hi = p[2];
+        uint8_t check_lo = p[3];
+        if ((uint8_t)~hi == check_hi && (uint8_t)~lo == check_lo)
+            return (hi << 8) | lo;
+    }
+}
+
+void SimAmiga::write_pointer(const Ring &ring, int legacy_offset, int ext_offset, int value)
+{
+    if (!ring.extended)
+        ca()[legacy_offset] = value;
+    else
+    {
+        volatile uint8_t *p = ext() + ring.pointers + ext_offset;
+        p[0] = value >> 8;
+        p[1] = value;
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        p[2] = ~value >> 8;
+        p[3] = ~value;
+    }
+}
+
+int SimAmiga::used_in_a2r(int i)
+{
+    int tail = read_pointer(a2r_[i], A2R_TAIL_OFFSET, EXT_A2R_TAIL_OFFSET);
+    int head = read_pointer(a2r_[i], A2R_HEAD_OFFSET, EXT_A2R_HEAD_OFFSET);
+    return (tail - head) & (a2r_[i].size - 1);
+}
+
+int SimAmiga::used_in_r2a(int i)
+{
+    int tail = read_pointer(r2a_[i], R2A_TAIL_OFFSET, EXT_R2A_TAIL_OFFSET);
+    int head = read_pointer(r2a_[i], R2A_HEAD_OFFSET, EXT_R2A_HEAD_OFFSET);
+    return (tail - head) & (r2a_[i].size - 1);
+}
+
+bool SimAmiga::r2a_empty()
+{
+    for (int i = 0; i < r2a_count_; i++)
+        if (used_in_r2a(i) != 0)
+            return false;
+    return true;
+}
+
+void SimAmiga::start()
+{
+    board_.write_cp_nibble(A_ENABLE_ADDRESS, 0);
+    board_.read_cp_nibble(A_EVENTS_ADDRESS);
+
+    sockets_.clear();
+    for (auto &sq : send_queue_)
+        sq.clear();
+    settings_queue_.clear();
+    queued_packets_ = 0;
+    held_bytes_ = 0;
+
+    a2r_[0] = {false, false, LEGACY_RING_SIZE, 0, A2R_BUFFER_OFFSET};
+    r2a_[0] = {false, false, LEGACY_RING_SIZE, 0, R2A_BUFFER_OFFSET};
+    a2r_count_ = 1;
+    r2a_count_ = 1;
+    switch_a2r_count_ = 0;
+    offer_outstanding_ = false;
+    credit_ = false;
+
+    memset((void *)ca(), 0, COM_AREA_SIZE);
+
+    // The window goes ahead of the offer, in the legacy A2R, though a314d
+    // would take it in any ring.
+    if (offer_window_size_ != 0)
+    {
+        unsigned int address = SIM_AMIGA_WINDOW_ADDRESS;
+        unsigned int size = offer_window_size_;
+        settings_queue_.push_back({SETTINGS_WINDOW, (uint8_t)(address >> 24), (uint8_t)(address >> 16), (uint8_t)(address >> 8),
+                (uint8_t)address, (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size});
+    }
+
+    if (!services_.empty())
+        settings_queue_.push_back({SETTINGS_LISTEN});
+
+    if (offer_a2r_log2_ != 0 && offer_r2a_log2_ != 0)
+    {
+        int pairs = offer_qos_ ? SIM_QOS_CLASSES : 1;
+        memset((void *)ext(), 0, pairs * (EXT_POINTERS_LEN + (1 << offer_a2r_log2_) + (1 << offer_r2a_log2_)));
+        for (int pair = 0; pair < pairs; pair++)
+        {
+            Ring ring = ext_ring(pair, pairs, false, false);
+            for (int offset = 0; offset < EXT_POINTERS_LEN; offset += 4)
+                write_pointer(ring, 0, offset, 0);
+        }
+
+        unsigned int address = com_area_ + SIM_AMIGA_EXT_AREA_OFFSET;
+        uint8_t flags = (offer_jumbo_ ? SETTINGS_FLAG_JUMBO : 0) | (offer_qos_ ? SETTINGS_FLAG_QOS : 0) |
+                (offer_credit_ ? SETTINGS_FLAG_CREDIT : 0);
+        std::vector<uint8_t> offer = {SETTINGS_OFFER, SETTINGS_VERSION, (uint8_t)offer_a2r_log2_, (uint8_t)offer_r2a_log2_, flags,
+                (uint8_t)(address >> 24), (uint8_t)(address >> 16), (uint8_t)(address >> 8), (uint8_t)address};
+        settings_queue_.push_back(offer);
+        offer_outstanding_ = true;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    unsigned int ba = com_area_ | 1;
+    board_.write_cp_nibble(0, 0);
+    for (int i = 4; i >= 0; i--)
+        board_.write_cp_nibble(i, (ba >> (i * 4)) & 0xf);
+
+    board_.write_cp_nibble(R_EVENTS_ADDRESS, R_EVENT_BASE_ADDRESS);
+    board_.write_cp_nibble(A_ENABLE_ADDRESS, A_EVENT_R2A_TAIL);
+    irqs_raised++;
+}
+
+int SimAmiga::header_length(const Ring &ring)
+{
+    return ring.jumbo ? 4 : 3;
+}
+
+void SimAmiga::append_a2r_packet(int pair, uint8_t type, uint8_t stream_id, const uint8_t *data, int length)
+{
+    const Ring &ring = a2r_[pair];
+    volatile uint8_t *buf = ca() + ring.buffer;
+    int mask = ring.size - 1;
+    int index = read_pointer(ring, A2R_TAIL_OFFSET, EXT_A2R_TAIL_OFFSET);
+
+    if (ring.jumbo)
+    {
+        buf[index] = length >> 8;
+        index = (index + 1) & mask;
+    }
+    buf[index] = length;
+    index = (index + 1) & mask;
+    buf[index] = type;
+    index = (index + 1) & mask;
+    buf[index] = stream_id;
+    index = (index + 1) & mask;
+    for (int i = 0; i < length; i++)
+    {
+        buf[index] = data[i];
+        index = (index + 1) & mask;
+    }
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    write_pointer(ring, A2R_TAIL_OFFSET, EXT_A2R_TAIL_OFFSET, index);
+
+    packets_sent++;
+    bytes_sent += length;
+}
+
+void SimAmiga::enqueue(int socket, uint8_t type, const uint8_t *data, int length)
+{
+    Socket &s = sockets_[socket];
+
+    s.queue.emplace_back();
+    Packet &p = s.queue.back();
+    p.type = type;
+    p.data.assign(data, data + length);
+    queued_packets_++;
+
+    if (!s.in_send_queue && !s.credit_stalled)
+    {
+        s.in_send_queue = true;
+        send_queue_[s.ring].push_back(socket);
+    }
+}
+
+// Like a314d, the Amiga gives credit back ahead of what the socket has
+// queued, and not after a314d has sent EOS.
+void SimAmiga::give_credit(int socket, int length)
+{
+    auto it = sockets_.find(socket);
+    if (it == sockets_.end())
+        return;
+
+    Socket &s = it->second;
+    if (!s.flow_control || s.rcvd_eos)
+        return;
+
+    s.consumed += length;
+    if (s.consumed < SIM_CREDIT_GRANT_MIN)
+        return;
+
+    uint32_t credit = s.consumed;
+    s.consumed = 0;
+
+    if (!s.queue.empty() && s.queue.front().type == SIM_PKT_CREDIT)
+    {
+        std::vector<uint8_t> &d = s.queue.front().data;
+        credit += (d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+        d = {(uint8_t)(credit >> 24), (uint8_t)(credit >> 16), (uint8_t)(credit >> 8), (uint8_t)credit};
+        return;
+    }
+
+    s.queue.emplace_front();
+    Packet &p = s.queue.front();
+    p.type = SIM_PKT_CREDIT;
+    p.data = {(uint8_t)(credit >> 24), (uint8_t)(credit >> 16), (uint8_t)(credit >> 8), (uint8_t)credit};
+    queued_packets_++;
+
+    s.credit_stalled = false;
+    if (!s.in_send_queue)
+    {
+        s.in_send_queue = true;
+        send_queue_[s.ring].push_back(socket);
+    }
+}
+
+void SimAmiga::handle_credit(Socket &s, int socket, const uint8_t *data, int length)
+{
+    if (length < 4 || !s.flow_control)
+        return;
+
+    s.send_credit += (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+
+    if (s.credit_stalled && s.send_credit >= (int)s.queue.front().data.size())
+    {
+        s.credit_stalled = false;
+        s.in_send_queue = true;
+        send_queue_[s.ring].push_back(socket);
+    }
+}
+
+int SimAmiga::connect(const char *service, int qos_class)
+{
+    // Like the driver, the Amiga allocates odd stream ids. The even ones are
+    // a314d's.
+    int stream_id = -1;
+    for (int i = 0; i < 128 && stream_id == -1; i++)
+    {
+        if (sockets_.find(next_stream_id_) == sockets_.end())
+            stream_id = next_stream_id_;
+        next_stream_id_ += 2;
+    }
+    if (stream_id == -1)
+        return -1;
+
+    Socket &s = sockets_[stream_id];
+    s.connected = false;
+    s.sent_eos = false;
+    s.rcvd_eos = false;
+    s.in_send_queue = false;
+    s.flow_control = false;
+    s.send_credit = SIM_CHANNEL_WINDOW;
+    s.consumed = 0;
+    s.credit_stalled = false;
+    s.paused = false;
+    s.eos_held = false;
+    s.ring = qos_class >= 0 && qos_class < a2r_count_ ? qos_class : SIM_QOS_CONTROL;
+
+    int len = strlen(service);
+    if (len > SIM_MAX_PAYLOAD)
+        len = SIM_MAX_PAYLOAD;
+    enqueue(stream_id, SIM_PKT_CONNECT, (const uint8_t *)service, len);
+    return stream_id;
+}
+
+bool SimAmiga::write(int socket, const uint8_t *data, int length)
+{
+    auto it = sockets_.find(socket);
+    if (it == sockets_.end() || it->second.sent_eos || length > max_payload())
+        return false;
+
+    enqueue(socket, SIM_PKT_DATA, data, length);
+    return true;
+}
+
+bool SimAmiga::eos(int socket)
+{
+    auto it = sockets_.find(socket);
+    if (it == sockets_.end() || it->second.sent_eos)
+        return false;
+
+    it->second.sent_eos = true;
+    enqueue(socket, SIM_PKT_EOS, nullptr, 0);
+    return true;
+}
+
+void SimAmiga::reset(int socket)
+{
+    auto it = sockets_.find(socket);
+    if (it == sockets_.end())
+        return;
+
+    queued_packets_ -= it->second.queue.size();
+    it->second.queue.clear();
+    it->second.credit_stalled = false;
+    it->second.sent_eos = true;
+
+    // The socket is deleted once the RESET packet has been sent.
+    enqueue(socket, SIM_PKT_RESET, nullptr, 0);
+}
+
+// a314d learns that the Amiga listens from the first service; start() tells
+// it again.
+void SimAmiga::listen(const char *service)
+{
+    if (services_.empty())
+        settings_queue_.push_back({SETTINGS_LISTEN});
+    services_.insert(service);
+}
+
+void SimAmiga::pause(int socket, bool paused)
+{
+    auto it = sockets_.find(socket);
+    if (it == sockets_.end() || it->second.paused == paused)
+        return;
+
+    it->second.paused = paused;
+    if (paused)
+        return;
+
+    std::deque<std::vector<uint8_t>> held = std::move(it->second.held);
+    it->second.held.clear();
+    bool eos = it->second.eos_held;
+    for (auto &d : held)
+        held_bytes_ -= d.size();
+
+    // on_data may close the socket.
+    for (auto &d : held)
+    {
+        if (sockets_.find(socket) == sockets_.end())
+            return;
+        if (on_data)
+            on_data(socket, d.data(), d.size());
+        give_credit(socket, d.size());
+    }
+
+    if (eos && sockets_.find(socket) != sockets_.end())
+        handle_eos(socket);
+}
+
+void SimAmiga::delete_socket(int socket)
+{
+    auto it = sockets_.find(socket);
+    if (it == sockets_.end())
+        return;
+
+    for (auto &d : it->second.held)
+        held_bytes_ -= d.size();
+    queued_packets_ -= it->second.queue.size();
+    if (it->second.in_send_queue)
+    {
+        auto &sq = send_queue_[it->second.ring];
+        sq.erase(std::find(sq.begin(), sq.end(), socket));
+    }
+    sockets_.erase(it);
+}
+
+// Called for PKT_SETTINGS in R2A, which answers the offer from start().
+void SimAmiga::handle_settings(const uint8_t *data, int length)
+{
+    if (length < 4 || !offer_outstanding_)
+        return;
+
+    offer_outstanding_ = false;
+    if (data[0] != SETTINGS_ACCEPT)
+        return;
+
+    // ACCEPT was the last packet in the legacy R2A. A2R follows once SWITCHED
+    // has been written to the legacy A2R.
+    uint8_t flags = length >= 5 ? data[4] : 0;
+    bool jumbo = (flags & SETTINGS_FLAG_JUMBO) != 0;
+    credit_ = (flags & SETTINGS_FLAG_CREDIT) != 0;
+    int pairs = (flags & SETTINGS_FLAG_QOS) ? SIM_QOS_CLASSES : 1;
+
+    for (int pair = 0; pair < pairs; pair++)
+    {
+        r2a_[pair] = ext_ring(pair, pairs, true, jumbo);
+        switch_a2r_[pair] = ext_ring(pair, pairs, false, jumbo);
+    }
+    r2a_count_ = pairs;
+    switch_a2r_count_ = pairs;
+    settings_queue_.push_back({SETTINGS_SWITCHED});
+}
+
+void SimAmiga::handle_eos(int socket)
+{
+    Socket &s = sockets_[socket];
+    s.rcvd_eos = true;
+    bool done = s.sent_eos && s.queue.empty() && !s.in_send_queue;
+    if (done)
+        delete_socket(socket);
+    if (on_eos)
+        on_eos(socket);
+}
+
+// Called for PKT_CONNECT in R2A. A socket to a service that isn't listened
+// to only lives until its CONNECT_RESPONSE has been sent.
+void SimAmiga::handle_connect(int pair, int socket, const uint8_t *data, int length)
+{
+    if (sockets_.find(socket) != sockets_.end())
+        return;
+
+    Socket &s = sockets_[socket];
+    s.connected = false;
+    s.sent_eos = false;
+    s.rcvd_eos = false;
+    s.in_send_queue = false;
+    s.flow_control = false;
+    s.send_credit = SIM_CHANNEL_WINDOW;
+    s.consumed = 0;
+    s.credit_stalled = false;
+    s.paused = false;
+    s.eos_held = false;
+    s.ring = pair;
+
+    std::string service((const char *)data, length);
+    uint8_t result = services_.count(service) ? 0 : 3;
+    enqueue(socket, SIM_PKT_CONNECT_RESPONSE, &result, 1);
+
+    if (result != 0)
+        return;
+
+    s.connected = true;
+    if (on_connect)
+        on_connect(socket, service);
+}
+
+void SimAmiga::handle_packets_received_r2a()
+{
+    static uint8_t data[SIM_MAX_RING_SIZE];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // In order of QoS class. ACCEPT moves the rings, including the first.
+    for (int pair = 0; pair < r2a_count_; pair++)
+    {
+        while (used_in_r2a(pair) != 0)
+        {
+            const Ring &ring = r2a_[pair];
+            volatile uint8_t *buf = ca() + ring.buffer;
+            int mask = ring.size - 1;
+            int index = read_pointer(ring, R2A_HEAD_OFFSET, EXT_R2A_HEAD_OFFSET);
+
+            int len = 0;
+            if (ring.jumbo)
+            {
+                len = buf[index] << 8;
+                index = (index + 1) & mask;
+            }
+            len |= buf[index];
+            index = (index + 1) & mask;
+            uint8_t type = buf[index];
+            index = (index + 1) & mask;
+            uint8_t stream_id = buf[index];
+            index = (index + 1) & mask;
+
+            for (int i = 0; i < len; i++)
+            {
+                data[i] = buf[index];
+                index = (index + 1) & mask;
+            }
+
+            write_pointer(ring, R2A_HEAD_OFFSET, EXT_R2A_HEAD_OFFSET, index);
+
+            packets_received++;
+            bytes_received += len;
+
+            if (type == SIM_PKT_SETTINGS)
+            {
+                handle_settings(data, len);
+                continue;
+            }
+
+            if (type == SIM_PKT_CONNECT)
+            {
+                handle_connect(pair, stream_id, data, len);
+                continue;
+            }
+
+            auto it = sockets_.find(stream_id);
+            if (it == sockets_.end())
+                continue;
+
+            Socket &s = it->second;
+
+            if (type == SIM_PKT_RESET)
+            {
+                delete_socket(stream_id);
+                if (on_reset)
+                    on_reset(stream_id);
+            }
+            else if (type == SIM_PKT_CONNECT_RESPONSE)
+            {
+                int result = len == 1 ? data[0] : -1;
+                if (result == 0)
+                    s.connected = true;
+                else
+                    delete_socket(stream_id);
+
+                if (on_connect_response)
+                    on_connect_response(stream_id, result);
+            }
+            else if (type == SIM_PKT_DATA)
+            {
+                if (s.paused)
+                {
+                    s.held.emplace_back(data, data + len);
+                    held_bytes_ += len;
+                }
+                else
+                {
+                    if (on_data)
+                        on_data(stream_id, data, len);
+                    give_credit(stream_id, len);
+                }
+            }
+            else if (type == SIM_PKT_CREDIT)
+                handle_credit(s, stream_id, data, len);
+            else if (type == SIM_PKT_EOS)
+            {
+                if (s.paused)
+                    s.eos_held = true;
+                else
+                    handle_eos(stream_id);
+            }
+        }
+    }
+}
+
+bool SimAmiga::handle_room_in_a2r()
+{
+    while (!settings_queue_.empty())
+    {
+        std::vector<uint8_t> &p = settings_queue_.front();
+        if (used_in_a2r(0) + header_length(a2r_[0]) + (int)p.size() > a2r_[0].size - 1)
+            return false;
+
+        append_a2r_packet(0, SIM_PKT_SETTINGS, 0, p.data(), p.size());
+        bool switched = p[0] == SETTINGS_SWITCHED;
+        settings_queue_.pop_front();
+
+        if (switched)
+        {
+            for (int pair = 0; pair < switch_a2r_count_; pair++)
+                a2r_[pair] = switch_a2r_[pair];
+            a2r_count_ = switch_a2r_count_;
+            switch_a2r_count_ = 0;
+        }
+    }
+
+    // Each pair has its own A2R ring, so a full bulk ring doesn't hold up
+    // the other classes.
+    bool all_sent = true;
+    for (int pair = 0; pair < a2r_count_; pair++)
+    {
+        auto &sq = send_queue_[pair];
+        while (!sq.empty())
+        {
+            int socket = sq.front();
+            Socket &s = sockets_[socket];
+            Packet &p = s.queue.front();
+
+            if (p.type == SIM_PKT_DATA && s.flow_control && s.send_credit < (int)p.data.size())
+            {
+                sq.pop_front();
+                s.in_send_queue = false;
+                s.credit_stalled = true;
+                credit_stalls++;
+                continue;
+            }
+
+            if (used_in_a2r(pair) + header_length(a2r_[pair]) + (int)p.data.size() > a2r_[pair].size - 1)
+            {
+                all_sent = false;
+                break;
+            }
+
+            sq.pop_front();
+
+            uint8_t type = p.type;
+            bool refused = type == SIM_PKT_CONNECT_RESPONSE && p.data[0] != 0;
+            if (type == SIM_PKT_CONNECT || type == SIM_PKT_CONNECT_RESPONSE)
+                s.flow_control = a2r_[pair].extended && credit_;
+            else if (type == SIM_PKT_DATA && s.flow_control)
+                s.send_credit -= p.data.size();
+            append_a2r_packet(pair, type, socket, p.data.data(), p.data.size());
+            s.queue.pop_front();
+            queued_packets_--;
+
+            if (type == SIM_PKT_RESET || refused || (type == SIM_PKT_EOS && s.rcvd_eos))
+            {
+                s.in_send_queue = false;
+                delete_socket(socket);
+            }
+            else if (!s.queue.empty())
+                sq.push_back(socket);
+            else
+                s.in_send_queue = false;
+        }
+    }
+    return all_sent;
+}
+
+void SimAmiga::service()
+{
+    board_.drain_irq();
+
+    // Counted rather than compared, as the pointers move when the rings do.
+    uint64_t prev_sent = packets_sent;
+    uint64_t prev_received = packets_received;
+
+    uint8_t a_enable = 0;
+    while (a_enable == 0)
+    {
+        handle_packets_received_r2a();
+        bool all_sent = handle_room_in_a2r();
+
+        uint8_t r_events = 0;
+        if (packets_sent != prev_sent)
+            r_events |= R_EVENT_A2R_TAIL;
+        if (packets_received != prev_received)
+            r_events |= R_EVENT_R2A_HEAD;
+
+        board_.read_cp_nibble(A_EVENTS_ADDRESS);
+
+        if (r2a_empty())
+        {
+            a_enable = all_sent ? A_EVENT_R2A_TAIL : A_EVENT_R2A_TAIL | A_EVENT_A2R_HEAD;
+            board_.write_cp_nibble(A_ENABLE_ADDRESS, a_enable);
+            if (r_events != 0)
+            {
+                board_.write_cp_nibble(R_EVENTS_ADDRESS, r_events);
+                irqs_raised++;
+            }
+        }
+    }
+}
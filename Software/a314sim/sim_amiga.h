@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2018 Niklas Ekström
+ */
+
+#ifndef SIM_AMIGA_H
+#define SIM_AMIGA_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../a314d/virtual_a314.h"
+
+// Model of the Amiga side of the A314, playing the part of a314.device
+// (a314device/a314driver.c) against a VirtualA314 board. It places the
+// communication area in the board's SRAM, publishes the base address in
+// CMEM, and moves packets across the A2R and R2A rings exactly as the
+// driver does.
+//
+// The model is single threaded and event driven: the owner waits for
+// irq_fd() to become readable (or for its own timers), and then calls
+// service(). Calls to connect(), write(), eos() and reset() only queue
+// packets; they are moved to A2R by the next service().
+//
+// With offer_rings(), start() also offers a314d larger rings in an extended
+// area, with PKT_SETTINGS as described in a314d.cc, and each ring moves there
+// once the handshake has got that far. The extended area may have a ring
+// pair for each QoS class, and each socket then stays on the pair of the
+// class it was connected in. With per-channel flow control, sockets that
+// are opened in the extended rings may only have a window of DATA
+// outstanding, and a paused socket holds what it receives without giving
+// credit back, as an application that doesn't read would.
+//
+// With offer_window(), start() also reserves a transfer window, of which
+// a314d hands out slices to its clients.
+//
+// Services that listen() are offered to a314d's clients, which open sockets
+// to them with even stream ids, once PKT_SETTINGS LISTEN has told a314d
+// that the Amiga takes such sockets. Such a socket is accepted right away, on the
+// ring pair that the CONNECT came in on, and on_connect is called.
+
+#define SIM_AMIGA_COM_AREA      0x1000
+
+// Offset of the extended area from the communication area.
+#define SIM_AMIGA_EXT_AREA_OFFSET   0x400
+
+// Where the transfer window is, after the largest extended area.
+#define SIM_AMIGA_WINDOW_ADDRESS    0x40000
+#define SIM_MAX_WINDOW_SIZE         (VIRTUAL_A314_SRAM_SIZE - SIM_AMIGA_WINDOW_ADDRESS)
+
+// Packet types that are sent across the physical channel.
+#define SIM_PKT_SETTINGS            3
+#define SIM_PKT_CONNECT             4
+#define SIM_PKT_CONNECT_RESPONSE    5
+#define SIM_PKT_DATA                6
+#define SIM_PKT_EOS                 7
+#define SIM_PKT_RESET               8
+#define SIM_PKT_CREDIT              9
+
+// Largest payload that fits in a packet on the 256 byte rings.
+#define SIM_MAX_PAYLOAD             252
+
+// Largest ring that can be offered, and so the largest jumbo packet.
+#define SIM_MAX_RING_SIZE           16384
+
+// Per-channel flow control: the DATA bytes that may be outstanding on a
+// socket in each direction, and how many are given back at a time.
+#define SIM_CHANNEL_WINDOW          65536
+#define SIM_CREDIT_GRANT_MIN        16384
+
+// QoS classes, which are also the ring pairs, in order of priority.
+#define SIM_QOS_CONTROL             0
+#define SIM_QOS_INTERACTIVE         1
+#define SIM_QOS_BULK                2
+#define SIM_QOS_CLASSES             3
+
+class SimAmiga
+{
+public:
+    std::function<void(int socket, int result)> on_connect_response;
+    std::function<void(int socket, const std::string &service)> on_connect;
+    std::function<void(int socket, const uint8_t *data, int length)> on_data;
+    std::function<void(int socket)> on_eos;
+    std::function<void(int socket)> on_reset;
+
+    SimAmiga(VirtualA314 &board, unsigned int com_area = SIM_AMIGA_COM_AREA);
+
+    // Makes start() offer rings of these sizes, powers of two from 256 to
+    // 16384, and optionally jumbo packets in them, a ring pair for each QoS
+    // class and per-channel flow control. 0 keeps the legacy 256 byte rings
+    // without asking.
+    void offer_rings(int a2r_size, int r2a_size, bool jumbo = false, bool qos = false, bool credit = false);
+
+    // Makes start() offer a314d a transfer window of this many bytes, up to
+    // SIM_MAX_WINDOW_SIZE. 0 offers none.
+    void offer_window(int size);
+
+    // True from start() until a314d has answered the offer, and the Amiga
+    // has moved A2R if it was accepted.
+    bool negotiating() const { return offer_outstanding_ || !settings_queue_.empty(); }
+
+    // The largest payload that write() takes now. It grows once a314d has
+    // agreed to jumbo packets.
+    int max_payload() const;
+
+    // The current size of each ring, and the number of ring pairs.
+    int a2r_size() const { return a2r_[0].size; }
+    int r2a_size() const { return r2a_[0].size; }
+    int ring_pairs() const { return a2r_count_; }
+    bool flow_control() const { return credit_; }
+
+    // Clears the communication area and signals R_EVENT_BASE_ADDRESS, which
+    // makes a314d drop all logical channels, as when the Amiga reboots.
+    void start();
+
+    // Returns the socket (stream id) of the new logical channel, or -1 if
+    // all stream ids are in use. Without a ring pair for qos_class, which
+    // there isn't until negotiating() is over, the socket goes in the first
+    // pair, with control traffic.
+    int connect(const char *service, int qos_class = SIM_QOS_CONTROL);
+    bool write(int socket, const uint8_t *data, int length);
+    bool eos(int socket);
+    void reset(int socket);
+
+    // Accepts sockets from a314d to service from now on.
+    void listen(const char *service);
+
+    // While a socket is paused, the DATA it receives is held rather than
+    // passed to on_data, and no credit is given back for it.
+    void pause(int socket, bool paused);
+
+    void service();
+
+    int irq_fd() const { return board_.irq_fd(); }
+    size_t open_sockets() const { return sockets_.size(); }
+    size_t queued_packets() const { return queued_packets_; }
+    size_t held_bytes() const { return held_bytes_; }
+
+    // Counters, for load generators.
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t irqs_raised;
+    uint64_t credit_stalls;
+
+private:
+    struct Packet
+    {
+        uint8_t type;
+        std::vector<uint8_t> data;
+    };
+
+    struct Ring
+    {
+        bool extended;
+        bool jumbo;
+        int size;
+
+        // Offset of the ring's pair of pointers in the extended area, and of
+        // the ring itself in the communication area.
+        int pointers;
+        int buffer;
+    };
+
+    struct Socket
+    {
+        bool connected;
+        bool sent_eos;
+        bool rcvd_eos;
+        bool in_send_queue;
+        int ring;
+        std::deque<Packet> queue;
+
+        bool flow_control;
+        int send_credit;
+        int consumed;
+        bool credit_stalled;
+        bool paused;
+        bool eos_held;
+        std::deque<std::vector<uint8_t>> held;
+    };
+
+    volatile uint8_t *ca() { return board_.sram() + com_area_; }
+    volatile uint8_t *ext() { return ca() + SIM_AMIGA_EXT_AREA_OFFSET; }
+    int read_pointer(const Ring &ring, int legacy_offset, int ext_offset);
+    void write_pointer(const Ring &ring, int legacy_offset, int ext_offset, int value);
+    static int header_length(const Ring &ring);
+    int used_in_a2r(int i);
+    int used_in_r2a(int i);
+    bool r2a_empty();
+    Ring ext_ring(int pair, int pairs, bool r2a, bool jumbo);
+    void append_a2r_packet(int pair, uint8_t type, uint8_t stream_id, const uint8_t *data, int length);
+    void handle_settings(const uint8_t *data, int length);
+    void handle_eos(int socket);
+    void handle_connect(int pair, int socket, const uint8_t *data, int length);
+    void enqueue(int socket, uint8_t type, const uint8_t *data, int length);
+    void give_credit(int socket, int length);
+    void handle_credit(Socket &s, int socket, const uint8_t *data, int length);
+    void delete_socket(int socket);
+    void handle_packets_received_r2a();
+    bool handle_room_in_a2r();
+
+    VirtualA314 &board_;
+    unsigned int com_area_;
+    uint8_t next_stream_id_;
+    size_t queued_packets_;
+    size_t held_bytes_;
+
+    std::map<int, Socket> sockets_;
+    std::set<std::string> services_;
+    std::deque<int> send_queue_[SIM_QOS_CLASSES];
+
+    Ring a2r_[SIM_QOS_CLASSES];
+    Ring r2a_[SIM_QOS_CLASSES];
+    int a2r_count_;
+    int r2a_count_;
+    int offer_a2r_log2_;
+    int offer_r2a_log2_;
+    bool offer_jumbo_;
+    bool offer_qos_;
+    bool offer_credit_;
+    bool offer_outstanding_;
+    int offer_window_size_;
+
+    // Set once a314d has agreed to flow control, for sockets whose CONNECT
+    // goes in an extended A2R ring.
+    bool credit_;
+
+    // The A2R rings that are used once SWITCHED has been sent.
+    Ring switch_a2r_[SIM_QOS_CLASSES];
+    int switch_a2r_count_;
+
+    // PKT_SETTINGS packets, which go ahead of every socket.
+    std::deque<std::vector<uint8_t>> settings_queue_;
+};
+
+#endif